@@ -22,6 +22,8 @@
 #include <QVariant>
 #include <QByteArray>
 #include <QHash>
+#include <QSharedPointer>
+#include <QVector>
 #include <QDebug>
 
 namespace Sink {
@@ -96,5 +98,54 @@ private:
     QHash<QByteArray, QVariant> mValues;
     QList<QByteArray> mChanges;
 };
+
+/**
+ * Restricts an adaptor to a projection of its properties, and decodes each of them at most once.
+ *
+ * Properties outside of the projection are never read from the underlying adaptor.
+ */
+class ProjectedBufferAdaptor : public BufferAdaptor
+{
+public:
+    ProjectedBufferAdaptor(const QSharedPointer<BufferAdaptor> &adaptor, const QByteArrayList &properties)
+        : BufferAdaptor(), mAdaptor(adaptor), mProperties(properties), mValues(properties.size()), mDecoded(properties.size(), false)
+    {
+    }
+
+    virtual ~ProjectedBufferAdaptor()
+    {
+    }
+
+    virtual QVariant getProperty(const QByteArray &key) const
+    {
+        const auto index = mProperties.indexOf(key);
+        if (index < 0) {
+            return {};
+        }
+        if (!mDecoded.at(index)) {
+            mValues[index] = mAdaptor->getProperty(key);
+            mDecoded[index] = true;
+        }
+        return mValues.at(index);
+    }
+
+    virtual QByteArrayList availableProperties() const
+    {
+        const auto available = mAdaptor->availableProperties();
+        QByteArrayList properties;
+        for (const auto &property : mProperties) {
+            if (available.contains(property)) {
+                properties << property;
+            }
+        }
+        return properties;
+    }
+
+private:
+    QSharedPointer<BufferAdaptor> mAdaptor;
+    QByteArrayList mProperties;
+    mutable QVector<QVariant> mValues;
+    mutable QVector<bool> mDecoded;
+};
 }
 }
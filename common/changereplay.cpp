@@ -118,7 +118,8 @@ KAsync::Job<void> ChangeReplay::replayNextRevision()
                             DataStore::mainDatabase(mMainStoreTransaction, type)
                                 .scan(key,
                                     [&entityBuffer](const QByteArray &key, const QByteArray &value) -> bool {
-                                        entityBuffer = value;
+                                        //The replay may outlive the transaction, so we need a deep copy
+                                        entityBuffer = QByteArray(value.constData(), value.size());
                                         return false;
                                     },
                                     [this, key](const DataStore::Error &) { SinkErrorCtx(mLogCtx) << "Failed to read the entity buffer " << key; });
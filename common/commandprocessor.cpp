@@ -30,6 +30,7 @@
 #include "bufferutils.h"
 #include "definitions.h"
 #include "storage.h"
+#include "resourceconfig.h"
 
 #include "queuedcommand_generated.h"
 #include "revisionreplayed_generated.h"
@@ -38,18 +39,40 @@
 static int sBatchSize = 100;
 // This interval directly affects the roundtrip time of single commands
 static int sCommitInterval = 10;
+// The maximum time commits remain unsynced with group durability
+static int sDiskSyncInterval = 1000;
+// The maximum number of revisions that are cleaned up before the queues are processed
+static qint64 sCleanupBatchSize = 1000;
 
 
 using namespace Sink;
 using namespace Sink::Storage;
 
+static DataStore::Durability durabilityFromConfig(const QByteArray &instanceId)
+{
+    const auto durability = ResourceConfig::getConfiguration(instanceId).value("durability").toByteArray();
+    if (durability == "group") {
+        return DataStore::Group;
+    }
+    if (durability == "relaxed") {
+        return DataStore::Relaxed;
+    }
+    if (!durability.isEmpty() && durability != "strict") {
+        SinkWarning() << "Unknown durability: " << durability;
+    }
+    return DataStore::Strict;
+}
+
 CommandProcessor::CommandProcessor(Sink::Pipeline *pipeline, const QByteArray &instanceId, const Sink::Log::Context &ctx)
     : QObject(),
     mLogCtx(ctx.subContext("commandprocessor")),
     mPipeline(pipeline), 
     mUserQueue(Sink::storageLocation(), instanceId + ".userqueue"),
     mSynchronizerQueue(Sink::storageLocation(), instanceId + ".synchronizerqueue"),
-    mCommandQueues(QList<MessageQueue*>() << &mUserQueue << &mSynchronizerQueue), mProcessingLock(false), mLowerBoundRevision(0)
+    mCommandQueues(QList<MessageQueue*>() << &mUserQueue << &mSynchronizerQueue), mProcessingLock(false), mLowerBoundRevision(0), mCleanupPending(false),
+    mEnvironments(QByteArrayList() << instanceId << instanceId + ".userqueue" << instanceId + ".synchronizerqueue" << instanceId + ".changereplay" << instanceId + ".synchronization"),
+    mDurability(durabilityFromConfig(instanceId)),
+    mRelaxedSyncInProgress(false)
 {
     for (auto queue : mCommandQueues) {
         const bool ret = connect(queue, &MessageQueue::messageReady, this, &CommandProcessor::process);
@@ -59,6 +82,50 @@ CommandProcessor::CommandProcessor(Sink::Pipeline *pipeline, const QByteArray &i
     mCommitQueueTimer.setInterval(sCommitInterval);
     mCommitQueueTimer.setSingleShot(true);
     QObject::connect(&mCommitQueueTimer, &QTimer::timeout, &mUserQueue, &MessageQueue::commit);
+
+    // Relaxed durability only applies to bulk synchronizations, otherwise it's the same as group durability.
+    setDurability(mDurability == DataStore::Strict ? DataStore::Strict : DataStore::Group);
+    mDiskSyncTimer.setInterval(sDiskSyncInterval);
+    mDiskSyncTimer.setSingleShot(true);
+    QObject::connect(&mDiskSyncTimer, &QTimer::timeout, this, &CommandProcessor::syncToDisk);
+    if (mDurability == DataStore::Relaxed) {
+        QObject::connect(&mSynchronizerQueue, &MessageQueue::messageReady, this, [this]() {
+            if (!mRelaxedSyncInProgress) {
+                SinkTraceCtx(mLogCtx) << "Starting bulk synchronization with relaxed durability.";
+                mRelaxedSyncInProgress = true;
+                setDurability(DataStore::Relaxed);
+            }
+        });
+    }
+}
+
+CommandProcessor::~CommandProcessor()
+{
+    if (mDurability != DataStore::Strict) {
+        syncToDisk();
+    }
+}
+
+void CommandProcessor::setDurability(DataStore::Durability durability)
+{
+    for (const auto &environment : mEnvironments) {
+        DataStore::setDurability(Sink::storageLocation(), environment, durability);
+    }
+}
+
+void CommandProcessor::scheduleDiskSync()
+{
+    if (mDurability != DataStore::Strict && !mDiskSyncTimer.isActive()) {
+        mDiskSyncTimer.start();
+    }
+}
+
+void CommandProcessor::syncToDisk()
+{
+    mDiskSyncTimer.stop();
+    for (const auto &environment : mEnvironments) {
+        DataStore::syncToDisk(Sink::storageLocation(), environment);
+    }
 }
 
 static void enqueueCommand(MessageQueue &mq, int commandId, const QByteArray &data)
@@ -94,6 +161,7 @@ void CommandProcessor::processCommand(int commandId, const QByteArray &data)
             } else {
                 mCommitQueueTimer.start();
             }
+            scheduleDiskSync();
         }
     };
 }
@@ -173,6 +241,9 @@ void CommandProcessor::process()
                         mProcessingLock = false;
                         if (messagesToProcessAvailable()) {
                             process();
+                        } else if (mCleanupPending) {
+                            //Continue the cleanup once the event loop had a chance to deliver new commands
+                            QTimer::singleShot(0, this, &CommandProcessor::process);
                         }
                     })
                     .exec();
@@ -251,15 +322,26 @@ KAsync::Job<void> CommandProcessor::processQueue(MessageQueue *queue)
                             }
                         });
             }))
-        .then([this](const KAsync::Error &) { mPipeline->commit(); });
+        .then([this, queue](const KAsync::Error &) {
+            mPipeline->commit();
+            if (mRelaxedSyncInProgress && queue == &mSynchronizerQueue) {
+                // The bulk synchronization has been processed, so we make it durable with a single sync
+                SinkTraceCtx(mLogCtx) << "Bulk synchronization processed, syncing to disk.";
+                mRelaxedSyncInProgress = false;
+                setDurability(DataStore::Group);
+                syncToDisk();
+            }
+            scheduleDiskSync();
+        });
 }
 
 KAsync::Job<void> CommandProcessor::processPipeline()
 {
     auto time = QSharedPointer<QTime>::create();
     time->start();
-    mPipeline->cleanupRevisions(mLowerBoundRevision);
-    SinkTraceCtx(mLogCtx) << "Cleanup done." << Log::TraceTime(time->elapsed());
+    //A large cleanup is split over multiple runs, so it doesn't block the processing of commands
+    mCleanupPending = !mPipeline->cleanupRevisions(mLowerBoundRevision, sCleanupBatchSize);
+    SinkTraceCtx(mLogCtx) << "Cleanup done." << (mCleanupPending ? "More pending." : "") << Log::TraceTime(time->elapsed());
 
     // Go through all message queues
     if (mCommandQueues.isEmpty()) {
@@ -29,6 +29,7 @@
 #include "log.h"
 #include "notification.h"
 #include "messagequeue.h"
+#include "storage.h"
 
 namespace Sink {
     class Pipeline;
@@ -46,6 +47,7 @@ class CommandProcessor : public QObject
 
 public:
     CommandProcessor(Sink::Pipeline *pipeline, const QByteArray &instanceId, const Sink::Log::Context &ctx);
+    ~CommandProcessor();
 
     void setOldestUsedRevision(qint64 revision);
 
@@ -78,6 +80,10 @@ private:
 
     KAsync::Job<void> flush(void const *command, size_t size);
 
+    void setDurability(Sink::Storage::DataStore::Durability durability);
+    void scheduleDiskSync();
+    void syncToDisk();
+
     Sink::Log::Context mLogCtx;
     Sink::Pipeline *mPipeline;
     MessageQueue mUserQueue;
@@ -87,9 +93,17 @@ private:
     bool mProcessingLock;
     // The lowest revision we no longer need
     qint64 mLowerBoundRevision;
+    // Set while revisions up to the lower bound revision remain to be cleaned up
+    bool mCleanupPending;
     QSharedPointer<Synchronizer> mSynchronizer;
     QSharedPointer<Inspector> mInspector;
     QTimer mCommitQueueTimer;
+    // The environments of the resource, which all share the durability
+    QByteArrayList mEnvironments;
+    Sink::Storage::DataStore::Durability mDurability;
+    // Set while a bulk synchronization is processed with relaxed durability
+    bool mRelaxedSyncInProgress;
+    QTimer mDiskSyncTimer;
 };
 
 };
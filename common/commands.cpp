@@ -67,6 +67,10 @@ QByteArray name(int commandId)
             return "Secret";
         case UpgradeCommand:
             return "Upgrade";
+        case CompactCommand:
+            return "Compact";
+        case StorageStatisticsCommand:
+            return "StorageStatistics";
         case CustomCommand:
             return "Custom";
     };
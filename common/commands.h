@@ -50,6 +50,8 @@ enum CommandIds
     FlushCommand,
     SecretCommand,
     UpgradeCommand,
+    CompactCommand,
+    StorageStatisticsCommand,
     CustomCommand = 0xffff
 };
 
@@ -18,6 +18,12 @@
  */
 #include "datastorequery.h"
 
+#include <QDataStream>
+#include <QTemporaryFile>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
 #include "log.h"
 #include "applicationdomaintype.h"
 
@@ -37,6 +43,14 @@ static QByteArray operationName(const Sink::Operation op)
     return "";
 }
 
+//The number of uids a full scan reads at once
+static const int sFullScanBatchSize = 500;
+//The number of entities of an index lookup that are read with a single sweep over the main database
+static const int sLookupBatchSize = 100;
+
+//The number of sort candidates that are kept in memory before they are spilled to disk
+static const int sSortSpillThreshold = 100000;
+
 class Source : public FilterBase {
     public:
     typedef QSharedPointer<Source> Ptr;
@@ -45,6 +59,18 @@ class Source : public FilterBase {
     QVector<QByteArray>::ConstIterator mIt;
     QVector<QByteArray> mIncrementalIds;
     QVector<QByteArray>::ConstIterator mIncrementalIt;
+    //A full scan reads the uids in batches, and resumes after the last uid it has read
+    bool mFullScan = false;
+    bool mFullScanComplete = false;
+    QByteArray mLastUid;
+    //Later batches are read in newer transactions, but everything that changed after the revision the scan started at
+    //is delivered by the incremental updates, so the scan reads the entities as they were at that revision.
+    qint64 mScanRevision = -1;
+    //The entities of an index lookup are read ahead in batches. They are only valid in the transaction they've been read in,
+    //so the batch is dropped when the state is used for another query.
+    QHash<QByteArray, QPair<Sink::ApplicationDomain::ApplicationDomainType, Sink::Operation>> mBatch;
+    int mBatchBegin = 0;
+    int mBatchEnd = 0;
 
     Source (const QVector<QByteArray> &ids, DataStoreQuery *store)
         : FilterBase(store),
@@ -54,15 +80,83 @@ class Source : public FilterBase {
 
     }
 
+    /*
+     * A source over all entities of the type.
+     */
+    Source (DataStoreQuery *store)
+        : FilterBase(store),
+        mIt(mIds.constBegin()),
+        mFullScan(true)
+    {
+
+    }
+
     virtual ~Source(){}
 
+    void fetchMore()
+    {
+        if (!mFullScan || mFullScanComplete || mIt != mIds.constEnd()) {
+            return;
+        }
+        if (mScanRevision < 0) {
+            mScanRevision = mDatastore->mStore.maxRevision();
+        }
+        mIds = mDatastore->readUids(mLastUid, sFullScanBatchSize);
+        mIt = mIds.constBegin();
+        mFullScanComplete = mIds.size() < sFullScanBatchSize;
+        if (!mIds.isEmpty()) {
+            mLastUid = mIds.last();
+        }
+    }
+
+    bool atEnd() const
+    {
+        return mIt == mIds.constEnd() && (!mFullScan || mFullScanComplete);
+    }
+
     virtual void skip() Q_DECL_OVERRIDE
     {
+        fetchMore();
         if (mIt != mIds.constEnd()) {
             mIt++;
         }
     };
 
+    //The scan revision is kept, so another pass doesn't read what the incremental updates have delivered
+    virtual void reset() Q_DECL_OVERRIDE
+    {
+        if (mFullScan) {
+            mIds.clear();
+            mFullScanComplete = false;
+            mLastUid.clear();
+        }
+        mIt = mIds.constBegin();
+    }
+
+    void dropBatch()
+    {
+        mBatch.clear();
+        mBatchBegin = 0;
+        mBatchEnd = 0;
+    }
+
+    void readBatched(const DataStoreQuery::BufferCallback &callback)
+    {
+        const int position = mIt - mIds.constBegin();
+        if (position < mBatchBegin || position >= mBatchEnd) {
+            dropBatch();
+            mBatchBegin = position;
+            mBatchEnd = qMin(position + sLookupBatchSize, mIds.size());
+            mDatastore->readLatestBatch(mIds.mid(mBatchBegin, mBatchEnd - mBatchBegin), [this](const Sink::ApplicationDomain::ApplicationDomainType &entity, Sink::Operation operation) {
+                mBatch.insert(entity.identifier(), qMakePair(entity, operation));
+            });
+        }
+        const auto it = mBatch.constFind(*mIt);
+        if (it != mBatch.constEnd()) {
+            callback(it->first, it->second);
+        }
+    }
+
     void add(const QVector<QByteArray> &ids)
     {
         mIncrementalIds = ids;
@@ -85,15 +179,21 @@ class Source : public FilterBase {
             }
             return true;
         } else {
+            fetchMore();
             if (mIt == mIds.constEnd()) {
                 return false;
             }
-            readEntity(*mIt, [this, callback](const Sink::ApplicationDomain::ApplicationDomainType &entity, Sink::Operation operation) {
+            const auto resultCallback = [this, callback](const Sink::ApplicationDomain::ApplicationDomainType &entity, Sink::Operation operation) {
                 SinkTraceCtx(mDatastore->mLogCtx) << "Source: Read entity: " << entity.identifier() << operationName(operation);
                 callback({entity, operation});
-            });
+            };
+            if (mFullScan) {
+                mDatastore->readEntity(*mIt, mScanRevision, resultCallback);
+            } else {
+                readBatched(resultCallback);
+            }
             mIt++;
-            return mIt != mIds.constEnd();
+            return !atEnd();
         }
     }
 };
@@ -173,6 +273,235 @@ public:
     }
 };
 
+static QByteArray toBigEndian(quint64 value)
+{
+    QByteArray result(sizeof(value), '\0');
+    for (int i = sizeof(value) - 1; i >= 0; i--) {
+        result[i] = static_cast<char>(value & 0xFF);
+        value >>= 8;
+    }
+    return result;
+}
+
+/*
+ * Returns a key that compares like @param value: dates with the newest first like the sorted indexes, everything else ascending.
+ * Invalid values sort last.
+ */
+static QByteArray sortKey(const QVariant &value)
+{
+    static const quint64 signBit = quint64{1} << 63;
+    switch (value.type()) {
+        case QVariant::Invalid:
+            return QByteArray(1, '\x01');
+        case QVariant::DateTime:
+            if (!value.toDateTime().isValid()) {
+                return QByteArray(1, '\x01');
+            }
+            return QByteArray(1, '\x00') + toBigEndian(~(static_cast<quint64>(value.toDateTime().toMSecsSinceEpoch()) ^ signBit));
+        case QVariant::Bool:
+        case QVariant::Int:
+        case QVariant::LongLong:
+            return QByteArray(1, '\x00') + toBigEndian(static_cast<quint64>(value.toLongLong()) ^ signBit);
+        case QVariant::UInt:
+        case QVariant::ULongLong:
+            return QByteArray(1, '\x00') + toBigEndian(value.toULongLong());
+        default:
+            break;
+    }
+    if (value.canConvert<Sink::ApplicationDomain::Reference>()) {
+        return QByteArray(1, '\x00') + value.value<Sink::ApplicationDomain::Reference>().value;
+    }
+    return QByteArray(1, '\x00') + value.toByteArray();
+}
+
+/*
+ * Sorts the results of the source by a property that has no sorted index.
+ *
+ * Only the sort key and the uid of the candidates are kept, the entities are read again when they are returned.
+ * With a limit every pass over the source keeps the top-k candidates after the last returned one in a bounded heap,
+ * so the next batch requires another pass, but no more than k candidates are ever kept.
+ * Without a limit all candidates are sorted in a single pass, and spilled to disk in sorted runs that are merged lazily if there are too many.
+ * Incremental updates are passed through unsorted, like with a sorted index.
+ */
+class Sort : public FilterBase {
+public:
+    typedef QSharedPointer<Sort> Ptr;
+
+    struct Candidate {
+        QByteArray key;
+        QByteArray uid;
+
+        bool operator<(const Candidate &other) const
+        {
+            return key < other.key || (key == other.key && uid < other.uid);
+        }
+    };
+
+    //A sorted run of candidates that has been spilled to disk
+    struct Run {
+        QTemporaryFile file;
+        QDataStream stream;
+        Candidate head;
+
+        bool advance()
+        {
+            if (stream.atEnd()) {
+                return false;
+            }
+            stream >> head.key >> head.uid;
+            return stream.status() == QDataStream::Ok;
+        }
+    };
+
+    QByteArray mSortProperty;
+    std::size_t mLimit;
+    //The sorted candidates of the current pass and the next one to return
+    std::vector<Candidate> mSorted;
+    std::size_t mPos = 0;
+    //The spilled runs, as a heap ordered by their next candidate
+    std::vector<std::unique_ptr<Run>> mRuns;
+    bool mSpillFailed = false;
+    //A further pass only considers the candidates after the last returned one
+    Candidate mBoundary;
+    bool mHasBoundary = false;
+    bool mStarted = false;
+    bool mComplete = false;
+
+    Sort(const QByteArray &sortProperty, int limit, FilterBase::Ptr source, DataStoreQuery *store)
+        : FilterBase(source, store),
+        mSortProperty(sortProperty),
+        mLimit(qMax(limit, 0))
+    {
+
+    }
+
+    virtual ~Sort(){}
+
+    static bool runGreater(const std::unique_ptr<Run> &left, const std::unique_ptr<Run> &right)
+    {
+        return right->head < left->head;
+    }
+
+    void spill(std::vector<Candidate> &candidates)
+    {
+        std::sort(candidates.begin(), candidates.end());
+        std::unique_ptr<Run> run{new Run};
+        if (!run->file.open()) {
+            SinkWarningCtx(mDatastore->mLogCtx) << "Failed to spill the sort candidates, sorting in memory: " << run->file.errorString();
+            mSpillFailed = true;
+            return;
+        }
+        run->stream.setDevice(&run->file);
+        for (const auto &candidate : candidates) {
+            run->stream << candidate.key << candidate.uid;
+        }
+        run->file.seek(0);
+        SinkTraceCtx(mDatastore->mLogCtx) << "Spilled " << candidates.size() << " sort candidates to " << run->file.fileName();
+        candidates.clear();
+        if (run->advance()) {
+            mRuns.push_back(std::move(run));
+        }
+    }
+
+    void fill()
+    {
+        if (mStarted) {
+            mSource->reset();
+        }
+        mStarted = true;
+        std::vector<Candidate> candidates;
+        const auto consider = [&](const ResultSet::Result &result) {
+            if (result.operation == Sink::Operation_Removal) {
+                return;
+            }
+            Candidate candidate{sortKey(result.entity.getProperty(mSortProperty)), result.entity.identifier()};
+            if (mHasBoundary && !(mBoundary < candidate)) {
+                return;
+            }
+            if (!mLimit) {
+                candidates.push_back(candidate);
+                if (candidates.size() >= static_cast<std::size_t>(sSortSpillThreshold) && !mSpillFailed) {
+                    spill(candidates);
+                }
+            } else if (candidates.size() < mLimit) {
+                candidates.push_back(candidate);
+                std::push_heap(candidates.begin(), candidates.end());
+            } else if (candidate < candidates.front()) {
+                //Replace the largest of the top-k candidates
+                std::pop_heap(candidates.begin(), candidates.end());
+                candidates.back() = candidate;
+                std::push_heap(candidates.begin(), candidates.end());
+            }
+        };
+        while (mSource->next(consider)) {}
+
+        if (mLimit) {
+            std::sort_heap(candidates.begin(), candidates.end());
+            //A pass that doesn't fill the heap has seen all remaining candidates
+            mComplete = candidates.size() < mLimit;
+        } else {
+            if (!mRuns.empty() && !candidates.empty()) {
+                spill(candidates);
+            }
+            std::sort(candidates.begin(), candidates.end());
+            std::make_heap(mRuns.begin(), mRuns.end(), runGreater);
+            mComplete = true;
+        }
+        SinkTraceCtx(mDatastore->mLogCtx) << "Sorted " << candidates.size() << " candidates in memory and " << mRuns.size() << " runs on disk.";
+        mSorted = std::move(candidates);
+        mPos = 0;
+    }
+
+    bool takeNext(Candidate &candidate)
+    {
+        if (!mStarted || (mPos >= mSorted.size() && mRuns.empty() && !mComplete)) {
+            fill();
+        }
+        if (!mRuns.empty()) {
+            std::pop_heap(mRuns.begin(), mRuns.end(), runGreater);
+            candidate = mRuns.back()->head;
+            if (mRuns.back()->advance()) {
+                std::push_heap(mRuns.begin(), mRuns.end(), runGreater);
+            } else {
+                mRuns.pop_back();
+            }
+        } else if (mPos < mSorted.size()) {
+            candidate = mSorted[mPos++];
+        } else {
+            return false;
+        }
+        mBoundary = candidate;
+        mHasBoundary = true;
+        return true;
+    }
+
+    void skip() Q_DECL_OVERRIDE
+    {
+        if (mIncremental) {
+            mSource->skip();
+            return;
+        }
+        Candidate candidate;
+        takeNext(candidate);
+    }
+
+    bool next(const std::function<void(const ResultSet::Result &result)> &callback) Q_DECL_OVERRIDE
+    {
+        if (mIncremental) {
+            return mSource->next(callback);
+        }
+        Candidate candidate;
+        if (!takeNext(candidate)) {
+            return false;
+        }
+        readEntity(candidate.uid, [&](const Sink::ApplicationDomain::ApplicationDomainType &entity, Sink::Operation operation) {
+            SinkTraceCtx(mDatastore->mLogCtx) << "Sort: " << entity.identifier() << operationName(operation);
+            callback({entity, operation});
+        });
+        return true;
+    }
+};
+
 class Reduce : public Filter {
 public:
     typedef QSharedPointer<Reduce> Ptr;
@@ -416,11 +745,12 @@ public:
     bool mBloomed = false;
 };
 
-DataStoreQuery::DataStoreQuery(const Sink::QueryBase &query, const QByteArray &type, EntityStore &store)
+DataStoreQuery::DataStoreQuery(const Sink::QueryBase &query, const QByteArray &type, EntityStore &store, int limit, const QByteArrayList &requestedProperties)
     : mType(type), mStore(store), mLogCtx(store.logContext().subContext("datastorequery"))
 {
     //This is what we use during a new query
-    setupQuery(query);
+    setupProjection(query, requestedProperties);
+    setupQuery(query, limit);
 }
 
 DataStoreQuery::DataStoreQuery(const DataStoreQuery::State &state, const QByteArray &type, Sink::Storage::EntityStore &store, bool incremental)
@@ -430,6 +760,10 @@ DataStoreQuery::DataStoreQuery(const DataStoreQuery::State &state, const QByteAr
     //And this is what we use when the data changed and we want to update with incremental = true
     mCollector = state.mCollector;
     mSource = state.mSource;
+    mProjection = state.mProjection;
+    if (mSource) {
+        mSource->dropBatch();
+    }
 
     auto source = mCollector;
     while (source) {
@@ -449,12 +783,28 @@ DataStoreQuery::State::Ptr DataStoreQuery::getState()
     auto state = State::Ptr::create();
     state->mSource = mSource;
     state->mCollector = mCollector;
+    state->mProjection = mProjection;
     return state;
 }
 
 void DataStoreQuery::readEntity(const QByteArray &key, const BufferCallback &resultCallback)
 {
-    mStore.readLatest(mType, key, resultCallback);
+    mStore.readLatest(mType, key, mProjection, resultCallback);
+}
+
+void DataStoreQuery::readEntity(const QByteArray &key, qint64 maxRevision, const BufferCallback &resultCallback)
+{
+    //Only transactions that started later can see newer revisions
+    if (mStore.maxRevision() <= maxRevision) {
+        return readEntity(key, resultCallback);
+    }
+    mStore.readLatestUntil(mType, key, maxRevision, mProjection, resultCallback);
+}
+
+void DataStoreQuery::readLatestBatch(const QVector<QByteArray> &keys, const BufferCallback &resultCallback)
+{
+    //In key order, so the entities don't have to be kept until all have been read
+    mStore.readLatestBatch(mType, keys, mProjection, resultCallback, true);
 }
 
 void DataStoreQuery::readPrevious(const QByteArray &key, const std::function<void (const ApplicationDomain::ApplicationDomainType &)> &callback)
@@ -467,6 +817,11 @@ QVector<QByteArray> DataStoreQuery::indexLookup(const QByteArray &property, cons
     return mStore.indexLookup(mType, property, value);
 }
 
+QVector<QByteArray> DataStoreQuery::readUids(const QByteArray &lastUid, int limit)
+{
+    return mStore.readUids(mType, lastUid, limit);
+}
+
 /* ResultSet DataStoreQuery::filterAndSortSet(ResultSet &resultSet, const FilterFunction &filter, const QByteArray &sortProperty) */
 /* { */
 /*     const bool sortingRequired = !sortProperty.isEmpty(); */
@@ -560,7 +915,42 @@ QByteArrayList DataStoreQuery::executeSubquery(const QueryBase &subquery)
     return ids;
 }
 
-void DataStoreQuery::setupQuery(const Sink::QueryBase &query_)
+void DataStoreQuery::setupProjection(const Sink::QueryBase &query, const QByteArrayList &requestedProperties)
+{
+    //Without requested properties everything may be accessed
+    if (requestedProperties.isEmpty()) {
+        return;
+    }
+    auto projection = requestedProperties;
+    const auto addProperty = [&](const QByteArray &property) {
+        if (!property.isEmpty() && !projection.contains(property)) {
+            projection << property;
+        }
+    };
+    for (const auto &property : query.getBaseFilters().keys()) {
+        addProperty(property);
+    }
+    addProperty(query.sortProperty());
+    for (const auto &stage : query.getFilterStages()) {
+        if (auto filter = stage.dynamicCast<Query::Filter>()) {
+            for (const auto &property : filter->propertyFilter.keys()) {
+                addProperty(property);
+            }
+        } else if (auto filter = stage.dynamicCast<Query::Reduce>()) {
+            addProperty(filter->property);
+            addProperty(filter->selector.property);
+            for (const auto &aggregator : filter->aggregators) {
+                addProperty(aggregator.propertyToCollect);
+            }
+        } else if (auto filter = stage.dynamicCast<Query::Bloom>()) {
+            addProperty(filter->property);
+        }
+    }
+    SinkTraceCtx(mLogCtx) << "Projection: " << projection;
+    mProjection = projection;
+}
+
+void DataStoreQuery::setupQuery(const Sink::QueryBase &query_, int limit)
 {
     auto query = query_;
     auto baseFilters = query.getBaseFilters();
@@ -590,7 +980,8 @@ void DataStoreQuery::setupQuery(const Sink::QueryBase &query_)
                 return Source::Ptr::create(resultSet, this);
             }
             // We do a full scan if there were no indexes available to create the initial set (this is going to be expensive for large sets).
-            return Source::Ptr::create(mStore.fullScan(mType), this);
+            // The uids are read lazily, so the first results don't have to wait for the complete set.
+            return Source::Ptr::create(this);
         }
     }();
 
@@ -603,10 +994,11 @@ void DataStoreQuery::setupQuery(const Sink::QueryBase &query_)
         }
         baseSet = filter;
     }
-    /* if (appliedSorting.isEmpty() && !query.sortProperty.isEmpty()) { */
-    /*     //Apply manual sorting */
-    /*     baseSet = Sort::Ptr::create(baseSet, query.sortProperty); */
-    /* } */
+    if (appliedSorting.isEmpty() && !query.sortProperty().isEmpty()) {
+        //Apply manual sorting
+        SinkTraceCtx(mLogCtx) << "Sorting in memory according to property: " << query.sortProperty();
+        baseSet = Sort::Ptr::create(query.sortProperty(), limit, baseSet, this);
+    }
 
     //Setup the rest of the filter stages on top of the base set
     for (const auto &stage : query.getFilterStages()) {
@@ -28,6 +28,7 @@ class Source;
 class Bloom;
 class Reduce;
 class Filter;
+class Sort;
 class FilterBase;
 
 class DataStoreQuery {
@@ -36,6 +37,7 @@ class DataStoreQuery {
     friend class Bloom;
     friend class Reduce;
     friend class Filter;
+    friend class Sort;
 public:
     typedef QSharedPointer<DataStoreQuery> Ptr;
 
@@ -43,9 +45,17 @@ public:
         typedef QSharedPointer<State> Ptr;
         QSharedPointer<FilterBase> mCollector;
         QSharedPointer<Source> mSource;
+        QByteArrayList mProjection;
     };
 
-    DataStoreQuery(const Sink::QueryBase &query, const QByteArray &type, Sink::Storage::EntityStore &store);
+    /**
+     * If the query is sorted by a property without a sorted index, the results are sorted in memory.
+     * With a @param limit only the next @param limit results are kept while sorting, at the cost of another pass for every further batch.
+     *
+     * If @param requestedProperties are set, the entities only provide those and the properties the query needs to filter, sort and reduce,
+     * so no other property is ever decoded.
+     */
+    DataStoreQuery(const Sink::QueryBase &query, const QByteArray &type, Sink::Storage::EntityStore &store, int limit = 0, const QByteArrayList &requestedProperties = {});
     DataStoreQuery(const DataStoreQuery::State &state, const QByteArray &type, Sink::Storage::EntityStore &store, bool incremental);
     ~DataStoreQuery();
     ResultSet execute();
@@ -60,19 +70,25 @@ private:
     typedef std::function<void(const Sink::ApplicationDomain::ApplicationDomainType &entity, Sink::Operation)> BufferCallback;
 
     QVector<QByteArray> indexLookup(const QByteArray &property, const QVariant &value);
+    QVector<QByteArray> readUids(const QByteArray &lastUid, int limit);
 
     void readEntity(const QByteArray &key, const BufferCallback &resultCallback);
+    void readEntity(const QByteArray &key, qint64 maxRevision, const BufferCallback &resultCallback);
+    void readLatestBatch(const QVector<QByteArray> &keys, const BufferCallback &resultCallback);
     void readPrevious(const QByteArray &key, const std::function<void (const Sink::ApplicationDomain::ApplicationDomainType &)> &callback);
 
     ResultSet createFilteredSet(ResultSet &resultSet, const FilterFunction &);
     QVector<QByteArray> loadIncrementalResultSet(qint64 baseRevision);
 
-    void setupQuery(const Sink::QueryBase &query_);
+    void setupQuery(const Sink::QueryBase &query_, int limit);
+    void setupProjection(const Sink::QueryBase &query, const QByteArrayList &requestedProperties);
     QByteArrayList executeSubquery(const Sink::QueryBase &subquery);
 
     const QByteArray mType;
     QSharedPointer<FilterBase> mCollector;
     QSharedPointer<Source> mSource;
+    //The properties the entities provide, or all if empty
+    QByteArrayList mProjection;
 
     Sink::Storage::EntityStore &mStore;
     Sink::Log::Context mLogCtx;
@@ -116,6 +132,9 @@ public:
 
     virtual void skip() { mSource->skip(); }
 
+    //Starts over from the first result of the source, for stages that need more than one pass
+    virtual void reset() { mSource->reset(); }
+
     //Returns true for as long as a result is available
     virtual bool next(const std::function<void(const ResultSet::Result &)> &callback) = 0;
 
@@ -87,8 +87,17 @@ QString Sink::resourceStorageLocation(const QByteArray &resourceInstanceIdentifi
     return storageLocation() + "/" + resourceInstanceIdentifier + "/data";
 }
 
+QString Sink::storageStatisticsLocation(const QByteArray &resourceInstanceIdentifier)
+{
+    return temporaryFileLocation() + "/" + resourceInstanceIdentifier + ".storagestatistics.json";
+}
+
+QString Sink::blobStorageLocation(const QByteArray &resourceInstanceIdentifier)
+{
+    return resourceStorageLocation(resourceInstanceIdentifier) + "/blobs";
+}
 
 qint64 Sink::latestDatabaseVersion()
 {
-    return 2;
+    return 5;
 }
@@ -30,6 +30,8 @@ QString SINK_EXPORT dataLocation();
 QString SINK_EXPORT configLocation();
 QString SINK_EXPORT temporaryFileLocation();
 QString SINK_EXPORT resourceStorageLocation(const QByteArray &resourceInstanceIdentifier);
+QString SINK_EXPORT storageStatisticsLocation(const QByteArray &resourceInstanceIdentifier);
+QString SINK_EXPORT blobStorageLocation(const QByteArray &resourceInstanceIdentifier);
 qint64 SINK_EXPORT latestDatabaseVersion();
 
 /**
@@ -49,7 +49,7 @@ QDebug Sink::ApplicationDomain::operator<< (QDebug d, const Sink::ApplicationDom
     }
     d << " " << "Resource: " << "\t" << type.resourceInstanceIdentifier() << "\n";
     for (const auto &property : properties) {
-        d << " " << property << "\t" << type.getProperty(property) << "\n";
+        d << " " << property << "\t" << type.getRawProperty(property) << "\n";
     }
     d << ")";
     return d;
@@ -61,6 +61,12 @@ QDebug Sink::ApplicationDomain::operator<< (QDebug d, const Sink::ApplicationDom
     return d;
 }
 
+QDebug Sink::ApplicationDomain::operator<< (QDebug d, const Sink::ApplicationDomain::BLOB &blob)
+{
+    d << "BLOB(" << blob.hash << ")";
+    return d;
+}
+
 template <typename DomainType, typename Property>
 int registerProperty() {
     Sink::Private::PropertyRegistry::instance().registerProperty<Property>(Sink::ApplicationDomain::getTypeName<DomainType>());
@@ -127,6 +133,8 @@ static const int foo = [] {
     QMetaType::registerEqualsComparator<Reference>();
     QMetaType::registerDebugStreamOperator<Reference>();
     QMetaType::registerConverter<Reference, QByteArray>();
+    QMetaType::registerEqualsComparator<BLOB>();
+    QMetaType::registerDebugStreamOperator<BLOB>();
     QMetaType::registerDebugStreamOperator<Mail::Contact>();
     qRegisterMetaTypeStreamOperators<Sink::ApplicationDomain::Reference>();
     return 0;
@@ -206,12 +214,43 @@ bool ApplicationDomainType::hasProperty(const QByteArray &key) const
     return mAdaptor->availableProperties().contains(key);
 }
 
+static QByteArray loadBlob(const QByteArray &resourceInstanceIdentifier, const BLOB &blob)
+{
+    QFile file{Sink::blobStorageLocation(resourceInstanceIdentifier) + "/" + blob.hash};
+    if (!file.open(QIODevice::ReadOnly)) {
+        SinkWarning() << "Failed to open blob: " << file.fileName() << file.errorString();
+        return {};
+    }
+    return file.readAll();
+}
+
 QVariant ApplicationDomainType::getProperty(const QByteArray &key) const
+{
+    Q_ASSERT(mAdaptor);
+    const auto value = mAdaptor->getProperty(key);
+    //Blobs are only loaded when they are accessed
+    if (value.userType() == qMetaTypeId<BLOB>()) {
+        return loadBlob(mResourceInstanceIdentifier, value.value<BLOB>());
+    }
+    return value;
+}
+
+QVariant ApplicationDomainType::getRawProperty(const QByteArray &key) const
 {
     Q_ASSERT(mAdaptor);
     return mAdaptor->getProperty(key);
 }
 
+void ApplicationDomainType::loadBlobs(BufferAdaptor &adaptor) const
+{
+    for (const auto &property : adaptor.availableProperties()) {
+        const auto value = adaptor.getProperty(property);
+        if (value.userType() == qMetaTypeId<BLOB>()) {
+            adaptor.setProperty(property, loadBlob(mResourceInstanceIdentifier, value.value<BLOB>()));
+        }
+    }
+}
+
 QVariantList ApplicationDomainType::getCollectedProperty(const QByteArray &key) const
 {
     Q_ASSERT(mAdaptor);
@@ -72,6 +72,14 @@
     void set##NAME(const QByteArray &value) { setProperty(NAME::name, QVariant::fromValue(Reference{value})); } \
     QByteArray get##NAME() const { return getProperty(NAME::name).value<Reference>().value; } \
 
+#define SINK_BLOB_PROPERTY(NAME, LOWERCASENAME) \
+    struct NAME { \
+        static constexpr const char *name = #LOWERCASENAME; \
+        typedef BLOB Type; \
+    }; \
+    void set##NAME(const QByteArray &value) { setProperty(NAME::name, QVariant::fromValue(value)); } \
+    QByteArray get##NAME() const { return getProperty(NAME::name).toByteArray(); } \
+
 #define SINK_INDEX_PROPERTY(TYPE, NAME, LOWERCASENAME) \
     struct NAME { \
         static constexpr const char *name = #LOWERCASENAME; \
@@ -153,6 +161,23 @@ struct Reference {
     QByteArray value;
 };
 
+/**
+ * Internal type.
+ *
+ * Represents a blob in the blob store of the resource, identified by the hash of its content.
+ * getProperty transparently loads the content, the buffers only contain the hash.
+ */
+struct BLOB {
+    BLOB() = default;
+    BLOB(const BLOB &) = default;
+    BLOB(const QByteArray &hash_) : hash(hash_) {};
+    ~BLOB() = default;
+    bool operator==(const BLOB &other) const {
+        return hash == other.hash;
+    }
+    QByteArray hash;
+};
+
 void copyBuffer(Sink::ApplicationDomain::BufferAdaptor &buffer, Sink::ApplicationDomain::BufferAdaptor &memoryAdaptor, const QList<QByteArray> &properties = QList<QByteArray>(), bool pruneReferences = false);
 
 /**
@@ -211,6 +236,8 @@ public:
         auto memoryAdaptor = QSharedPointer<Sink::ApplicationDomain::MemoryBufferAdaptor>::create();
         Q_ASSERT(domainType.mAdaptor);
         copyBuffer(*(domainType.mAdaptor), *memoryAdaptor, properties, true);
+        //The copy is no longer associated with our resource, so it needs the content of the blobs
+        domainType.loadBlobs(*memoryAdaptor);
         return QSharedPointer<DomainType>::create(QByteArray{}, QByteArray{}, 0, memoryAdaptor);
     }
 
@@ -258,6 +285,12 @@ public:
     bool hasProperty(const QByteArray &key) const;
 
     QVariant getProperty(const QByteArray &key) const;
+
+    /**
+     * Returns the property as stored in the buffer, so blobs are not loaded from the blob store.
+     */
+    QVariant getRawProperty(const QByteArray &key) const;
+
     QVariantList getCollectedProperty(const QByteArray &key) const;
 
     template <typename Property>
@@ -293,6 +326,7 @@ public:
 
 private:
     friend QDebug operator<<(QDebug, const ApplicationDomainType &);
+    void loadBlobs(BufferAdaptor &adaptor) const;
     QSharedPointer<BufferAdaptor> mAdaptor;
     QSharedPointer<QSet<QByteArray>> mChangeSet;
     /*
@@ -316,6 +350,7 @@ inline bool operator==(const ApplicationDomainType& lhs, const ApplicationDomain
 
 SINK_EXPORT QDebug operator<< (QDebug d, const ApplicationDomainType &type);
 SINK_EXPORT QDebug operator<< (QDebug d, const Reference &ref);
+SINK_EXPORT QDebug operator<< (QDebug d, const BLOB &blob);
 
 
 struct SINK_EXPORT SinkAccount : public ApplicationDomainType {
@@ -433,7 +468,7 @@ struct SINK_EXPORT Mail : public Entity {
     SINK_PROPERTY(bool, Unread, unread);
     SINK_PROPERTY(bool, Important, important);
     SINK_REFERENCE_PROPERTY(Folder, Folder, folder);
-    SINK_PROPERTY(QByteArray, MimeMessage, mimeMessage);
+    SINK_BLOB_PROPERTY(MimeMessage, mimeMessage);
     SINK_EXTRACTED_PROPERTY(bool, FullPayloadAvailable, fullPayloadAvailable);
     SINK_PROPERTY(bool, Draft, draft);
     SINK_PROPERTY(bool, Trash, trash);
@@ -569,3 +604,4 @@ Q_DECLARE_METATYPE(Sink::ApplicationDomain::Contact::Email)
 Q_DECLARE_METATYPE(Sink::ApplicationDomain::Error)
 Q_DECLARE_METATYPE(Sink::ApplicationDomain::Progress)
 Q_DECLARE_METATYPE(Sink::ApplicationDomain::Reference)
+Q_DECLARE_METATYPE(Sink::ApplicationDomain::BLOB)
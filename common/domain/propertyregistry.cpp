@@ -45,6 +45,12 @@ QVariant parseString<Sink::ApplicationDomain::Reference>(const QString &s)
     return QVariant::fromValue(Sink::ApplicationDomain::Reference{s.toLatin1()});
 }
 
+template <>
+QVariant parseString<Sink::ApplicationDomain::BLOB>(const QString &s)
+{
+    return QVariant::fromValue(s.toUtf8());
+}
+
 template <>
 QVariant parseString<bool>(const QString &s)
 {
@@ -117,5 +123,17 @@ QVariant PropertyRegistry::parse(const QByteArray &type, const QByteArray &prope
     return QVariant{};
 }
 
+QByteArrayList PropertyRegistry::blobProperties(const QByteArray &type) const
+{
+    QByteArrayList result;
+    const auto properties = registry.value(type).properties;
+    for (auto it = properties.constBegin(); it != properties.constEnd(); it++) {
+        if (it->isBlob) {
+            result << it.key();
+        }
+    }
+    return result;
+}
+
     }
 }
@@ -24,6 +24,7 @@
 #include <QString>
 #include <QVariant>
 #include <functional>
+#include <type_traits>
 
 #include "applicationdomaintype.h"
 
@@ -42,6 +43,9 @@ QVariant parseString<QByteArray>(const QString &s);
 template <>
 QVariant parseString<Sink::ApplicationDomain::Reference>(const QString &s);
 
+template <>
+QVariant parseString<Sink::ApplicationDomain::BLOB>(const QString &s);
+
 template <>
 QVariant parseString<bool>(const QString &s);
 
@@ -66,6 +70,7 @@ public:
     struct Type {
         struct Property {
             std::function<QVariant(const QString &)> parser;
+            bool isBlob = false;
         };
         QHash<QByteArray, Property> properties;
     };
@@ -77,9 +82,15 @@ public:
     template <typename PropertyType>
     void registerProperty(const QByteArray &entityType) {
         registry[entityType].properties[PropertyType::name].parser = Sink::Private::parseString<typename PropertyType::Type>;
+        registry[entityType].properties[PropertyType::name].isBlob = std::is_same<typename PropertyType::Type, Sink::ApplicationDomain::BLOB>::value;
     }
 
     QVariant parse(const QByteArray &type, const QByteArray &property, const QString &value);
+
+    /**
+     * The properties of @param type that are stored in the blob store.
+     */
+    QByteArrayList blobProperties(const QByteArray &type) const;
 };
 
     }
@@ -147,7 +147,7 @@ public:
 
     static QMap<QByteArray, int> databases()
     {
-        return getDbs<Indexes...>();
+        return merge(getDbs<Indexes...>(), QMap<QByteArray, int>{{QByteArray{EntityType::name} + ".index.stats", 0}});
     }
 
 };
@@ -44,9 +44,10 @@ createBufferPart(const Sink::ApplicationDomain::ApplicationDomainType &domainObj
     QList<std::function<void(void *builder)>> propertiesToAddToResource;
     for (const auto &property : domainObject.changedProperties()) {
         // SinkTrace() << "copying property " << property;
-        const auto value = domainObject.getProperty(property);
+        //Blobs are serialized as reference, so we don't load them
+        const auto value = domainObject.getRawProperty(property);
         if (mapper.hasMapping(property)) {
-            mapper.setProperty(property, domainObject.getProperty(property), propertiesToAddToResource, fbb);
+            mapper.setProperty(property, value, propertiesToAddToResource, fbb);
         } else {
             // SinkTrace() << "no mapping for property available " << property;
         }
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2017 Christian Mollekopf <chrigi_1@fastmail.fm>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+namespace Sink {
+
+template <typename Fn>
+class FunctionRef;
+
+/**
+ * A non-owning reference to a callable.
+ *
+ * Unlike std::function this never allocates and invoking it is a single indirect call,
+ * which makes it suitable for callbacks that are invoked per row in tight loops.
+ * The referenced callable must outlive the FunctionRef, so only use it for parameters.
+ */
+template <typename Ret, typename ...Params>
+class FunctionRef<Ret(Params...)>
+{
+    template <typename Callable>
+    using IsCompatible = std::integral_constant<bool,
+        !std::is_same<typename std::decay<Callable>::type, FunctionRef>::value &&
+        std::is_convertible<decltype(std::declval<Callable &>()(std::declval<Params>()...)), Ret>::value>;
+
+public:
+    template <typename Callable, typename = typename std::enable_if<IsCompatible<Callable>::value>::type>
+    FunctionRef(Callable &&callable)
+        : mCallback(&FunctionRef::invoke<typename std::remove_reference<Callable>::type>),
+          mCallable(reinterpret_cast<intptr_t>(&callable))
+    {
+    }
+
+    Ret operator()(Params ...params) const
+    {
+        return mCallback(mCallable, std::forward<Params>(params)...);
+    }
+
+private:
+    template <typename Callable>
+    static Ret invoke(intptr_t callable, Params ...params)
+    {
+        return (*reinterpret_cast<Callable *>(callable))(std::forward<Params>(params)...);
+    }
+
+    Ret (*mCallback)(intptr_t, Params...);
+    intptr_t mCallable;
+};
+
+}
@@ -25,6 +25,13 @@
 #include "commandprocessor.h"
 #include "definitions.h"
 #include "storage.h"
+#include "storage/entitystore.h"
+#include "typeindex.h"
+#include "resourceconfig.h"
+#include "log.h"
+
+#include <QFileInfo>
+#include <QDir>
 
 using namespace Sink;
 using namespace Sink::Storage;
@@ -40,6 +47,11 @@ GenericResource::GenericResource(const ResourceContext &resourceContext, const Q
     QObject::connect(mProcessor.data(), &CommandProcessor::error, [this](int errorCode, const QString &msg) { onProcessorError(errorCode, msg); });
     QObject::connect(mProcessor.data(), &CommandProcessor::notify, this, &GenericResource::notify);
     QObject::connect(mPipeline.data(), &Pipeline::revisionUpdated, this, &Resource::revisionUpdated);
+    //The entity cache is shared by all entity stores of the resource process
+    const auto cacheSize = ResourceConfig::getConfiguration(resourceContext.instanceId()).value("entityCacheSize");
+    if (cacheSize.isValid()) {
+        Storage::EntityStore::setCacheCapacity(cacheSize.toInt());
+    }
 }
 
 GenericResource::~GenericResource()
@@ -56,6 +68,45 @@ void GenericResource::setSecret(const QString &s)
     }
 }
 
+/*
+ * Version 4 replaced the textual $uid$revision keys of the main databases with binary keys.
+ * Everything else is unchanged since version 3, so we can convert the keys in place.
+ */
+static void upgradeMainDatabaseKeys(Sink::Storage::DataStore::Transaction &transaction)
+{
+    using Sink::Storage::DataStore;
+    for (const auto &name : transaction.getDatabaseNames()) {
+        if (!name.endsWith(".main")) {
+            continue;
+        }
+        auto db = transaction.openDatabase(name);
+        qint64 count = 0;
+        while (true) {
+            //Convert in batches so we don't have to hold the complete database in memory.
+            QList<QPair<QByteArray, QByteArray>> batch;
+            //All textual keys start with the opening brace of the uuid.
+            db.scan("{", [&](const QByteArray &key, const QByteArray &value) {
+                if (DataStore::isLegacyKey(key)) {
+                    batch << qMakePair(QByteArray{key.constData(), key.size()}, QByteArray{value.constData(), value.size()});
+                }
+                return batch.size() < 10000;
+            },
+            [](const DataStore::Error &error) {
+                SinkWarning() << "Error while reading legacy keys: " << error.message;
+            }, true);
+            if (batch.isEmpty()) {
+                break;
+            }
+            for (const auto &entry : batch) {
+                db.remove(entry.first);
+                db.write(DataStore::assembleKey(DataStore::uidFromKey(entry.first), DataStore::revisionFromKey(entry.first)), entry.second);
+            }
+            count += batch.size();
+        }
+        SinkLog() << "Converted " << count << " keys in " << name;
+    }
+}
+
 bool GenericResource::checkForUpgrade()
 {
     const auto currentDatabaseVersion = [&] {
@@ -65,14 +116,24 @@ bool GenericResource::checkForUpgrade()
     if (currentDatabaseVersion != Sink::latestDatabaseVersion()) {
         SinkLog() << "Starting database upgrade from " << currentDatabaseVersion << " to " << Sink::latestDatabaseVersion();
 
-        //Right now upgrading just means removing all local storage so we will resync
-        Sink::Storage::DataStore(Sink::storageLocation(), mResourceContext.instanceId(), Sink::Storage::DataStore::ReadWrite).removeFromDisk();
-        Sink::Storage::DataStore(Sink::storageLocation(), mResourceContext.instanceId() + ".userqueue", Sink::Storage::DataStore::ReadWrite).removeFromDisk();
-        Sink::Storage::DataStore(Sink::storageLocation(), mResourceContext.instanceId() + ".synchronizerqueue", Sink::Storage::DataStore::ReadWrite).removeFromDisk();
-        Sink::Storage::DataStore(Sink::storageLocation(), mResourceContext.instanceId() + ".changereplay", Sink::Storage::DataStore::ReadWrite).removeFromDisk();
-        Sink::Storage::DataStore(Sink::storageLocation(), mResourceContext.instanceId() + ".synchronization", Sink::Storage::DataStore::ReadWrite).removeFromDisk();
+        if (currentDatabaseVersion == 3 || currentDatabaseVersion == 4) {
+            auto store = Sink::Storage::DataStore(Sink::storageLocation(), mResourceContext.instanceId(), Sink::Storage::DataStore::ReadWrite);
+            auto t = store.createTransaction(Storage::DataStore::ReadWrite);
+            if (currentDatabaseVersion == 3) {
+                upgradeMainDatabaseKeys(t);
+            }
+            TypeIndex::upgradeDateKeys(t);
+            Storage::DataStore::setDatabaseVersion(t, Sink::latestDatabaseVersion());
+            t.commit();
+        } else {
+            //For anything older upgrading just means removing all local storage so we will resync
+            Sink::Storage::DataStore(Sink::storageLocation(), mResourceContext.instanceId(), Sink::Storage::DataStore::ReadWrite).removeFromDisk();
+            Sink::Storage::DataStore(Sink::storageLocation(), mResourceContext.instanceId() + ".userqueue", Sink::Storage::DataStore::ReadWrite).removeFromDisk();
+            Sink::Storage::DataStore(Sink::storageLocation(), mResourceContext.instanceId() + ".synchronizerqueue", Sink::Storage::DataStore::ReadWrite).removeFromDisk();
+            Sink::Storage::DataStore(Sink::storageLocation(), mResourceContext.instanceId() + ".changereplay", Sink::Storage::DataStore::ReadWrite).removeFromDisk();
+            Sink::Storage::DataStore(Sink::storageLocation(), mResourceContext.instanceId() + ".synchronization", Sink::Storage::DataStore::ReadWrite).removeFromDisk();
+            QDir{Sink::blobStorageLocation(mResourceContext.instanceId())}.removeRecursively();
 
-        {
             auto store = Sink::Storage::DataStore(Sink::storageLocation(), mResourceContext.instanceId(), Sink::Storage::DataStore::ReadWrite);
             auto t = store.createTransaction(Storage::DataStore::ReadWrite);
             Storage::DataStore::setDatabaseVersion(t, Sink::latestDatabaseVersion());
@@ -110,6 +171,7 @@ void GenericResource::removeFromDisk(const QByteArray &instanceIdentifier)
     Sink::Storage::DataStore(Sink::storageLocation(), instanceIdentifier + ".synchronizerqueue", Sink::Storage::DataStore::ReadWrite).removeFromDisk();
     Sink::Storage::DataStore(Sink::storageLocation(), instanceIdentifier + ".changereplay", Sink::Storage::DataStore::ReadWrite).removeFromDisk();
     Sink::Storage::DataStore(Sink::storageLocation(), instanceIdentifier + ".synchronization", Sink::Storage::DataStore::ReadWrite).removeFromDisk();
+    QDir{Sink::blobStorageLocation(instanceIdentifier)}.removeRecursively();
 }
 
 qint64 GenericResource::diskUsage(const QByteArray &instanceIdentifier)
@@ -122,6 +184,32 @@ qint64 GenericResource::diskUsage(const QByteArray &instanceIdentifier)
     return size;
 }
 
+bool GenericResource::compact(const QByteArray &instanceIdentifier, double minimumFreeRatio)
+{
+    bool success = true;
+    for (const auto &name : QByteArrayList{instanceIdentifier, instanceIdentifier + ".userqueue", instanceIdentifier + ".synchronizerqueue", instanceIdentifier + ".changereplay", instanceIdentifier + ".synchronization"}) {
+        //Don't create environments that don't exist yet
+        if (!QFileInfo::exists(Sink::storageLocation() + '/' + name + "/data.mdb")) {
+            continue;
+        }
+        Sink::Storage::DataStore store(Sink::storageLocation(), name, Sink::Storage::DataStore::ReadWrite);
+        const auto stat = store.createTransaction(Sink::Storage::DataStore::ReadOnly).stat(false);
+        const double freeRatio = stat.totalPages ? double(stat.freePages) / stat.totalPages : 0;
+        if (freeRatio < minimumFreeRatio) {
+            SinkTrace() << "Not compacting " << name << ", free page ratio: " << freeRatio;
+            continue;
+        }
+        const auto sizeBefore = store.diskUsage();
+        if (store.compact()) {
+            SinkLog() << "Compacted " << name << " from " << sizeBefore / 1024 << " to " << store.diskUsage() / 1024 << " [kb]";
+        } else {
+            SinkWarning() << "Failed to compact " << name;
+            success = false;
+        }
+    }
+    return success;
+}
+
 void GenericResource::onProcessorError(int errorCode, const QString &errorMessage)
 {
     SinkWarning() << "Received error from Processor: " << errorCode << errorMessage;
@@ -46,6 +46,13 @@ public:
 
     static void removeFromDisk(const QByteArray &instanceIdentifier);
     static qint64 diskUsage(const QByteArray &instanceIdentifier);
+    /**
+     * Compacts all environments of the resource that have at least @param minimumFreeRatio of their pages on the freelist.
+     *
+     * The resource must not be in use while this runs. Environments that other processes have open are left alone.
+     * Returns false if any of the environments could not be compacted.
+     */
+    static bool compact(const QByteArray &instanceIdentifier, double minimumFreeRatio = 0);
 
     virtual void setSecret(const QString &s) Q_DECL_OVERRIDE;
     virtual bool checkForUpgrade() Q_DECL_OVERRIDE;
@@ -4,14 +4,14 @@
 
 Index::Index(const QString &storageRoot, const QString &name, Sink::Storage::DataStore::AccessMode mode)
     : mTransaction(Sink::Storage::DataStore(storageRoot, name, mode).createTransaction(mode)),
-      mDb(mTransaction.openDatabase(name.toLatin1(), std::function<void(const Sink::Storage::DataStore::Error &)>(), true)),
+      mDb(mTransaction.openDatabase(name.toLatin1(), std::function<void(const Sink::Storage::DataStore::Error &)>(), Sink::Storage::DataStore::AllowDuplicates)),
       mName(name),
       mLogCtx("index." + name.toLatin1())
 {
 }
 
 Index::Index(const QByteArray &name, Sink::Storage::DataStore::Transaction &transaction)
-    : mDb(transaction.openDatabase(name, std::function<void(const Sink::Storage::DataStore::Error &)>(), true)), mName(name),
+    : mDb(transaction.openDatabase(name, std::function<void(const Sink::Storage::DataStore::Error &)>(), Sink::Storage::DataStore::AllowDuplicates)), mName(name),
       mLogCtx("index." + name)
 {
 }
@@ -33,8 +33,8 @@ void Index::remove(const QByteArray &key, const QByteArray &value)
 void Index::lookup(const QByteArray &key, const std::function<void(const QByteArray &value)> &resultHandler, const std::function<void(const Error &error)> &errorHandler, bool matchSubStringKeys)
 {
     mDb.scan(key,
-        [&](const QByteArray &key, const QByteArray &value) -> bool {
-            resultHandler(value);
+        [&](const Sink::Storage::Slice &, const Sink::Storage::Slice &value) -> bool {
+            resultHandler(value.toRawByteArray());
             return true;
         },
         [&](const Sink::Storage::DataStore::Error &error) {
@@ -51,3 +51,15 @@ QByteArray Index::lookup(const QByteArray &key)
     lookup(key, [&](const QByteArray &value) { result = QByteArray(value.constData(), value.size()); }, [this](const Index::Error &) { });
     return result;
 }
+
+void Index::rangeLookup(const QByteArray &lowerBound, const QByteArray &upperBound, const std::function<void(const QByteArray &value)> &resultHandler,
+    const std::function<void(const Error &error)> &errorHandler)
+{
+    auto cursor = mDb.createCursor(upperBound, [&](const Sink::Storage::DataStore::Error &error) {
+        SinkWarningCtx(mLogCtx) << "Error while retrieving range:" << error << mName;
+        errorHandler(Error(error.store, error.code, error.message));
+    });
+    for (auto valid = cursor.seek(lowerBound); valid; valid = cursor.next()) {
+        resultHandler(cursor.value().toByteArray());
+    }
+}
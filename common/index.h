@@ -39,6 +39,14 @@ public:
         bool matchSubStringKeys = false);
     QByteArray lookup(const QByteArray &key);
 
+    /**
+     * Returns the values of all keys from @param lowerBound up to the exclusive @param upperBound, in the order of the keys.
+     *
+     * An empty bound leaves that side of the range open.
+     */
+    void rangeLookup(const QByteArray &lowerBound, const QByteArray &upperBound, const std::function<void(const QByteArray &value)> &resultHandler,
+        const std::function<void(const Error &error)> &errorHandler);
+
 private:
     Q_DISABLE_COPY(Index);
     Sink::Storage::DataStore::Transaction mTransaction;
@@ -21,6 +21,10 @@
 
 #include "common/commands.h"
 #include "common/resource.h"
+#include "common/genericresource.h"
+#include "common/resourceconfig.h"
+#include "common/storage.h"
+#include "common/storage/entitystore.h"
 #include "common/log.h"
 #include "common/definitions.h"
 #include "common/resourcecontext.h"
@@ -35,7 +39,11 @@
 #include "common/revisionreplayed_generated.h"
 #include "common/secret_generated.h"
 
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
 #include <QLocalServer>
+#include <QSaveFile>
 #include <QLocalSocket>
 #include <QTimer>
 
@@ -95,6 +103,60 @@ void Listener::checkForUpgrade()
     }
 }
 
+static bool writeStorageStatistics(const QString &path)
+{
+    QJsonObject environments;
+    const auto statistics = Sink::Storage::DataStore::statistics();
+    for (auto env = statistics.constBegin(); env != statistics.constEnd(); env++) {
+        QJsonArray histogram;
+        for (const auto count : env->commitLatencyHistogram) {
+            histogram.append(double(count));
+        }
+        QJsonObject databases;
+        for (auto db = env->databases.constBegin(); db != env->databases.constEnd(); db++) {
+            databases.insert(QString::fromUtf8(db.key()), QJsonObject{
+                {"writes", double(db->writes)},
+                {"removes", double(db->removes)},
+                {"scans", double(db->scans)},
+                {"findLatest", double(db->findLatest)},
+                {"rowsVisited", double(db->rowsVisited)},
+                {"bytesRead", double(db->bytesRead)},
+                {"bytesWritten", double(db->bytesWritten)}
+            });
+        }
+        environments.insert(env.key(), QJsonObject{
+            {"commits", double(env->commits)},
+            {"commitLatencyHistogram", histogram},
+            {"databases", databases}
+        });
+    }
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        SinkWarning() << "Failed to open the storage statistics file: " << path;
+        return false;
+    }
+    const auto cache = Sink::Storage::EntityStore::cacheStatistics();
+    const QJsonObject entityCache{
+        {"hits", double(cache.hits)},
+        {"misses", double(cache.misses)},
+        {"size", cache.size},
+        {"capacity", cache.capacity}
+    };
+    file.write(QJsonDocument(QJsonObject{{"environments", environments}, {"entityCache", entityCache}}).toJson());
+    return file.commit();
+}
+
+void Listener::checkForCompaction()
+{
+    //Compaction rewrites the complete database, so it's only done if explicitly configured
+    const auto threshold = ResourceConfig::getConfiguration(m_resourceInstanceIdentifier).value("compactionThreshold").toDouble();
+    if (threshold > 0) {
+        //Close the resource to ensure no transactions are open
+        m_resource.reset(nullptr);
+        GenericResource::compact(m_resourceInstanceIdentifier, threshold);
+    }
+}
+
 void Listener::emergencyAbortAllConnections()
 {
     Sink::Notification n;
@@ -300,6 +362,23 @@ void Listener::processCommand(int commandId, uint messageId, const QByteArray &c
         case Sink::Commands::UpgradeCommand:
             //Because we synchronously run the update directly on resource start, we know that the upgrade is complete once this message completes.
             break;
+        case Sink::Commands::StorageStatisticsCommand:
+            SinkLog() << QString("Received a storage statistics command from %1").arg(client.name);
+            //The client reads the statistics from the file once the command completed
+            success = writeStorageStatistics(Sink::storageStatisticsLocation(m_resourceInstanceIdentifier));
+            break;
+        case Sink::Commands::CompactCommand:
+            SinkLog() << QString("Received a compact command from %1").arg(client.name);
+            //Other clients would continue to use the old database files
+            if (m_connections.size() > 1) {
+                SinkWarning() << "Not compacting while other clients are connected.";
+                success = false;
+            } else {
+                //Close the resource to ensure no transactions are open
+                m_resource.reset(nullptr);
+                success = GenericResource::compact(m_resourceInstanceIdentifier);
+            }
+            break;
         default:
             if (commandId > Sink::Commands::CustomCommand) {
                 SinkLog() << QString("Received custom command from %1: ").arg(client.name) << commandId;
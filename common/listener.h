@@ -60,6 +60,7 @@ public:
     ~Listener();
 
     void checkForUpgrade();
+    void checkForCompaction();
 
 signals:
     void noClients();
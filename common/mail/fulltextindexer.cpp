@@ -29,6 +29,10 @@ using namespace Sink::ApplicationDomain;
 
 void FulltextIndexer::add(const ApplicationDomain::ApplicationDomainType &entity)
 {
+    //A modification that didn't touch the indexed content keeps the existing document
+    if (mPendingRemovals.remove(entity.identifier()) && !entity.hasProperty("index")) {
+        return;
+    }
     if (!index) {
         index.reset(new FulltextIndex{mResourceInstanceIdentifier, Storage::DataStore::ReadWrite});
     }
@@ -37,14 +41,19 @@ void FulltextIndexer::add(const ApplicationDomain::ApplicationDomainType &entity
 
 void FulltextIndexer::remove(const ApplicationDomain::ApplicationDomainType &entity)
 {
-    if (!index) {
-        index.reset(new FulltextIndex{mResourceInstanceIdentifier, Storage::DataStore::ReadWrite});
-    }
-    index->remove(entity.identifier());
+    //Modifications remove the old entity before adding the new one, so we only know at commit time whether this is a removal
+    mPendingRemovals.insert(entity.identifier());
 }
 
 void FulltextIndexer::commitTransaction()
 {
+    if (!mPendingRemovals.isEmpty() && !index) {
+        index.reset(new FulltextIndex{mResourceInstanceIdentifier, Storage::DataStore::ReadWrite});
+    }
+    for (const auto &identifier : mPendingRemovals) {
+        index->remove(identifier);
+    }
+    mPendingRemovals.clear();
     if (index) {
         index->commitTransaction();
     }
@@ -52,6 +61,7 @@ void FulltextIndexer::commitTransaction()
 
 void FulltextIndexer::abortTransaction()
 {
+    mPendingRemovals.clear();
     if (index) {
         index->abortTransaction();
     }
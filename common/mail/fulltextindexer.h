@@ -20,6 +20,8 @@
 
 #include "indexer.h"
 
+#include <QSet>
+
 class FulltextIndex;
 namespace Sink {
 
@@ -34,6 +36,7 @@ public:
     static QMap<QByteArray, int> databases();
 private:
     QSharedPointer<FulltextIndex> index;
+    QSet<QByteArray> mPendingRemovals;
 };
 
 }
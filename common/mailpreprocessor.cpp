@@ -149,5 +149,8 @@ void MailPropertyExtractor::newEntity(Sink::ApplicationDomain::Mail &mail)
 
 void MailPropertyExtractor::modifiedEntity(const Sink::ApplicationDomain::Mail &oldMail, Sink::ApplicationDomain::Mail &newMail)
 {
-    updatedIndexedProperties(newMail, newMail.getMimeMessage());
+    //The extracted properties only depend on the message, so e.g. flag changes don't need to load and parse it again
+    if (newMail.changedProperties().contains(Sink::ApplicationDomain::Mail::MimeMessage::name)) {
+        updatedIndexedProperties(newMail, newMail.getMimeMessage());
+    }
 }
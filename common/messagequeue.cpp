@@ -83,15 +83,15 @@ KAsync::Job<void> MessageQueue::dequeueBatch(int maxBatchSize, const std::functi
         mStorage.createTransaction(Sink::Storage::DataStore::ReadOnly)
             .openDatabase()
             .scan("",
-                [this, resultHandler, resultCount, &count, maxBatchSize, &waitCondition](const QByteArray &key, const QByteArray &value) -> bool {
-                    if (mPendingRemoval.contains(key)) {
+                [this, resultHandler, resultCount, &count, maxBatchSize, &waitCondition](const Sink::Storage::Slice &key, const Sink::Storage::Slice &value) -> bool {
+                    if (mPendingRemoval.contains(key.toRawByteArray())) {
                         return true;
                     }
                     *resultCount += 1;
                     // We need a copy of the key here, otherwise we can't store it in the lambda (the pointers will become invalid)
-                    mPendingRemoval << QByteArray(key.constData(), key.size());
+                    mPendingRemoval << key.toByteArray();
 
-                    waitCondition << resultHandler(value).exec();
+                    waitCondition << resultHandler(value.toRawByteArray()).exec();
 
                     count++;
                     if (count < maxBatchSize) {
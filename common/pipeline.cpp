@@ -360,11 +360,13 @@ KAsync::Job<qint64> Pipeline::deletedEntity(void const *command, size_t size)
     return KAsync::value(d->entityStore.maxRevision());
 }
 
-void Pipeline::cleanupRevisions(qint64 revision)
+bool Pipeline::cleanupRevisions(qint64 revision, qint64 batchSize)
 {
+    bool complete = true;
     //We have to set revisionChanged, otherwise a call to commit might abort
     //the transaction when not using the implicit internal transaction
-    d->revisionChanged = d->entityStore.cleanupRevisions(revision);
+    d->revisionChanged = d->entityStore.cleanupRevisions(revision, batchSize, &complete);
+    return complete;
 }
 
 
@@ -58,9 +58,11 @@ public:
     KAsync::Job<qint64> deletedEntity(void const *command, size_t size);
 
     /*
-     * Cleans up all revisions until @param revision.
+     * Cleans up the revisions until @param revision, but no more than @param batchSize revisions (all if 0).
+     *
+     * Returns true if the cleanup has reached @param revision.
      */
-    void cleanupRevisions(qint64 revision);
+    bool cleanupRevisions(qint64 revision, qint64 batchSize = 0);
 
 
 signals:
@@ -54,6 +54,22 @@ flatbuffers::uoffset_t variantToProperty<QByteArray>(const QVariant &property, f
     return 0;
 }
 
+/*
+ * Blob properties either contain the content inline, or a reference to the blob store.
+ * The reference is prefixed with a null byte, which can't be part of a regular value of a blob property (e.g. a mime message).
+ */
+static const QByteArray sBlobReferencePrefix = QByteArray("\0sink.blob:", 11);
+
+template <>
+flatbuffers::uoffset_t variantToProperty<Sink::ApplicationDomain::BLOB>(const QVariant &property, flatbuffers::FlatBufferBuilder &fbb)
+{
+    if (property.isValid()) {
+        const auto ba = property.userType() == qMetaTypeId<Sink::ApplicationDomain::BLOB>() ? sBlobReferencePrefix + property.value<Sink::ApplicationDomain::BLOB>().hash : property.toByteArray();
+        return fbb.CreateString(ba.constData(), ba.size()).o;
+    }
+    return 0;
+}
+
 template <>
 flatbuffers::uoffset_t variantToProperty<QDateTime>(const QVariant &property, flatbuffers::FlatBufferBuilder &fbb)
 {
@@ -161,6 +177,20 @@ QVariant propertyToVariant<QByteArray>(const flatbuffers::String *property)
     return QVariant();
 }
 
+template <>
+QVariant propertyToVariant<Sink::ApplicationDomain::BLOB>(const flatbuffers::String *property)
+{
+    if (property) {
+        const auto value = QByteArray::fromRawData(property->c_str(), property->size());
+        if (value.startsWith(sBlobReferencePrefix)) {
+            return QVariant::fromValue(Sink::ApplicationDomain::BLOB{value.mid(sBlobReferencePrefix.size())});
+        }
+        // We have to copy the memory, otherwise it would become eventually invalid
+        return QByteArray(property->c_str(), property->Length());
+    }
+    return QVariant();
+}
+
 template <>
 QVariant propertyToVariant<QByteArray>(const flatbuffers::Vector<uint8_t> *property)
 {
@@ -21,6 +21,7 @@
 
 #include <QList>
 #include <QDataStream>
+#include <QDateTime>
 
 using namespace Sink;
 
@@ -36,6 +37,12 @@ QDebug operator<<(QDebug dbg, const Sink::QueryBase::Comparator &c)
         dbg.nospace() << "in " << c.value;
     } else if (c.comparator == Sink::Query::Comparator::Fulltext) {
         dbg.nospace() << "fulltext contains " << c.value;
+    } else if (c.comparator == Sink::Query::Comparator::LessThan) {
+        dbg.nospace() << "< " << c.value;
+    } else if (c.comparator == Sink::Query::Comparator::GreaterThan) {
+        dbg.nospace() << "> " << c.value;
+    } else if (c.comparator == Sink::Query::Comparator::Within) {
+        dbg.nospace() << "within " << c.value;
     } else {
         dbg.nospace() << "unknown comparator: " << c.value;
     }
@@ -150,6 +157,37 @@ QueryBase::Comparator::Comparator(const QVariant &v, Comparators c) : value(v),
 {
 }
 
+//Orders values the same way as the keys of the indexes, so range lookups and filtering agree.
+static bool lessThan(const QVariant &left, const QVariant &right)
+{
+    if (left.type() == QVariant::DateTime || right.type() == QVariant::DateTime) {
+        return left.toDateTime() < right.toDateTime();
+    }
+    switch (left.type()) {
+        case QVariant::Int:
+        case QVariant::UInt:
+        case QVariant::LongLong:
+        case QVariant::ULongLong:
+        case QVariant::Double:
+            return left.toDouble() < right.toDouble();
+        case QVariant::String:
+            return left.toString().toUtf8() < right.toString().toUtf8();
+        default:
+            return left.toByteArray() < right.toByteArray();
+    }
+}
+
+static bool isComparable(const QVariant &v)
+{
+    if (!v.isValid()) {
+        return false;
+    }
+    if (v.type() == QVariant::DateTime) {
+        return v.toDateTime().isValid();
+    }
+    return true;
+}
+
 bool QueryBase::Comparator::matches(const QVariant &v) const
 {
     switch(comparator) {
@@ -171,6 +209,21 @@ bool QueryBase::Comparator::matches(const QVariant &v) const
                 return false;
             }
             return value.value<QByteArrayList>().contains(v.toByteArray());
+        case LessThan:
+            return isComparable(v) && lessThan(v, value);
+        case GreaterThan:
+            return isComparable(v) && lessThan(value, v);
+        case Within: {
+            if (!isComparable(v)) {
+                return false;
+            }
+            const auto range = value.toList();
+            if (range.size() != 2) {
+                return false;
+            }
+            //An invalid bound leaves that side of the range open
+            return (!range.at(0).isValid() || !lessThan(v, range.at(0))) && (!range.at(1).isValid() || !lessThan(range.at(1), v));
+        }
         case Fulltext:
         case Invalid:
         default:
@@ -36,7 +36,12 @@ public:
             Equals,
             Contains,
             In,
-            Fulltext
+            Fulltext,
+            //Strictly less or greater than the value
+            LessThan,
+            GreaterThan,
+            //Within the inclusive range of a QVariantList with the lower and upper bound, an invalid bound leaves the range open
+            Within
         };
 
         Comparator();
@@ -125,11 +125,14 @@ void QueryRunner<DomainType>::fetch(const Sink::Query &query, const QByteArray &
             mInitialQueryComplete = true;
             mQueryInProgress = false;
             mQueryState = result.queryState;
-            // Only send the revision replayed information if we're connected to the resource, there's no need to start the resource otherwise.
-            if (query.liveQuery()) {
-                mResourceAccess->sendRevisionReplayedCommand(result.newRevision);
+            //Further batches read the data as of the revision of the initial batch, everything newer is delivered by the incremental updates
+            if (!state) {
+                // Only send the revision replayed information if we're connected to the resource, there's no need to start the resource otherwise.
+                if (query.liveQuery()) {
+                    mResourceAccess->sendRevisionReplayedCommand(result.newRevision);
+                }
+                resultProvider->setRevision(result.newRevision);
             }
-            resultProvider->setRevision(result.newRevision);
             resultProvider->initialResultSetComplete(result.replayedAll);
             if (mRequestFetchMore) {
                 mRequestFetchMore = false;
@@ -269,7 +272,7 @@ ReplayResult QueryWorker<DomainType>::executeInitialQuery(
         if (state) {
             return DataStoreQuery{*state, ApplicationDomain::getTypeName<DomainType>(), entityStore, false};
         } else {
-            return DataStoreQuery{query, ApplicationDomain::getTypeName<DomainType>(), entityStore};
+            return DataStoreQuery{query, ApplicationDomain::getTypeName<DomainType>(), entityStore, batchsize, query.requestedProperties};
         }
     }();
     auto resultSet = preparedQuery.execute();
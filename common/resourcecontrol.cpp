@@ -78,6 +78,24 @@ KAsync::Job<void> ResourceControl::start(const QByteArray &identifier)
     return resourceAccess->sendCommand(Sink::Commands::PingCommand).addToContext(resourceAccess).then([time]() { SinkTrace() << "Start complete." << Log::TraceTime(time->elapsed()); });
 }
 
+KAsync::Job<void> ResourceControl::dumpStorageStatistics(const QByteArray &identifier)
+{
+    SinkTrace() << "dumpStorageStatistics " << identifier;
+    return ResourceAccess::connectToServer(identifier)
+        .then<void, QSharedPointer<QLocalSocket>>(
+            [identifier](const KAsync::Error &error, QSharedPointer<QLocalSocket> socket) {
+                if (error) {
+                    return KAsync::error<void>(1, "The resource is not running.");
+                }
+                // We can't currently reuse the socket
+                socket->close();
+                auto resourceAccess = ResourceAccessFactory::instance().getAccess(identifier, ResourceConfig::getResourceType(identifier));
+                resourceAccess->open();
+                return resourceAccess->sendCommand(Sink::Commands::StorageStatisticsCommand)
+                    .addToContext(resourceAccess);
+            });
+}
+
 KAsync::Job<void> ResourceControl::flushMessageQueue(const QByteArrayList &resourceIdentifier)
 {
     SinkTrace() << "flushMessageQueue" << resourceIdentifier;
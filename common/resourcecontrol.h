@@ -62,5 +62,12 @@ KAsync::Job<void> SINK_EXPORT flushReplayQueue(const QByteArray &resourceIdentif
 
 KAsync::Job<void> SINK_EXPORT flush(Flush::FlushType, const QByteArray &resourceIdentifier);
 
+/**
+ * Makes the running resource write the statistics of its storage to Sink::storageStatisticsLocation.
+ *
+ * Fails if the resource is not running, since a freshly started resource has no statistics.
+ */
+KAsync::Job<void> SINK_EXPORT dumpStorageStatistics(const QByteArray &resourceIdentifier);
+
 }
 }
@@ -23,13 +23,84 @@
 
 #include "sink_export.h"
 #include <string>
+#include <cstring>
 #include <functional>
 #include <QString>
 #include <QMap>
+#include <QVector>
+#include "functionref.h"
 
 namespace Sink {
 namespace Storage {
 
+/**
+ * A non-owning view on a key or value stored in the database.
+ *
+ * The data is only valid for the duration of the callback it is passed to.
+ */
+class Slice
+{
+public:
+    Slice(const char *data, size_t size) : mData(data), mSize(size)
+    {
+    }
+
+    const char *data() const
+    {
+        return mData;
+    }
+
+    size_t size() const
+    {
+        return mSize;
+    }
+
+    bool isEmpty() const
+    {
+        return mSize == 0;
+    }
+
+    bool startsWith(const char *prefix, size_t prefixSize) const
+    {
+        return mSize >= prefixSize && memcmp(mData, prefix, prefixSize) == 0;
+    }
+
+    bool startsWith(const QByteArray &prefix) const
+    {
+        return startsWith(prefix.constData(), prefix.size());
+    }
+
+    bool operator==(const QByteArray &other) const
+    {
+        return mSize == static_cast<size_t>(other.size()) && memcmp(mData, other.constData(), mSize) == 0;
+    }
+
+    /**
+     * A QByteArray that refers to the same data without copying it.
+     */
+    QByteArray toRawByteArray() const
+    {
+        return QByteArray::fromRawData(mData, mSize);
+    }
+
+    /**
+     * A deep copy that remains valid after the callback.
+     */
+    QByteArray toByteArray() const
+    {
+        return QByteArray(mData, mSize);
+    }
+
+private:
+    const char *mData;
+    size_t mSize;
+};
+
+class StorageBackend;
+class TransactionBackend;
+class DatabaseBackend;
+class CursorBackend;
+
 struct SINK_EXPORT DbLayout {
     typedef QMap<QByteArray, int> Databases;
     DbLayout();
@@ -56,6 +127,34 @@ public:
         NotFound
     };
 
+    enum DatabaseFlags
+    {
+        AllowDuplicates = 1,
+        IntegerKeys = 2,
+        /**
+         * Values are transparently compressed on write and decompressed on read.
+         *
+         * Like all values, decompressed values remain valid until the transaction ends.
+         * The flag is recorded when the database is created, so the values are decoded no matter with which flags it is opened later on.
+         * It is ignored for databases with duplicates.
+         */
+        Compressed = 4
+    };
+
+    /**
+     * How commits are flushed to disk.
+     *
+     * Strict: Every commit is synced to disk.
+     * Group: The meta page is not synced on commit (MDB_NOMETASYNC), so the last transactions may be lost in a system crash until syncToDisk is called.
+     * Relaxed: Nothing is synced on commit (MDB_NOSYNC), everything since the last syncToDisk may be lost in a system crash.
+     */
+    enum Durability
+    {
+        Strict,
+        Group,
+        Relaxed
+    };
+
     class Error
     {
     public:
@@ -99,6 +198,14 @@ public:
         int scan(const QByteArray &key, const std::function<bool(const QByteArray &key, const QByteArray &value)> &resultHandler,
             const std::function<void(const DataStore::Error &error)> &errorHandler = std::function<void(const DataStore::Error &error)>(), bool findSubstringKeys = false, bool skipInternalKeys = true) const;
 
+        /**
+         * Same as above, but without wrapping every row in QByteArrays.
+         *
+         * Prefer this for scans that visit many rows.
+         */
+        int scan(const QByteArray &key, FunctionRef<bool(const Slice &key, const Slice &value)> resultHandler,
+            const std::function<void(const DataStore::Error &error)> &errorHandler = std::function<void(const DataStore::Error &error)>(), bool findSubstringKeys = false, bool skipInternalKeys = true) const;
+
         /**
          * Finds the last value in a series matched by prefix.
          *
@@ -107,12 +214,61 @@ public:
          */
         void findLatest(const QByteArray &uid, const std::function<void(const QByteArray &key, const QByteArray &value)> &resultHandler,
             const std::function<void(const DataStore::Error &error)> &errorHandler = std::function<void(const DataStore::Error &error)>()) const;
+        void findLatest(const QByteArray &uid, FunctionRef<void(const Slice &key, const Slice &value)> resultHandler,
+            const std::function<void(const DataStore::Error &error)> &errorHandler = std::function<void(const DataStore::Error &error)>()) const;
 
         /**
          * Returns true if the database contains the substring key.
          */
         bool contains(const QByteArray &uid);
 
+        /**
+         * A pull based iterator over the keys of a database, in the order of the database.
+         *
+         * Internal keys are skipped, and if an upper bound is set the cursor becomes invalid once it reaches a key that is equal or greater than the bound.
+         * Key and value are only valid until the cursor is moved, and the cursor must be destroyed before the transaction ends.
+         */
+        class Cursor
+        {
+        public:
+            Cursor();
+            ~Cursor();
+            Cursor(Cursor &&other);
+            Cursor &operator=(Cursor &&other);
+
+            /**
+             * Position the cursor on the first key that is equal or greater than @param key.
+             *
+             * An empty key positions the cursor on the first key.
+             */
+            bool seek(const QByteArray &key = {});
+
+            /**
+             * Position the cursor on the last key below the upper bound.
+             */
+            bool seekLast();
+
+            bool next();
+            bool prev();
+
+            bool isValid() const;
+            Slice key() const;
+            Slice value() const;
+
+        private:
+            Q_DISABLE_COPY(Cursor);
+            friend NamedDatabase;
+            Cursor(CursorBackend *);
+            CursorBackend *d;
+        };
+
+        /**
+         * Create a cursor, optionally with an exclusive @param upperBound.
+         *
+         * The cursor is not positioned until one of the seek functions is called.
+         */
+        Cursor createCursor(const QByteArray &upperBound = {}, const std::function<void(const DataStore::Error &error)> &errorHandler = {}) const;
+
         NamedDatabase(NamedDatabase &&other);
         NamedDatabase &operator=(NamedDatabase &&other);
 
@@ -137,9 +293,8 @@ public:
         friend Transaction;
         NamedDatabase(NamedDatabase &other);
         NamedDatabase &operator=(NamedDatabase &other);
-        class Private;
-        NamedDatabase(Private *);
-        Private *d;
+        NamedDatabase(DatabaseBackend *);
+        DatabaseBackend *d;
     };
 
     class Transaction
@@ -152,8 +307,13 @@ public:
 
         QList<QByteArray> getDatabaseNames() const;
 
+        /**
+         * Open a named database.
+         *
+         * @param flags A combination of DatabaseFlags. The flags are only applied when the database is created.
+         */
         NamedDatabase openDatabase(const QByteArray &name = {"default"},
-            const std::function<void(const DataStore::Error &error)> &errorHandler = {}, bool allowDuplicates = false) const;
+            const std::function<void(const DataStore::Error &error)> &errorHandler = {}, int flags = 0) const;
 
         Transaction(Transaction &&other);
         Transaction &operator=(Transaction &&other);
@@ -173,15 +333,35 @@ public:
         Transaction(Transaction &other);
         Transaction &operator=(Transaction &other);
         friend DataStore;
-        class Private;
-        Transaction(Private *);
-        Private *d;
+        friend NamedDatabase;
+        Transaction(TransactionBackend *);
+        TransactionBackend *d;
+    };
+
+    /**
+     * The implementation of the storage.
+     *
+     * LmdbBackend: The LMDB environment in the storage root.
+     * MemoryBackend: An ordered map per database with the same semantics, that only lives as long as the process.
+     * It is shared by all instances with the same storage root and name in this process, but it is invisible to other processes.
+     * DefaultBackend: The backend set with setDefaultBackend.
+     */
+    enum Backend
+    {
+        DefaultBackend,
+        LmdbBackend,
+        MemoryBackend
     };
 
-    DataStore(const QString &storageRoot, const QString &name, AccessMode mode = ReadOnly);
-    DataStore(const QString &storageRoot, const DbLayout &layout, AccessMode mode = ReadOnly);
+    DataStore(const QString &storageRoot, const QString &name, AccessMode mode = ReadOnly, Backend backend = DefaultBackend);
+    DataStore(const QString &storageRoot, const DbLayout &layout, AccessMode mode = ReadOnly, Backend backend = DefaultBackend);
     ~DataStore();
 
+    /**
+     * Sets the backend of the instances that don't request one. This is LmdbBackend unless set otherwise.
+     */
+    static void setDefaultBackend(Backend backend);
+
     Transaction createTransaction(AccessMode mode = ReadWrite, const std::function<void(const DataStore::Error &error)> &errorHandler = std::function<void(const DataStore::Error &error)>());
 
     /**
@@ -200,13 +380,77 @@ public:
     qint64 diskUsage() const;
     void removeFromDisk() const;
 
+    /**
+     * Rewrites the environment without its free pages (mdb_env_copy2 with MDB_CP_COMPACT) and replaces the database file with the copy.
+     *
+     * Other processes would keep using the old file, so this fails if any other process has the environment open.
+     * No transaction of this process may be active, and the environment must not be used by other threads meanwhile.
+     */
+    bool compact();
+
     /**
      * Clears all cached environments.
      *
      * This only ever has to be called if a database was removed from another process.
+     * In-memory environments are not affected, they only go away with removeFromDisk.
      */
     static void clearEnv();
 
+    /**
+     * Limits for the size of the memory map of read-write environments.
+     *
+     * The map starts at @param initialSize (or twice the size of the existing data) and is doubled before a read-write transaction starts
+     * if more than half of it is in use, up to @param maximumSize. A transaction that runs out of space anyway is transparently restarted on a larger map.
+     * The initial size only applies to environments that are opened afterwards. Passing 0 restores the defaults.
+     */
+    static void setMapSizeLimits(size_t initialSize, size_t maximumSize);
+
+    /**
+     * The number of finished read-only transactions that are kept per environment, so they can be renewed by the next read-only transaction.
+     *
+     * A pooled transaction doesn't hold on to a snapshot, but it occupies a reader slot of the environment. 0 disables the pool, a negative size restores the default.
+     */
+    static void setReadTransactionPoolSize(int size);
+
+    /**
+     * Operation counters of a named database.
+     */
+    struct DatabaseStatistics {
+        qint64 writes = 0;
+        qint64 removes = 0;
+        qint64 scans = 0;
+        qint64 findLatest = 0;
+        // The rows the scans and lookups went over, including the ones that were not passed to the result handler
+        qint64 rowsVisited = 0;
+        qint64 bytesRead = 0;
+        qint64 bytesWritten = 0;
+    };
+
+    struct EnvironmentStatistics {
+        qint64 commits = 0;
+        // The number of commits by latency, the buckets are: < 100us, < 1ms, < 10ms, < 100ms, < 1s, >= 1s
+        QVector<qint64> commitLatencyHistogram;
+        QMap<QByteArray, DatabaseStatistics> databases;
+    };
+
+    /**
+     * The storage statistics of this process by environment name, accumulated since the process started or resetStatistics was called.
+     */
+    static QMap<QString, EnvironmentStatistics> statistics();
+    static void resetStatistics();
+
+    /**
+     * Sets the durability of the environment @param name in @param storageRoot.
+     *
+     * This applies to all instances of the environment in this process, including ones that are only opened later.
+     */
+    static void setDurability(const QString &storageRoot, const QString &name, Durability durability);
+
+    /**
+     * Syncs everything that has been committed to the environment to disk, if the environment is open for writing in this process.
+     */
+    static bool syncToDisk(const QString &storageRoot, const QString &name);
+
     static qint64 maxRevision(const Transaction &);
     static void setMaxRevision(Transaction &, qint64 revision);
 
@@ -220,17 +464,49 @@ public:
     static void recordUid(DataStore::Transaction &transaction, const QByteArray &uid, const QByteArray &type);
     static void removeUid(DataStore::Transaction &transaction, const QByteArray &uid, const QByteArray &type);
     static void getUids(const QByteArray &type, const Transaction &, const std::function<void(const QByteArray &uid)> &);
+    /**
+     * Returns up to @param limit uids of @param type that sort after @param lastUid.
+     *
+     * This allows to resume a scan over all uids in a later transaction.
+     */
+    static QVector<QByteArray> getUids(const QByteArray &type, const Transaction &, const QByteArray &lastUid, int limit);
 
     bool exists() const;
 
     static bool isInternalKey(const char *key);
     static bool isInternalKey(void *key, int keySize);
     static bool isInternalKey(const QByteArray &key);
+    static bool isInternalKey(const Slice &key);
+
+    /**
+     * Native representation of an integer key, as used by IntegerKeys databases.
+     */
+    static QByteArray sizeTToByteArray(size_t value);
+    static size_t byteArrayToSizeT(const QByteArray &value);
 
+    /**
+     * Keys of the main databases consist of the 16 byte binary uuid followed by the big endian revision.
+     *
+     * uidFromKey and revisionFromKey also understand the textual keys used before database version 4.
+     */
     static QByteArray assembleKey(const QByteArray &key, qint64 revision);
     static QByteArray uidFromKey(const QByteArray &key);
+    static QByteArray uidFromKey(const Slice &key);
     static qint64 revisionFromKey(const QByteArray &key);
 
+    /**
+     * The prefix shared by all main database keys of an entity, for use with findLatest and substring scans.
+     *
+     * Returns an empty prefix if @param uid is not a uuid, which callers must not use for a scan.
+     * assembleKey returns an empty key in that case.
+     */
+    static QByteArray keyPrefix(const QByteArray &uid);
+
+    /**
+     * Returns true for a textual $uid$revision key as written before database version 4.
+     */
+    static bool isLegacyKey(const QByteArray &key);
+
     static NamedDatabase mainDatabase(const Transaction &, const QByteArray &type);
 
     static QByteArray generateUid();
@@ -238,12 +514,19 @@ public:
     static qint64 databaseVersion(const Transaction &);
     static void setDatabaseVersion(Transaction &, qint64 revision);
 
+    /**
+     * Identifies the contents of an environment, because the revisions start over if it is removed and created again.
+     *
+     * Empty for environments that predate it.
+     */
+    static QByteArray generation(const Transaction &);
+    static void setGeneration(Transaction &, const QByteArray &generation);
+
 private:
     std::function<void(const DataStore::Error &error)> mErrorHandler;
 
 private:
-    class Private;
-    Private *const d;
+    StorageBackend *const d;
 };
 
 }
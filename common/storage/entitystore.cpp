@@ -21,6 +21,11 @@
 
 #include <QDir>
 #include <QFile>
+#include <QSaveFile>
+#include <QCryptographicHash>
+#include <QCache>
+#include <QMutex>
+#include <algorithm>
 
 #include "entitybuffer.h"
 #include "log.h"
@@ -32,15 +37,109 @@
 #include "entity_generated.h"
 #include "applicationdomaintype_p.h"
 #include "typeimplementations.h"
+#include "propertyregistry.h"
 
 using namespace Sink;
 using namespace Sink::Storage;
 
+//Blob properties smaller than this are stored inline
+static const int sBlobSizeThreshold = 4096;
+
+//The number of revisions that are cleaned up per transaction
+static const qint64 sCleanupChunkSize = 1000;
+
+//The number of decoded entities that are kept in memory, unless configured otherwise
+static const int sDefaultEntityCacheCapacity = 1000;
+
+/*
+ * A bounded LRU cache of decoded entities, shared by all entity stores of the process.
+ *
+ * Every entry remembers the revision it has been decoded from and is only used while that is the latest revision
+ * that the reading transaction sees, so a cached entity is never newer or older than what the transaction would decode itself.
+ * The cached adaptors are never modified, readers get a (cheap, implicitly shared) copy.
+ */
+class EntityCache
+{
+public:
+    static EntityCache &instance()
+    {
+        static EntityCache cache;
+        return cache;
+    }
+
+    bool isEnabled()
+    {
+        QMutexLocker locker(&mLock);
+        return mCache.maxCost() > 0;
+    }
+
+    QSharedPointer<ApplicationDomain::MemoryBufferAdaptor> lookup(const QByteArray &key, qint64 revision, Sink::Operation *operation = nullptr)
+    {
+        QMutexLocker locker(&mLock);
+        if (!mCache.maxCost()) {
+            return {};
+        }
+        const auto entry = mCache.object(key);
+        if (entry && entry->revision == revision) {
+            mHits++;
+            if (operation) {
+                *operation = entry->operation;
+            }
+            return entry->adaptor;
+        }
+        mMisses++;
+        return {};
+    }
+
+    void insert(const QByteArray &key, qint64 revision, Sink::Operation operation, const QSharedPointer<ApplicationDomain::MemoryBufferAdaptor> &adaptor)
+    {
+        QMutexLocker locker(&mLock);
+        mCache.insert(key, new Entry{revision, operation, adaptor});
+    }
+
+    void invalidate(const QByteArray &key)
+    {
+        QMutexLocker locker(&mLock);
+        mCache.remove(key);
+    }
+
+    void setCapacity(int capacity)
+    {
+        QMutexLocker locker(&mLock);
+        mCache.setMaxCost(qMax(capacity, 0));
+    }
+
+    EntityStore::CacheStatistics statistics()
+    {
+        QMutexLocker locker(&mLock);
+        return {mHits, mMisses, mCache.size(), mCache.maxCost()};
+    }
+
+    void resetStatistics()
+    {
+        QMutexLocker locker(&mLock);
+        mHits = 0;
+        mMisses = 0;
+    }
+
+private:
+    struct Entry {
+        qint64 revision;
+        Sink::Operation operation;
+        QSharedPointer<ApplicationDomain::MemoryBufferAdaptor> adaptor;
+    };
+    QMutex mLock;
+    QCache<QByteArray, Entry> mCache{sDefaultEntityCacheCapacity};
+    qint64 mHits = 0;
+    qint64 mMisses = 0;
+};
+
 static QMap<QByteArray, int> baseDbs()
 {
-    return {{"revisionType", 0},
-            {"revisions", 0},
+    return {{"revisionType", Storage::DataStore::IntegerKeys},
+            {"revisions", Storage::DataStore::IntegerKeys},
             {"uids", 0},
+            {"blobs", 0},
             {"default", 0},
             {"__flagtable", 0}};
 }
@@ -102,6 +201,25 @@ public:
     DataStore::Transaction transaction;
     QHash<QByteArray, QSharedPointer<TypeIndex> > indexByType;
     Sink::Log::Context logCtx;
+    //Blobs that lost their last reference in the current transaction
+    QSet<QByteArray> unreferencedBlobs;
+    //Blobs that have been written to the blob store in the current transaction
+    QSet<QByteArray> createdBlobs;
+    //The max revision of the current transaction, or -1 if it hasn't been read yet
+    qint64 cachedMaxRevision = -1;
+    //The max revision is only written to the store when the transaction is committed
+    bool maxRevisionChanged = false;
+    //The max revision before the current transaction, revisions above it may still be aborted
+    qint64 committedMaxRevision = -1;
+    //The generation of the environment, read once per transaction
+    QByteArray cachedGeneration;
+    bool generationRead = false;
+
+    ~Private()
+    {
+        //In case the transaction is committed implicitly
+        writeMaxRevision();
+    }
 
     bool exists()
     {
@@ -119,6 +237,134 @@ public:
         return transaction;
     }
 
+    qint64 maxRevision()
+    {
+        if (cachedMaxRevision < 0) {
+            cachedMaxRevision = DataStore::maxRevision(getTransaction());
+            committedMaxRevision = cachedMaxRevision;
+        }
+        return cachedMaxRevision;
+    }
+
+    void setMaxRevision(qint64 revision)
+    {
+        cachedMaxRevision = revision;
+        maxRevisionChanged = true;
+    }
+
+    void writeMaxRevision()
+    {
+        if (maxRevisionChanged && transaction) {
+            //The revisions start over if the environment is created again, so it gets a new generation with its first revision
+            if (committedMaxRevision == 0) {
+                DataStore::setGeneration(transaction, DataStore::generateUid());
+            }
+            DataStore::setMaxRevision(transaction, cachedMaxRevision);
+        }
+        maxRevisionChanged = false;
+    }
+
+    void resetTransactionState()
+    {
+        cachedMaxRevision = -1;
+        maxRevisionChanged = false;
+        committedMaxRevision = -1;
+        generationRead = false;
+    }
+
+    QByteArray generation()
+    {
+        if (!generationRead) {
+            cachedGeneration = DataStore::generation(getTransaction());
+            generationRead = true;
+        }
+        return cachedGeneration;
+    }
+
+    /*
+     * The key of an entity in the EntityCache.
+     *
+     * Revisions are only unique within a generation of the environment, so cached entities of a removed environment never match the ones of its successor.
+     */
+    QByteArray cacheKey(const QByteArray &type, const QByteArray &uid)
+    {
+        return resourceContext.instanceId() + "/" + generation() + "/" + type + "/" + DataStore::keyPrefix(uid);
+    }
+
+    QString blobPath(const QByteArray &hash) const
+    {
+        return Sink::blobStorageLocation(resourceContext.instanceId()) + "/" + hash;
+    }
+
+    qint64 blobReferences(const QByteArray &hash)
+    {
+        qint64 count = 0;
+        transaction.openDatabase("blobs").scan(hash,
+            [&](const QByteArray &, const QByteArray &value) -> bool {
+                count = value.toLongLong();
+                return false;
+            },
+            [](const DataStore::Error &error) {
+                if (error.code != DataStore::NotFound) {
+                    SinkWarning() << "Failed to read blob references: " << error.message;
+                }
+            });
+        return count;
+    }
+
+    void addBlobReference(const QByteArray &hash)
+    {
+        transaction.openDatabase("blobs").write(hash, QByteArray::number(blobReferences(hash) + 1));
+    }
+
+    void releaseBlobReference(const QByteArray &hash)
+    {
+        const auto count = blobReferences(hash) - 1;
+        if (count > 0) {
+            transaction.openDatabase("blobs").write(hash, QByteArray::number(count));
+        } else {
+            transaction.openDatabase("blobs").remove(hash);
+            unreferencedBlobs.insert(hash);
+        }
+    }
+
+    /*
+     * Writes @param content to the blob store, unless a blob with the same content already exists.
+     */
+    bool storeBlob(const QByteArray &hash, const QByteArray &content)
+    {
+        const auto path = blobPath(hash);
+        if (QFile::exists(path)) {
+            return true;
+        }
+        QDir{}.mkpath(Sink::blobStorageLocation(resourceContext.instanceId()));
+        QSaveFile file{path};
+        if (!file.open(QIODevice::WriteOnly) || file.write(content) != content.size() || !file.commit()) {
+            SinkWarningCtx(logCtx) << "Failed to write blob: " << path << file.errorString();
+            return false;
+        }
+        createdBlobs.insert(hash);
+        return true;
+    }
+
+    /*
+     * Releases the blobs referenced by a revision that is removed.
+     */
+    void releaseBlobs(const QByteArray &type, const EntityBuffer &buffer)
+    {
+        const auto blobProperties = Sink::Private::PropertyRegistry::instance().blobProperties(type);
+        if (blobProperties.isEmpty() || !buffer.entity().local()) {
+            return;
+        }
+        const auto adaptor = resourceContext.adaptorFactory(type).createAdaptor(buffer.entity());
+        for (const auto &property : blobProperties) {
+            const auto value = adaptor->getProperty(property);
+            if (value.userType() == qMetaTypeId<ApplicationDomain::BLOB>()) {
+                releaseBlobReference(value.value<ApplicationDomain::BLOB>().hash);
+            }
+        }
+    }
+
     template <class T>
     struct ConfigureHelper {
         void operator()(TypeIndex &arg) const {
@@ -150,6 +396,93 @@ public:
         auto adaptor = resourceContext.adaptorFactory(type).createAdaptor(buffer.entity(), &typeIndex(type));
         return ApplicationDomain::ApplicationDomainType{resourceContext.instanceId(), uid, revision, adaptor};
     }
+
+    /*
+     * Positions the cursor on the latest revision of the entity with the given key prefix, without reading any values.
+     */
+    static bool seekLatest(DataStore::NamedDatabase::Cursor &cursor, const QByteArray &prefix)
+    {
+        if (prefix.isEmpty()) {
+            return false;
+        }
+        //The latest revision is the last key before the highest possible revision
+        return (cursor.seek(prefix + QByteArray(sizeof(qint64), '\xFF')) ? cursor.prev() : cursor.seekLast()) && cursor.key().startsWith(prefix);
+    }
+
+    /*
+     * Positions a single cursor on the latest revision of each of the @param uids, sweeping forward over the main database.
+     *
+     * The callback gets all positions in @param uids that requested the entity. Uids that don't exist are skipped.
+     */
+    void sweepLatest(const QByteArray &type, const QVector<QByteArray> &uids, const std::function<void(const QVector<int> &indexes, const DataStore::NamedDatabase::Cursor &cursor)> &callback)
+    {
+        //Sort the requested uids in the order of the database, so the cursor only ever moves forward
+        QVector<QPair<QByteArray, int>> prefixes;
+        prefixes.reserve(uids.size());
+        for (int i = 0; i < uids.size(); i++) {
+            const auto prefix = DataStore::keyPrefix(uids.at(i));
+            //Invalid uids have no prefix and can't exist
+            if (!prefix.isEmpty()) {
+                prefixes.append(qMakePair(prefix, i));
+            }
+        }
+        std::sort(prefixes.begin(), prefixes.end());
+
+        auto db = DataStore::mainDatabase(getTransaction(), type);
+        auto cursor = db.createCursor({}, [&](const DataStore::Error &error) { SinkWarningCtx(logCtx) << "Error during batch read: " << error.message; });
+        QVector<int> indexes;
+        for (int i = 0; i < prefixes.size(); i++) {
+            const auto &prefix = prefixes.at(i).first;
+            indexes.append(prefixes.at(i).second);
+            //The same uid may have been requested multiple times
+            if (i + 1 < prefixes.size() && prefixes.at(i + 1).first == prefix) {
+                continue;
+            }
+            if (seekLatest(cursor, prefix)) {
+                callback(indexes, cursor);
+            }
+            indexes.clear();
+        }
+    }
+
+    /*
+     * Reads the entity the cursor is positioned on, from the EntityCache if it holds that revision.
+     *
+     * A cache hit is validated with the revision in the key, so the value is neither decoded nor decompressed.
+     * Projections don't populate the cache because that would require all properties to be decoded,
+     * and only the latest revision is inserted so reading an older one doesn't evict it.
+     */
+    QSharedPointer<ApplicationDomain::BufferAdaptor> readCached(const QByteArray &type, const QByteArray &uid, const DataStore::NamedDatabase::Cursor &cursor, const QByteArrayList &properties, bool latest, Sink::Operation &operation)
+    {
+        const auto revision = DataStore::revisionFromKey(cursor.key().toRawByteArray());
+        const auto entityCacheKey = cacheKey(type, uid);
+        QSharedPointer<ApplicationDomain::BufferAdaptor> adaptor;
+        if (const auto cached = EntityCache::instance().lookup(entityCacheKey, revision, &operation)) {
+            adaptor = QSharedPointer<ApplicationDomain::MemoryBufferAdaptor>::create(*cached);
+        } else {
+            const auto value = cursor.value();
+            const Sink::EntityBuffer buffer(value.data(), value.size());
+            if (!buffer.isValid()) {
+                SinkWarningCtx(logCtx) << "Read invalid buffer from disk: " << uid;
+                return {};
+            }
+            operation = buffer.operation();
+            adaptor = resourceContext.adaptorFactory(type).createAdaptor(buffer.entity(), &typeIndex(type));
+            maxRevision();
+            //Revisions written by the current transaction may still be aborted, and the revision then reused
+            if (latest && properties.isEmpty() && revision <= committedMaxRevision && EntityCache::instance().isEnabled()) {
+                //The cache outlives the transaction, so it needs an in-memory copy
+                auto copy = QSharedPointer<ApplicationDomain::MemoryBufferAdaptor>::create();
+                ApplicationDomain::copyBuffer(*adaptor, *copy, adaptor->availableProperties(), false);
+                EntityCache::instance().insert(entityCacheKey, revision, operation, copy);
+                adaptor = QSharedPointer<ApplicationDomain::MemoryBufferAdaptor>::create(*copy);
+            }
+        }
+        if (!properties.isEmpty()) {
+            adaptor = QSharedPointer<ApplicationDomain::ProjectedBufferAdaptor>::create(adaptor, properties);
+        }
+        return adaptor;
+    }
 };
 
 EntityStore::EntityStore(const ResourceContext &context, const Log::Context &ctx)
@@ -162,6 +495,7 @@ void EntityStore::startTransaction(Sink::Storage::DataStore::AccessMode accessMo
 {
     SinkTraceCtx(d->logCtx) << "Starting transaction: " << accessMode;
     Q_ASSERT(!d->transaction);
+    d->resetTransactionState();
     d->transaction = Sink::Storage::DataStore(Sink::storageLocation(), dbLayout(d->resourceContext.instanceId()), accessMode).createTransaction(accessMode);
 }
 
@@ -174,15 +508,43 @@ void EntityStore::commitTransaction()
     }
 
     Q_ASSERT(d->transaction);
+    d->writeMaxRevision();
+    //A blob may have been referenced again after it lost its last reference
+    QList<QByteArray> blobsToRemove;
+    for (const auto &hash : d->unreferencedBlobs) {
+        if (!d->blobReferences(hash)) {
+            blobsToRemove << hash;
+        }
+    }
     d->transaction.commit();
     d->transaction = {};
+    d->resetTransactionState();
+
+    //Blobs can only be removed once no committed revision refers to them anymore
+    for (const auto &hash : blobsToRemove) {
+        SinkTraceCtx(d->logCtx) << "Removing unreferenced blob " << hash;
+        QFile::remove(d->blobPath(hash));
+    }
+    d->unreferencedBlobs.clear();
+    d->createdBlobs.clear();
 }
 
 void EntityStore::abortTransaction()
 {
     SinkTraceCtx(d->logCtx) << "Aborting transaction";
+    for (const auto &type : d->indexByType.keys()) {
+        d->typeIndex(type).abortTransaction();
+    }
     d->transaction.abort();
     d->transaction = {};
+    d->resetTransactionState();
+
+    //Blobs written in this transaction can't be referenced by any committed revision
+    for (const auto &hash : d->createdBlobs) {
+        QFile::remove(d->blobPath(hash));
+    }
+    d->unreferencedBlobs.clear();
+    d->createdBlobs.clear();
 }
 
 bool EntityStore::hasTransaction() const
@@ -202,7 +564,7 @@ bool EntityStore::add(const QByteArray &type, ApplicationDomain::ApplicationDoma
     d->typeIndex(type).add(entity.identifier(), entity, d->transaction, d->resourceContext.instanceId());
 
     //The maxRevision may have changed meanwhile if the entity created sub-entities
-    const qint64 newRevision = maxRevision() + 1;
+    const qint64 newRevision = d->maxRevision() + 1;
 
     // Add metadata buffer
     flatbuffers::FlatBufferBuilder metadataFbb;
@@ -213,13 +575,15 @@ bool EntityStore::add(const QByteArray &type, ApplicationDomain::ApplicationDoma
     auto metadataBuffer = metadataBuilder.Finish();
     FinishMetadataBuffer(metadataFbb, metadataBuffer);
 
+    copyBlobs(type, entity);
+
     flatbuffers::FlatBufferBuilder fbb;
     d->resourceContext.adaptorFactory(type).createBuffer(entity, fbb, metadataFbb.GetBufferPointer(), metadataFbb.GetSize());
 
     DataStore::mainDatabase(d->transaction, type)
         .write(DataStore::assembleKey(entity.identifier(), newRevision), BufferUtils::extractBuffer(fbb),
             [&](const DataStore::Error &error) { SinkWarningCtx(d->logCtx) << "Failed to write entity" << entity.identifier() << newRevision; });
-    DataStore::setMaxRevision(d->transaction, newRevision);
+    d->setMaxRevision(newRevision);
     DataStore::recordRevision(d->transaction, newRevision, entity.identifier(), type);
     DataStore::recordUid(d->transaction, entity.identifier(), type);
     SinkTraceCtx(d->logCtx) << "Wrote entity: " << entity.identifier() << type << newRevision;
@@ -269,7 +633,7 @@ bool EntityStore::modify(const QByteArray &type, const ApplicationDomain::Applic
     d->typeIndex(type).remove(current.identifier(), current, d->transaction, d->resourceContext.instanceId());
     d->typeIndex(type).add(newEntity.identifier(), newEntity, d->transaction, d->resourceContext.instanceId());
 
-    const qint64 newRevision = DataStore::maxRevision(d->transaction) + 1;
+    const qint64 newRevision = d->maxRevision() + 1;
 
     // Add metadata buffer
     flatbuffers::FlatBufferBuilder metadataFbb;
@@ -288,14 +652,18 @@ bool EntityStore::modify(const QByteArray &type, const ApplicationDomain::Applic
 
     newEntity.setChangedProperties(newEntity.availableProperties().toSet());
 
+    //After the metadata, so moving the content to the blob store is not recorded as a modification
+    copyBlobs(type, newEntity);
+
     flatbuffers::FlatBufferBuilder fbb;
     d->resourceContext.adaptorFactory(type).createBuffer(newEntity, fbb, metadataFbb.GetBufferPointer(), metadataFbb.GetSize());
 
     DataStore::mainDatabase(d->transaction, type)
         .write(DataStore::assembleKey(newEntity.identifier(), newRevision), BufferUtils::extractBuffer(fbb),
             [&](const DataStore::Error &error) { SinkWarningCtx(d->logCtx) << "Failed to write entity" << newEntity.identifier() << newRevision; });
-    DataStore::setMaxRevision(d->transaction, newRevision);
+    d->setMaxRevision(newRevision);
     DataStore::recordRevision(d->transaction, newRevision, newEntity.identifier(), type);
+    EntityCache::instance().invalidate(d->cacheKey(type, newEntity.identifier()));
     SinkTraceCtx(d->logCtx) << "Wrote modified entity: " << newEntity.identifier() << type << newRevision;
     return true;
 }
@@ -312,7 +680,7 @@ bool EntityStore::remove(const QByteArray &type, const Sink::ApplicationDomain::
 
     SinkTraceCtx(d->logCtx) << "Removed entity " << current;
 
-    const qint64 newRevision = DataStore::maxRevision(d->transaction) + 1;
+    const qint64 newRevision = d->maxRevision() + 1;
 
     // Add metadata buffer
     flatbuffers::FlatBufferBuilder metadataFbb;
@@ -329,24 +697,67 @@ bool EntityStore::remove(const QByteArray &type, const Sink::ApplicationDomain::
     DataStore::mainDatabase(d->transaction, type)
         .write(DataStore::assembleKey(uid, newRevision), BufferUtils::extractBuffer(fbb),
             [&](const DataStore::Error &error) { SinkWarningCtx(d->logCtx) << "Failed to write entity" << uid << newRevision; });
-    DataStore::setMaxRevision(d->transaction, newRevision);
+    d->setMaxRevision(newRevision);
     DataStore::recordRevision(d->transaction, newRevision, uid, type);
     DataStore::removeUid(d->transaction, uid, type);
+    EntityCache::instance().invalidate(d->cacheKey(type, uid));
     return true;
 }
 
-void EntityStore::cleanupEntityRevisionsUntil(qint64 revision)
+static bool isValidBlobHash(const QByteArray &hash)
 {
-    const auto uid = DataStore::getUidFromRevision(d->transaction, revision);
-    const auto bufferType = DataStore::getTypeFromRevision(d->transaction, revision);
-    if (bufferType.isEmpty() || uid.isEmpty()) {
-        SinkErrorCtx(d->logCtx) << "Failed to find revision during cleanup: " << revision;
-        Q_ASSERT(false);
-        return;
+    if (hash.size() != 64) {
+        return false;
     }
+    for (const auto c : hash) {
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void EntityStore::copyBlobs(const QByteArray &type, ApplicationDomain::ApplicationDomainType &entity)
+{
+    for (const auto &property : Sink::Private::PropertyRegistry::instance().blobProperties(type)) {
+        const auto value = entity.getRawProperty(property);
+        if (!value.isValid()) {
+            continue;
+        }
+        if (value.userType() == qMetaTypeId<ApplicationDomain::BLOB>()) {
+            //The blob is already in the blob store, the new revision just adds a reference
+            const auto hash = value.value<ApplicationDomain::BLOB>().hash;
+            if (!isValidBlobHash(hash) || !QFile::exists(d->blobPath(hash))) {
+                SinkWarningCtx(d->logCtx) << "Dropping reference to a missing blob: " << property << hash;
+                entity.setProperty(property, QVariant{});
+                continue;
+            }
+            d->addBlobReference(hash);
+        } else {
+            const auto content = value.toByteArray();
+            //Small values are cheaper to keep inline
+            if (content.size() < sBlobSizeThreshold) {
+                continue;
+            }
+            const auto hash = QCryptographicHash::hash(content, QCryptographicHash::Sha256).toHex();
+            if (!d->storeBlob(hash, content)) {
+                continue;
+            }
+            d->addBlobReference(hash);
+            entity.setProperty(property, QVariant::fromValue(ApplicationDomain::BLOB{hash}));
+        }
+    }
+}
+
+void EntityStore::cleanupEntityRevisionsUntil(DataStore::NamedDatabase &db, const QByteArray &bufferType, const QByteArray &uid, qint64 revision)
+{
     SinkTraceCtx(d->logCtx) << "Cleaning up revision " << revision << uid << bufferType;
-    DataStore::mainDatabase(d->transaction, bufferType)
-        .scan(uid,
+    const auto prefix = DataStore::keyPrefix(uid);
+    if (prefix.isEmpty()) {
+        SinkWarningCtx(d->logCtx) << "Not a valid uid: " << uid;
+        return;
+    }
+    db.scan(prefix,
             [&](const QByteArray &key, const QByteArray &data) -> bool {
                 EntityBuffer buffer(const_cast<const char *>(data.data()), data.size());
                 if (!buffer.isValid()) {
@@ -354,14 +765,21 @@ void EntityStore::cleanupEntityRevisionsUntil(qint64 revision)
                 } else {
                     const auto metadata = flatbuffers::GetRoot<Metadata>(buffer.metadataBuffer());
                     const qint64 rev = metadata->revision();
+                    //Don't cleanup more than specified
+                    if (rev > revision) {
+                        return false;
+                    }
                     const auto isRemoval = metadata->operation() == Operation_Removal;
                     // Remove old revisions, and the current if the entity has already been removed
                     if (rev < revision || isRemoval) {
+                        d->releaseBlobs(bufferType, buffer);
                         DataStore::removeRevision(d->transaction, rev);
-                        DataStore::mainDatabase(d->transaction, bufferType).remove(key);
+                        db.remove(key);
+                        if (isRemoval) {
+                            EntityCache::instance().invalidate(d->cacheKey(bufferType, uid));
+                        }
                     }
-                    //Don't cleanup more than specified
-                    if (rev >= revision) {
+                    if (rev == revision) {
                         return false;
                     }
                 }
@@ -369,10 +787,50 @@ void EntityStore::cleanupEntityRevisionsUntil(qint64 revision)
                 return true;
             },
             [&](const DataStore::Error &error) { SinkWarningCtx(d->logCtx) << "Error while reading: " << error.message; }, true);
-    DataStore::setCleanedUpRevision(d->transaction, revision);
 }
 
-bool EntityStore::cleanupRevisions(qint64 revision)
+void EntityStore::cleanupRevisionRange(qint64 firstRevision, qint64 lastRevision)
+{
+    struct Latest {
+        QByteArray prefix;
+        QByteArray uid;
+        qint64 revision;
+    };
+    //The latest revision in the range of every uid, grouped by type
+    QHash<QByteArray, QHash<QByteArray, Latest>> latestByType;
+    {
+        //Both tables are keyed by revision, so we can sweep over them in parallel
+        const auto upperBound = DataStore::sizeTToByteArray(lastRevision + 1);
+        auto uids = d->transaction.openDatabase("revisions", {}, DataStore::IntegerKeys).createCursor(upperBound);
+        auto types = d->transaction.openDatabase("revisionType", {}, DataStore::IntegerKeys).createCursor(upperBound);
+        const auto start = DataStore::sizeTToByteArray(firstRevision);
+        for (bool valid = uids.seek(start) && types.seek(start); valid; valid = uids.next() && types.next()) {
+            if (uids.key().toRawByteArray() != types.key().toRawByteArray()) {
+                SinkErrorCtx(d->logCtx) << "The revision tables are out of sync: " << DataStore::byteArrayToSizeT(uids.key().toRawByteArray());
+                Q_ASSERT(false);
+                break;
+            }
+            const auto uid = uids.value().toByteArray();
+            //Later revisions of the same uid replace the earlier ones
+            latestByType[types.value().toByteArray()][uid] = Latest{DataStore::keyPrefix(uid), uid, static_cast<qint64>(DataStore::byteArrayToSizeT(uids.key().toRawByteArray()))};
+        }
+    }
+
+    for (auto it = latestByType.constBegin(); it != latestByType.constEnd(); it++) {
+        //Visit the entities in the order of the main database
+        auto entities = it.value().values();
+        std::sort(entities.begin(), entities.end(), [](const Latest &a, const Latest &b) {
+            return a.prefix < b.prefix;
+        });
+        auto db = DataStore::mainDatabase(d->transaction, it.key());
+        for (const auto &entity : entities) {
+            cleanupEntityRevisionsUntil(db, it.key(), entity.uid, entity.revision);
+        }
+    }
+    DataStore::setCleanedUpRevision(d->transaction, lastRevision);
+}
+
+bool EntityStore::cleanupRevisions(qint64 revision, qint64 batchSize, bool *complete)
 {
     bool implicitTransaction = false;
     if (!d->transaction) {
@@ -381,16 +839,29 @@ bool EntityStore::cleanupRevisions(qint64 revision)
     }
     const auto lastCleanRevision = DataStore::cleanedUpRevision(d->transaction);
     const auto firstRevisionToCleanup = lastCleanRevision + 1;
-    bool cleanupIsNecessary = firstRevisionToCleanup <= revision;
+    const auto lastRevisionToCleanup = batchSize > 0 ? qMin(revision, lastCleanRevision + batchSize) : revision;
+    bool cleanupIsNecessary = firstRevisionToCleanup <= lastRevisionToCleanup;
     if (cleanupIsNecessary) {
-        SinkTraceCtx(d->logCtx) << "Cleaning up from " << firstRevisionToCleanup << " to " << revision;
-        for (qint64 rev = firstRevisionToCleanup; rev <= revision; rev++) {
-            cleanupEntityRevisionsUntil(rev);
+        SinkTraceCtx(d->logCtx) << "Cleaning up from " << firstRevisionToCleanup << " to " << lastRevisionToCleanup;
+        for (qint64 first = firstRevisionToCleanup; first <= lastRevisionToCleanup; first += sCleanupChunkSize) {
+            const auto last = qMin(lastRevisionToCleanup, first + sCleanupChunkSize - 1);
+            cleanupRevisionRange(first, last);
+            if (last < lastRevisionToCleanup) {
+                SinkLogCtx(d->logCtx) << "Cleaned up revisions until " << last << " out of " << revision;
+                //Commit every chunk, so the transaction doesn't grow without bounds
+                if (implicitTransaction) {
+                    commitTransaction();
+                    startTransaction(Sink::Storage::DataStore::ReadWrite);
+                }
+            }
         }
     }
     if (implicitTransaction) {
         commitTransaction();
     }
+    if (complete) {
+        *complete = lastRevisionToCleanup >= revision;
+    }
     return cleanupIsNecessary;
 }
 
@@ -401,23 +872,24 @@ QVector<QByteArray> EntityStore::fullScan(const QByteArray &type)
         SinkTraceCtx(d->logCtx) << "Database is not existing: " << type;
         return QVector<QByteArray>();
     }
-    //The scan can return duplicate results if we have multiple revisions, so we use a set to deduplicate.
-    QSet<QByteArray> keys;
+    //The scan returns every revision, but since all revisions of an entity are adjacent we only have to compare with the previous key.
+    QVector<QByteArray> keys;
+    QByteArray currentPrefix;
     DataStore::mainDatabase(d->getTransaction(), type)
         .scan(QByteArray(),
-            [&](const QByteArray &key, const QByteArray &value) -> bool {
-                const auto uid = DataStore::uidFromKey(key);
-                if (keys.contains(uid)) {
-                    //Not something that should persist if the replay works, so we keep a message for now.
-                    SinkTraceCtx(d->logCtx) << "Multiple revisions for key: " << key;
+            [&](const Slice &key, const Slice &) -> bool {
+                if (!currentPrefix.isEmpty() && key.startsWith(currentPrefix)) {
+                    return true;
                 }
+                const auto uid = DataStore::uidFromKey(key);
+                currentPrefix = DataStore::keyPrefix(uid);
                 keys << uid;
                 return true;
             },
             [&](const DataStore::Error &error) { SinkWarningCtx(d->logCtx) << "Error during query: " << error.message; });
 
     SinkTraceCtx(d->logCtx) << "Full scan retrieved " << keys.size() << " results.";
-    return keys.toList().toVector();
+    return keys;
 }
 
 QVector<QByteArray> EntityStore::indexLookup(const QByteArray &type, const QueryBase &query, QSet<QByteArray> &appliedFilters, QByteArray &appliedSorting)
@@ -461,7 +933,7 @@ void EntityStore::readLatest(const QByteArray &type, const QByteArray &uid, cons
 {
     Q_ASSERT(d);
     auto db = DataStore::mainDatabase(d->getTransaction(), type);
-    db.findLatest(uid,
+    db.findLatest(DataStore::keyPrefix(uid),
         [=](const QByteArray &key, const QByteArray &value) {
             callback(DataStore::uidFromKey(key), Sink::EntityBuffer(value.data(), value.size()));
         },
@@ -470,18 +942,47 @@ void EntityStore::readLatest(const QByteArray &type, const QByteArray &uid, cons
 
 void EntityStore::readLatest(const QByteArray &type, const QByteArray &uid, const std::function<void(const ApplicationDomain::ApplicationDomainType &)> callback)
 {
-    readLatest(type, uid, [&](const QByteArray &uid, const EntityBuffer &buffer) {
-        //TODO cache max revision for the duration of the transaction.
-        callback(d->createApplicationDomainType(type, uid, DataStore::maxRevision(d->getTransaction()), buffer));
+    readLatest(type, uid, QByteArrayList{}, [&](const ApplicationDomain::ApplicationDomainType &entity, Sink::Operation) {
+        callback(entity);
     });
 }
 
 void EntityStore::readLatest(const QByteArray &type, const QByteArray &uid, const std::function<void(const ApplicationDomain::ApplicationDomainType &, Sink::Operation)> callback)
 {
-    readLatest(type, uid, [&](const QByteArray &uid, const EntityBuffer &buffer) {
-        //TODO cache max revision for the duration of the transaction.
-        callback(d->createApplicationDomainType(type, uid, DataStore::maxRevision(d->getTransaction()), buffer), buffer.operation());
-    });
+    readLatest(type, uid, QByteArrayList{}, callback);
+}
+
+void EntityStore::readLatest(const QByteArray &type, const QByteArray &uid, const QByteArrayList &properties, const std::function<void(const ApplicationDomain::ApplicationDomainType &, Sink::Operation)> callback)
+{
+    Q_ASSERT(d);
+    auto db = DataStore::mainDatabase(d->getTransaction(), type);
+    auto cursor = db.createCursor({}, [&](const DataStore::Error &error) { SinkWarningCtx(d->logCtx) << "Error during query: " << error.message << uid; });
+    if (!Private::seekLatest(cursor, DataStore::keyPrefix(uid))) {
+        return;
+    }
+    Sink::Operation operation = Operation_Creation;
+    if (const auto adaptor = d->readCached(type, uid, cursor, properties, true, operation)) {
+        callback(ApplicationDomain::ApplicationDomainType{d->resourceContext.instanceId(), uid, d->maxRevision(), adaptor}, operation);
+    }
+}
+
+void EntityStore::readLatestUntil(const QByteArray &type, const QByteArray &uid, qint64 revision, const QByteArrayList &properties, const std::function<void(const ApplicationDomain::ApplicationDomainType &, Sink::Operation)> callback)
+{
+    Q_ASSERT(d);
+    const auto prefix = DataStore::keyPrefix(uid);
+    if (prefix.isEmpty()) {
+        return;
+    }
+    auto db = DataStore::mainDatabase(d->getTransaction(), type);
+    auto cursor = db.createCursor({}, [&](const DataStore::Error &error) { SinkWarningCtx(d->logCtx) << "Error during query: " << error.message << uid; });
+    //The revision we're looking for is the last key before the key of the next revision
+    if (!(cursor.seek(DataStore::assembleKey(uid, revision + 1)) ? cursor.prev() : cursor.seekLast()) || !cursor.key().startsWith(prefix)) {
+        return;
+    }
+    Sink::Operation operation = Operation_Creation;
+    if (const auto adaptor = d->readCached(type, uid, cursor, properties, false, operation)) {
+        callback(ApplicationDomain::ApplicationDomainType{d->resourceContext.instanceId(), uid, revision, adaptor}, operation);
+    }
 }
 
 ApplicationDomain::ApplicationDomainType EntityStore::readLatest(const QByteArray &type, const QByteArray &uid)
@@ -493,6 +994,77 @@ ApplicationDomain::ApplicationDomainType EntityStore::readLatest(const QByteArra
     return dt;
 }
 
+void EntityStore::readLatestBatch(const QByteArray &type, const QVector<QByteArray> &uids, const std::function<void(const QByteArray &uid, const EntityBuffer &entity)> &callback, bool keyOrder)
+{
+    Q_ASSERT(d);
+    QVector<QByteArray> buffers;
+    if (!keyOrder) {
+        buffers.resize(uids.size());
+    }
+    d->sweepLatest(type, uids, [&](const QVector<int> &indexes, const DataStore::NamedDatabase::Cursor &cursor) {
+        const auto value = cursor.value();
+        if (keyOrder) {
+            callback(uids.at(indexes.first()), Sink::EntityBuffer(value.data(), value.size()));
+            return;
+        }
+        const QByteArray buffer(value.data(), value.size());
+        for (const auto index : indexes) {
+            buffers[index] = buffer;
+        }
+    });
+
+    if (!keyOrder) {
+        for (int i = 0; i < buffers.size(); i++) {
+            const auto &buffer = buffers.at(i);
+            if (!buffer.isEmpty()) {
+                callback(uids.at(i), Sink::EntityBuffer(buffer.constData(), buffer.size()));
+            }
+        }
+    }
+}
+
+void EntityStore::readLatestBatch(const QByteArray &type, const QVector<QByteArray> &uids, const std::function<void(const ApplicationDomain::ApplicationDomainType &entity)> &callback, bool keyOrder)
+{
+    readLatestBatch(type, uids, QByteArrayList{}, [&](const ApplicationDomain::ApplicationDomainType &entity, Sink::Operation) {
+        callback(entity);
+    }, keyOrder);
+}
+
+void EntityStore::readLatestBatch(const QByteArray &type, const QVector<QByteArray> &uids, const QByteArrayList &properties, const std::function<void(const ApplicationDomain::ApplicationDomainType &entity, Sink::Operation)> &callback, bool keyOrder)
+{
+    Q_ASSERT(d);
+    const auto maxRevision = d->maxRevision();
+    //Unlike the buffers, the entities remain valid until the transaction ends, so they don't need to be copied to restore the order
+    QVector<QPair<ApplicationDomain::ApplicationDomainType, Sink::Operation>> entities;
+    if (!keyOrder) {
+        entities.resize(uids.size());
+    }
+    d->sweepLatest(type, uids, [&](const QVector<int> &indexes, const DataStore::NamedDatabase::Cursor &cursor) {
+        const auto uid = uids.at(indexes.first());
+        Sink::Operation operation = Operation_Creation;
+        const auto adaptor = d->readCached(type, uid, cursor, properties, true, operation);
+        if (!adaptor) {
+            return;
+        }
+        const ApplicationDomain::ApplicationDomainType entity{d->resourceContext.instanceId(), uid, maxRevision, adaptor};
+        if (keyOrder) {
+            callback(entity, operation);
+            return;
+        }
+        for (const auto index : indexes) {
+            entities[index] = qMakePair(entity, operation);
+        }
+    });
+
+    if (!keyOrder) {
+        for (const auto &entity : entities) {
+            if (!entity.first.identifier().isEmpty()) {
+                callback(entity.first, entity.second);
+            }
+        }
+    }
+}
+
 void EntityStore::readEntity(const QByteArray &type, const QByteArray &key, const std::function<void(const QByteArray &uid, const EntityBuffer &entity)> callback)
 {
     auto db = DataStore::mainDatabase(d->getTransaction(), type);
@@ -504,11 +1076,24 @@ void EntityStore::readEntity(const QByteArray &type, const QByteArray &key, cons
         [&](const DataStore::Error &error) { SinkWarningCtx(d->logCtx) << "Error during query: " << error.message << key; });
 }
 
-void EntityStore::readEntity(const QByteArray &type, const QByteArray &uid, const std::function<void(const ApplicationDomain::ApplicationDomainType &)> callback)
+void EntityStore::readEntity(const QByteArray &type, const QByteArray &key, const std::function<void(const ApplicationDomain::ApplicationDomainType &)> callback)
 {
-    readEntity(type, uid, [&](const QByteArray &uid, const EntityBuffer &buffer) {
-        callback(d->createApplicationDomainType(type, uid, DataStore::maxRevision(d->getTransaction()), buffer));
-    });
+    auto db = DataStore::mainDatabase(d->getTransaction(), type);
+    auto cursor = db.createCursor({}, [&](const DataStore::Error &error) { SinkWarningCtx(d->logCtx) << "Error during query: " << error.message << key; });
+    if (!cursor.seek(key) || cursor.key().toRawByteArray() != key) {
+        return;
+    }
+    const auto uid = DataStore::uidFromKey(key);
+    //Only the latest revision is cached, which is the one if the next key belongs to another entity
+    const bool valid = cursor.next();
+    const bool latest = !valid || !cursor.key().startsWith(DataStore::keyPrefix(uid));
+    if (!(valid ? cursor.prev() : cursor.seekLast())) {
+        return;
+    }
+    Sink::Operation operation = Operation_Creation;
+    if (const auto adaptor = d->readCached(type, uid, cursor, {}, latest, operation)) {
+        callback(ApplicationDomain::ApplicationDomainType{d->resourceContext.instanceId(), uid, d->maxRevision(), adaptor});
+    }
 }
 
 ApplicationDomain::ApplicationDomainType EntityStore::readEntity(const QByteArray &type, const QByteArray &uid)
@@ -521,17 +1106,43 @@ ApplicationDomain::ApplicationDomainType EntityStore::readEntity(const QByteArra
 }
 
 
+void EntityStore::readAllLatest(const QByteArray &type, const std::function<void(const QByteArray &uid, const EntityBuffer &entity)> &callback)
+{
+    auto db = DataStore::mainDatabase(d->getTransaction(), type);
+    auto cursor = db.createCursor({}, [&](const DataStore::Error &error) { SinkWarningCtx(d->logCtx) << "Error during read: " << error.message; });
+    bool valid = cursor.seek();
+    while (valid) {
+        const auto uid = DataStore::uidFromKey(cursor.key());
+        const auto prefix = DataStore::keyPrefix(uid);
+        //The revisions of an entity are adjacent, so the latest one is right before the first key of the next entity
+        while ((valid = cursor.next()) && cursor.key().startsWith(prefix)) {
+        }
+        if (!(valid ? cursor.prev() : cursor.seekLast())) {
+            break;
+        }
+        const auto value = cursor.value();
+        const Sink::EntityBuffer buffer(value.data(), value.size());
+        if (!buffer.isValid()) {
+            SinkWarningCtx(d->logCtx) << "Read invalid buffer from disk: " << uid;
+        } else if (buffer.operation() != Operation_Removal) {
+            callback(uid, buffer);
+        }
+        valid = cursor.next();
+    }
+}
+
 void EntityStore::readAll(const QByteArray &type, const std::function<void(const ApplicationDomain::ApplicationDomainType &entity)> &callback)
 {
-    readAllUids(type, [&] (const QByteArray &uid) {
-        readLatest(type, uid, callback);
+    const auto maxRevision = d->maxRevision();
+    readAllLatest(type, [&](const QByteArray &uid, const EntityBuffer &buffer) {
+        callback(d->createApplicationDomainType(type, uid, maxRevision, buffer));
     });
 }
 
 void EntityStore::readRevisions(qint64 baseRevision, const QByteArray &expectedType, const std::function<void(const QByteArray &key)> &callback)
 {
     qint64 revisionCounter = baseRevision;
-    const qint64 topRevision = DataStore::maxRevision(d->getTransaction());
+    const qint64 topRevision = d->maxRevision();
     // Spit out the revision keys one by one.
     while (revisionCounter <= topRevision) {
         const auto uid = DataStore::getUidFromRevision(d->getTransaction(), revisionCounter);
@@ -552,9 +1163,13 @@ void EntityStore::readRevisions(qint64 baseRevision, const QByteArray &expectedT
 
 void EntityStore::readPrevious(const QByteArray &type, const QByteArray &uid, qint64 revision, const std::function<void(const QByteArray &uid, const EntityBuffer &entity)> callback)
 {
+    const auto prefix = DataStore::keyPrefix(uid);
+    if (prefix.isEmpty()) {
+        return;
+    }
     auto db = DataStore::mainDatabase(d->getTransaction(), type);
     qint64 latestRevision = 0;
-    db.scan(uid,
+    db.scan(prefix,
         [&latestRevision, revision](const QByteArray &key, const QByteArray &) -> bool {
             const auto foundRevision = Sink::Storage::DataStore::revisionFromKey(key);
             if (foundRevision < revision && foundRevision > latestRevision) {
@@ -569,7 +1184,7 @@ void EntityStore::readPrevious(const QByteArray &type, const QByteArray &uid, qi
 void EntityStore::readPrevious(const QByteArray &type, const QByteArray &uid, qint64 revision, const std::function<void(const ApplicationDomain::ApplicationDomainType &)> callback)
 {
     readPrevious(type, uid, revision, [&](const QByteArray &uid, const EntityBuffer &buffer) {
-        callback(d->createApplicationDomainType(type, uid, DataStore::maxRevision(d->getTransaction()), buffer));
+        callback(d->createApplicationDomainType(type, uid, d->maxRevision(), buffer));
     });
 }
 
@@ -587,9 +1202,22 @@ void EntityStore::readAllUids(const QByteArray &type, const std::function<void(c
     DataStore::getUids(type, d->getTransaction(), callback);
 }
 
+QVector<QByteArray> EntityStore::readUids(const QByteArray &type, const QByteArray &lastUid, int limit)
+{
+    if (!d->exists()) {
+        SinkTraceCtx(d->logCtx) << "Database is not existing: " << type;
+        return {};
+    }
+    return DataStore::getUids(type, d->getTransaction(), lastUid, limit);
+}
+
 bool EntityStore::contains(const QByteArray &type, const QByteArray &uid)
 {
-    return DataStore::mainDatabase(d->getTransaction(), type).contains(uid);
+    const auto prefix = DataStore::keyPrefix(uid);
+    if (prefix.isEmpty()) {
+        return false;
+    }
+    return DataStore::mainDatabase(d->getTransaction(), type).contains(prefix);
 }
 
 bool EntityStore::exists(const QByteArray &type, const QByteArray &uid)
@@ -597,7 +1225,7 @@ bool EntityStore::exists(const QByteArray &type, const QByteArray &uid)
     bool found = false;
     bool alreadyRemoved = false;
     DataStore::mainDatabase(d->transaction, type)
-        .findLatest(uid,
+        .findLatest(DataStore::keyPrefix(uid),
             [&found, &alreadyRemoved](const QByteArray &key, const QByteArray &data) {
                 auto entity = GetEntity(data.data());
                 if (entity && entity->metadata()) {
@@ -623,14 +1251,29 @@ bool EntityStore::exists(const QByteArray &type, const QByteArray &uid)
 
 qint64 EntityStore::maxRevision()
 {
-    if (!d->exists()) {
+    if (!d->transaction && !d->exists()) {
         SinkTraceCtx(d->logCtx) << "Database is not existing.";
         return 0;
     }
-    return DataStore::maxRevision(d->getTransaction());
+    return d->maxRevision();
 }
 
 Sink::Log::Context EntityStore::logContext() const
 {
     return d->logCtx;
 }
+
+EntityStore::CacheStatistics EntityStore::cacheStatistics()
+{
+    return EntityCache::instance().statistics();
+}
+
+void EntityStore::resetCacheStatistics()
+{
+    EntityCache::instance().resetStatistics();
+}
+
+void EntityStore::setCacheCapacity(int capacity)
+{
+    EntityCache::instance().setCapacity(capacity);
+}
@@ -44,7 +44,16 @@ public:
     bool modify(const QByteArray &type, const ApplicationDomain::ApplicationDomainType &diff, const QByteArrayList &deletions, bool replayToSource);
     bool modify(const QByteArray &type, const ApplicationDomain::ApplicationDomainType &current, ApplicationDomain::ApplicationDomainType newEntity, bool replayToSource);
     bool remove(const QByteArray &type, const ApplicationDomain::ApplicationDomainType &current, bool replayToSource);
-    bool cleanupRevisions(qint64 revision);
+    /**
+     * Removes the outdated revisions and removals up to @param revision.
+     *
+     * The revision table is swept once and the revisions are grouped by uid, so every entity is only cleaned up once per chunk.
+     * Without a running transaction every chunk of revisions is committed separately.
+     * At most @param batchSize revisions are processed (all if 0), and @param complete is set to whether the cleanup has reached @param revision.
+     *
+     * @return true if anything has been cleaned up.
+     */
+    bool cleanupRevisions(qint64 revision, qint64 batchSize = 0, bool *complete = nullptr);
     ApplicationDomain::ApplicationDomainType applyDiff(const QByteArray &type, const ApplicationDomain::ApplicationDomainType &current, const ApplicationDomain::ApplicationDomainType &diff, const QByteArrayList &deletions) const;
 
     void startTransaction(Sink::Storage::DataStore::AccessMode);
@@ -64,16 +73,40 @@ public:
     void readLatest(const QByteArray &type, const QByteArray &uid, const std::function<void(const QByteArray &uid, const EntityBuffer &entity)> callback);
     void readLatest(const QByteArray &type, const QByteArray &uid, const std::function<void(const ApplicationDomain::ApplicationDomainType &entity)> callback);
     void readLatest(const QByteArray &type, const QByteArray &uid, const std::function<void(const ApplicationDomain::ApplicationDomainType &entity, Sink::Operation)> callback);
+    /**
+     * Only the @param properties of the entity are available, and each of them is decoded at most once.
+     *
+     * An empty list of properties makes all properties available.
+     */
+    void readLatest(const QByteArray &type, const QByteArray &uid, const QByteArrayList &properties, const std::function<void(const ApplicationDomain::ApplicationDomainType &entity, Sink::Operation)> callback);
+
+    /**
+     * Like readLatest, but reads the latest revision that is not newer than @param revision.
+     *
+     * Nothing is read if the entity didn't exist yet at that revision.
+     */
+    void readLatestUntil(const QByteArray &type, const QByteArray &uid, qint64 revision, const QByteArrayList &properties, const std::function<void(const ApplicationDomain::ApplicationDomainType &entity, Sink::Operation)> callback);
 
     ApplicationDomain::ApplicationDomainType readLatest(const QByteArray &type, const QByteArray &uid);
 
+    /**
+     * Read the latest revision of all @param uids with a single cursor that sweeps forward over the main database.
+     *
+     * Uids that don't exist are skipped. With @param keyOrder the entities are delivered in the order of the database,
+     * otherwise in the order of @param uids, which requires that the buffers are copied until all have been read.
+     * The entities are read through the entity cache like with readLatest.
+     */
+    void readLatestBatch(const QByteArray &type, const QVector<QByteArray> &uids, const std::function<void(const QByteArray &uid, const EntityBuffer &entity)> &callback, bool keyOrder = false);
+    void readLatestBatch(const QByteArray &type, const QVector<QByteArray> &uids, const std::function<void(const ApplicationDomain::ApplicationDomainType &entity)> &callback, bool keyOrder = false);
+    void readLatestBatch(const QByteArray &type, const QVector<QByteArray> &uids, const QByteArrayList &properties, const std::function<void(const ApplicationDomain::ApplicationDomainType &entity, Sink::Operation)> &callback, bool keyOrder = false);
+
     template<typename T>
     T readLatest(const QByteArray &uid) {
         return T(readLatest(ApplicationDomain::getTypeName<T>(), uid));
     }
 
     void readEntity(const QByteArray &type, const QByteArray &uid, const std::function<void(const QByteArray &uid, const EntityBuffer &entity)> callback);
-    void readEntity(const QByteArray &type, const QByteArray &uid, const std::function<void(const ApplicationDomain::ApplicationDomainType &entity)> callback);
+    void readEntity(const QByteArray &type, const QByteArray &key, const std::function<void(const ApplicationDomain::ApplicationDomainType &entity)> callback);
     ApplicationDomain::ApplicationDomainType readEntity(const QByteArray &type, const QByteArray &key);
 
     template<typename T>
@@ -93,6 +126,18 @@ public:
 
     void readAllUids(const QByteArray &type, const std::function<void(const QByteArray &uid)> callback);
 
+    /**
+     * Reads up to @param limit uids of @param type that sort after @param lastUid, so a scan over all uids can be resumed in a later transaction.
+     */
+    QVector<QByteArray> readUids(const QByteArray &type, const QByteArray &lastUid, int limit);
+
+    /**
+     * Reads the latest revision of every entity of @param type in a single forward pass over the main database.
+     *
+     * Entities that have been removed are skipped.
+     */
+    void readAllLatest(const QByteArray &type, const std::function<void(const QByteArray &uid, const EntityBuffer &entity)> &callback);
+
     void readAll(const QByteArray &type, const std::function<void(const ApplicationDomain::ApplicationDomainType &entity)> &callback);
 
     template<typename T>
@@ -114,12 +159,37 @@ public:
 
     Sink::Log::Context logContext() const;
 
+    struct CacheStatistics {
+        qint64 hits;
+        qint64 misses;
+        int size;
+        int capacity;
+    };
+
+    /**
+     * The statistics of the decoded-entity cache used by readLatest, which is shared by all entity stores of the process.
+     */
+    static CacheStatistics cacheStatistics();
+    static void resetCacheStatistics();
+
+    /**
+     * Sets the maximum number of decoded entities that are cached, 0 disables the cache.
+     */
+    static void setCacheCapacity(int capacity);
+
 private:
     /*
-     * Remove any old revisions of the same entity up until @param revision
+     * Remove the revisions from @param firstRevision to @param lastRevision, if they are outdated or removals
+     */
+    void cleanupRevisionRange(qint64 firstRevision, qint64 lastRevision);
+    /*
+     * Remove any old revisions of the entity up until @param revision, and @param revision itself if it is a removal
+     */
+    void cleanupEntityRevisionsUntil(DataStore::NamedDatabase &db, const QByteArray &bufferType, const QByteArray &uid, qint64 revision);
+    /*
+     * Move the content of blob properties to the blob store and reference them from @param entity
      */
-    void cleanupEntityRevisionsUntil(qint64 revision);
-    void copyBlobs(ApplicationDomain::ApplicationDomainType &entity, qint64 newRevision);
+    void copyBlobs(const QByteArray &type, ApplicationDomain::ApplicationDomainType &entity);
     class Private;
     const QSharedPointer<Private> d;
 };
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2017 Christian Mollekopf <mollekopf@kolabsys.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "valuecodec.h"
+
+#include <zlib.h>
+
+#include "log.h"
+
+using namespace Sink::Storage;
+
+static const int sHeaderSize = 8;
+//Compressing small values is not worth the header and the cpu time
+static const int sMinimumCompressionSize = 128;
+
+static void writeHeader(char *header, ValueCodec::Codec codec, quint32 size)
+{
+    header[0] = static_cast<char>(codec);
+    header[1] = 's';
+    header[2] = 'c';
+    header[3] = '\xFF';
+    for (int i = 0; i < 4; i++) {
+        header[4 + i] = static_cast<char>((size >> (8 * i)) & 0xFF);
+    }
+}
+
+static quint32 readSize(const char *header)
+{
+    quint32 size = 0;
+    for (int i = 0; i < 4; i++) {
+        size |= static_cast<quint32>(static_cast<unsigned char>(header[4 + i])) << (8 * i);
+    }
+    return size;
+}
+
+static QByteArray stored(const QByteArray &value)
+{
+    QByteArray result(sHeaderSize + value.size(), Qt::Uninitialized);
+    writeHeader(result.data(), ValueCodec::Stored, value.size());
+    memcpy(result.data() + sHeaderSize, value.constData(), value.size());
+    return result;
+}
+
+bool ValueCodec::isEncoded(const Slice &value)
+{
+    return value.size() >= static_cast<size_t>(sHeaderSize) && value.data()[1] == 's' && value.data()[2] == 'c' && value.data()[3] == '\xFF';
+}
+
+QByteArray ValueCodec::encode(const QByteArray &value)
+{
+    if (value.size() < sMinimumCompressionSize) {
+        //Values that happen to look like an encoded value need a header so we can tell them apart
+        if (isEncoded(Slice{value.constData(), static_cast<size_t>(value.size())})) {
+            return stored(value);
+        }
+        return value;
+    }
+
+    uLongf compressedSize = compressBound(value.size());
+    QByteArray result(sHeaderSize + compressedSize, Qt::Uninitialized);
+    const int rc = compress2(reinterpret_cast<Bytef *>(result.data() + sHeaderSize), &compressedSize,
+        reinterpret_cast<const Bytef *>(value.constData()), value.size(), Z_DEFAULT_COMPRESSION);
+    //Only keep the compressed value if it saves at least an eighth of the space
+    if (rc != Z_OK || sHeaderSize + compressedSize > static_cast<uLongf>(value.size() - value.size() / 8)) {
+        if (isEncoded(Slice{value.constData(), static_cast<size_t>(value.size())})) {
+            return stored(value);
+        }
+        return value;
+    }
+    writeHeader(result.data(), Zlib, value.size());
+    result.resize(sHeaderSize + compressedSize);
+    return result;
+}
+
+Slice ValueCodec::decode(const Slice &value, QByteArray &scratch)
+{
+    if (!isEncoded(value)) {
+        return value;
+    }
+    const auto payload = value.data() + sHeaderSize;
+    const auto payloadSize = value.size() - sHeaderSize;
+    switch (static_cast<unsigned char>(value.data()[0])) {
+        case Stored:
+            return Slice{payload, payloadSize};
+        case Zlib: {
+            const quint32 size = readSize(value.data());
+            scratch.resize(size);
+            uLongf decompressedSize = size;
+            const int rc = uncompress(reinterpret_cast<Bytef *>(scratch.data()), &decompressedSize, reinterpret_cast<const Bytef *>(payload), payloadSize);
+            if (rc != Z_OK || decompressedSize != size) {
+                SinkWarning() << "Failed to decompress value: " << rc;
+                return Slice{nullptr, 0};
+            }
+            return Slice{scratch.constData(), size};
+        }
+        default:
+            SinkWarning() << "Unknown value codec: " << static_cast<int>(value.data()[0]);
+            return Slice{nullptr, 0};
+    }
+}
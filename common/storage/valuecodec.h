@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2017 Christian Mollekopf <mollekopf@kolabsys.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <QByteArray>
+#include "storage.h"
+
+namespace Sink {
+namespace Storage {
+
+/**
+ * The value codec used by databases opened with DataStore::Compressed.
+ *
+ * Encoded values start with an 8 byte header: the codec, the magic "sc\xFF" and the uncompressed size (little endian).
+ * The fourth byte of a flatbuffer is the most significant byte of the root offset and thus never 0xFF,
+ * so values that have been written before compression was enabled are returned as they are.
+ */
+namespace ValueCodec {
+
+enum Codec {
+    Stored = 0,
+    Zlib = 1
+};
+
+/**
+ * Encode @param value for storage.
+ *
+ * The value is only compressed if that saves a meaningful amount of space, otherwise it's returned unmodified.
+ */
+QByteArray encode(const QByteArray &value);
+
+/**
+ * Returns true if @param value carries a codec header.
+ */
+bool isEncoded(const Slice &value);
+
+/**
+ * Decode @param value.
+ *
+ * If the value needs to be decompressed this is done into @param scratch, and the returned slice points into it.
+ * The slice is thus only valid until scratch is reused. Returns an empty slice if the value is corrupted.
+ */
+Slice decode(const Slice &value, QByteArray &scratch);
+
+}
+
+}
+}
@@ -20,6 +20,10 @@
  */
 
 #include "storage.h"
+#include "storage_p.h"
+
+#include <QUuid>
+#include <QtEndian>
 
 #include "log.h"
 #include "utils.h"
@@ -36,6 +40,8 @@ namespace Storage {
 static const char *s_internalPrefix = "__internal";
 static const int s_internalPrefixSize = strlen(s_internalPrefix);
 static const int s_lengthOfUid = 38;
+static const int s_lengthOfBinaryUid = 16;
+static const int s_lengthOfKey = s_lengthOfBinaryUid + sizeof(qint64);
 
 DbLayout::DbLayout()
 {
@@ -49,6 +55,33 @@ DbLayout::DbLayout(const QByteArray &n, const Databases &t)
 
 }
 
+static DataStore::Backend sDefaultBackend = DataStore::LmdbBackend;
+
+static StorageBackend *createBackend(const QString &storageRoot, const QString &name, DataStore::AccessMode mode, const DbLayout &layout, DataStore::Backend backend)
+{
+    if (backend == DataStore::DefaultBackend) {
+        backend = sDefaultBackend;
+    }
+    if (backend == DataStore::MemoryBackend) {
+        return createMemoryBackend(storageRoot, name, mode, layout);
+    }
+    return createLmdbBackend(storageRoot, name, mode, layout);
+}
+
+QByteArray prefixUpperBound(const QByteArray &prefix)
+{
+    QByteArray bound = prefix;
+    while (!bound.isEmpty()) {
+        const auto last = static_cast<unsigned char>(bound.at(bound.size() - 1));
+        if (last != 0xFF) {
+            bound[bound.size() - 1] = static_cast<char>(last + 1);
+            return bound;
+        }
+        bound.chop(1);
+    }
+    return bound;
+}
+
 void errorHandler(const DataStore::Error &error)
 {
     if (error.code == DataStore::TransactionError) {
@@ -76,9 +109,344 @@ std::function<void(const DataStore::Error &error)> DataStore::defaultErrorHandle
     return basicErrorHandler();
 }
 
+DataStore::DataStore(const QString &storageRoot, const QString &name, AccessMode mode, Backend backend) : d(createBackend(storageRoot, name, mode, {}, backend))
+{
+}
+
+DataStore::DataStore(const QString &storageRoot, const DbLayout &dbLayout, AccessMode mode, Backend backend) : d(createBackend(storageRoot, dbLayout.name, mode, dbLayout, backend))
+{
+}
+
+DataStore::~DataStore()
+{
+    delete d;
+}
+
+void DataStore::setDefaultBackend(Backend backend)
+{
+    sDefaultBackend = (backend == DefaultBackend) ? LmdbBackend : backend;
+}
+
+bool DataStore::exists() const
+{
+    return d->exists();
+}
+
+DataStore::Transaction DataStore::createTransaction(AccessMode type, const std::function<void(const DataStore::Error &error)> &errorHandlerArg)
+{
+    auto errorHandler = errorHandlerArg ? errorHandlerArg : defaultErrorHandler();
+    if (!d->exists()) {
+        errorHandler(Error(d->name.toLatin1(), ErrorCodes::GenericError, "Failed to create transaction: Missing database environment"));
+        return Transaction();
+    }
+
+    bool requestedRead = type == ReadOnly;
+
+    if (d->mode == ReadOnly && !requestedRead) {
+        errorHandler(Error(d->name.toLatin1(), ErrorCodes::GenericError, "Failed to create transaction: Requested read/write transaction in read-only mode."));
+        return Transaction();
+    }
+    if (auto transaction = d->createTransaction(requestedRead, defaultErrorHandler())) {
+        return Transaction(transaction);
+    }
+    return {};
+}
+
+qint64 DataStore::diskUsage() const
+{
+    return d->diskUsage();
+}
+
+void DataStore::removeFromDisk() const
+{
+    d->removeFromDisk(defaultErrorHandler());
+}
+
+bool DataStore::compact()
+{
+    return d->compact(defaultErrorHandler());
+}
+
+DataStore::Transaction::Transaction() : d(nullptr)
+{
+}
+
+DataStore::Transaction::Transaction(TransactionBackend *prv) : d(prv)
+{
+}
+
+DataStore::Transaction::Transaction(Transaction &&other) : d(nullptr)
+{
+    *this = std::move(other);
+}
+
+DataStore::Transaction &DataStore::Transaction::operator=(DataStore::Transaction &&other)
+{
+    if (&other != this) {
+        abort();
+        delete d;
+        d = other.d;
+        other.d = nullptr;
+    }
+    return *this;
+}
+
+DataStore::Transaction::~Transaction()
+{
+    if (d && d->isActive()) {
+        if (d->implicitCommit && !d->error) {
+            commit();
+        } else {
+            abort();
+        }
+    }
+    delete d;
+}
+
+DataStore::Transaction::operator bool() const
+{
+    return (d && d->isActive());
+}
+
+bool DataStore::Transaction::commit(const std::function<void(const DataStore::Error &error)> &errorHandler)
+{
+    if (!d || !d->isActive()) {
+        return false;
+    }
+    return d->commit(errorHandler);
+}
+
+void DataStore::Transaction::abort()
+{
+    if (!d || !d->isActive()) {
+        return;
+    }
+    d->abort();
+}
+
+DataStore::NamedDatabase DataStore::Transaction::openDatabase(const QByteArray &db, const std::function<void(const DataStore::Error &error)> &errorHandler, int flags) const
+{
+    if (!d) {
+        SinkError() << "Tried to open database on invalid transaction: " << db;
+        return DataStore::NamedDatabase();
+    }
+    if (!d->isActive()) {
+        //I.e. the transaction was lost because we failed to grow the map
+        SinkWarning() << "Tried to open database on a finished transaction: " << db;
+        return DataStore::NamedDatabase();
+    }
+    // We don't now if anything changed
+    d->implicitCommit = true;
+    return DataStore::NamedDatabase(d->openDatabase(db, errorHandler, flags));
+}
+
+QList<QByteArray> DataStore::Transaction::getDatabaseNames() const
+{
+    if (!d) {
+        SinkWarning() << "Invalid transaction";
+        return QList<QByteArray>();
+    }
+    return d->getDatabaseNames();
+}
+
+DataStore::Transaction::Stat DataStore::Transaction::stat(bool printDetails)
+{
+    if (!d || !d->isActive()) {
+        return {};
+    }
+    return d->stat(printDetails);
+}
+
+DataStore::NamedDatabase::NamedDatabase() : d(nullptr)
+{
+}
+
+DataStore::NamedDatabase::NamedDatabase(DatabaseBackend *prv) : d(prv)
+{
+}
+
+DataStore::NamedDatabase::NamedDatabase(NamedDatabase &&other) : d(nullptr)
+{
+    *this = std::move(other);
+}
+
+DataStore::NamedDatabase &DataStore::NamedDatabase::operator=(DataStore::NamedDatabase &&other)
+{
+    if (&other != this) {
+        delete d;
+        d = other.d;
+        other.d = nullptr;
+    }
+    return *this;
+}
+
+DataStore::NamedDatabase::~NamedDatabase()
+{
+    delete d;
+}
+
+bool DataStore::NamedDatabase::write(const QByteArray &key, const QByteArray &value, const std::function<void(const DataStore::Error &error)> &errorHandler)
+{
+    if (!d) {
+        return false;
+    }
+    return d->write(key, value, errorHandler);
+}
+
+void DataStore::NamedDatabase::remove(const QByteArray &key, const std::function<void(const DataStore::Error &error)> &errorHandler)
+{
+    remove(key, QByteArray(), errorHandler);
+}
+
+void DataStore::NamedDatabase::remove(const QByteArray &key, const QByteArray &value, const std::function<void(const DataStore::Error &error)> &errorHandler)
+{
+    if (!d) {
+        return;
+    }
+    d->remove(key, value, errorHandler);
+}
+
+int DataStore::NamedDatabase::scan(const QByteArray &k, const std::function<bool(const QByteArray &key, const QByteArray &value)> &resultHandler,
+    const std::function<void(const DataStore::Error &error)> &errorHandler, bool findSubstringKeys, bool skipInternalKeys) const
+{
+    return scan(k, [&](const Slice &key, const Slice &value) -> bool {
+            return resultHandler(key.toRawByteArray(), value.toRawByteArray());
+        },
+        errorHandler, findSubstringKeys, skipInternalKeys);
+}
+
+int DataStore::NamedDatabase::scan(const QByteArray &k, FunctionRef<bool(const Slice &key, const Slice &value)> resultHandler,
+    const std::function<void(const DataStore::Error &error)> &errorHandler, bool findSubstringKeys, bool skipInternalKeys) const
+{
+    if (!d) {
+        // Not an error. We rely on this to read nothing from non-existing databases.
+        return 0;
+    }
+    return d->scan(k, resultHandler, errorHandler, findSubstringKeys, skipInternalKeys);
+}
+
+void DataStore::NamedDatabase::findLatest(const QByteArray &k, const std::function<void(const QByteArray &key, const QByteArray &value)> &resultHandler,
+    const std::function<void(const DataStore::Error &error)> &errorHandler) const
+{
+    findLatest(k, [&](const Slice &key, const Slice &value) {
+            resultHandler(key.toRawByteArray(), value.toRawByteArray());
+        },
+        errorHandler);
+}
+
+void DataStore::NamedDatabase::findLatest(const QByteArray &k, FunctionRef<void(const Slice &key, const Slice &value)> resultHandler,
+    const std::function<void(const DataStore::Error &error)> &errorHandler) const
+{
+    if (!d) {
+        return;
+    }
+    d->findLatest(k, resultHandler, errorHandler);
+}
+
+DataStore::NamedDatabase::Cursor DataStore::NamedDatabase::createCursor(const QByteArray &upperBound, const std::function<void(const DataStore::Error &error)> &errorHandler) const
+{
+    if (!d) {
+        return Cursor{};
+    }
+    return Cursor{d->createCursor(upperBound, errorHandler)};
+}
+
+qint64 DataStore::NamedDatabase::getSize()
+{
+    if (!d) {
+        return -1;
+    }
+    return d->getSize();
+}
+
+DataStore::NamedDatabase::Stat DataStore::NamedDatabase::stat()
+{
+    if (!d) {
+        return {};
+    }
+    return d->stat();
+}
+
+bool DataStore::NamedDatabase::allowsDuplicates() const
+{
+    if (!d) {
+        return false;
+    }
+    return d->allowsDuplicates();
+}
+
+DataStore::NamedDatabase::Cursor::Cursor() : d(nullptr)
+{
+}
+
+DataStore::NamedDatabase::Cursor::Cursor(CursorBackend *prv) : d(prv)
+{
+}
+
+DataStore::NamedDatabase::Cursor::Cursor(Cursor &&other) : d(nullptr)
+{
+    *this = std::move(other);
+}
+
+DataStore::NamedDatabase::Cursor &DataStore::NamedDatabase::Cursor::operator=(DataStore::NamedDatabase::Cursor &&other)
+{
+    if (&other != this) {
+        delete d;
+        d = other.d;
+        other.d = nullptr;
+    }
+    return *this;
+}
+
+DataStore::NamedDatabase::Cursor::~Cursor()
+{
+    delete d;
+}
+
+bool DataStore::NamedDatabase::Cursor::seek(const QByteArray &key)
+{
+    return d && d->seek(key);
+}
+
+bool DataStore::NamedDatabase::Cursor::seekLast()
+{
+    return d && d->seekLast();
+}
+
+bool DataStore::NamedDatabase::Cursor::next()
+{
+    return d && d->next();
+}
+
+bool DataStore::NamedDatabase::Cursor::prev()
+{
+    return d && d->prev();
+}
+
+bool DataStore::NamedDatabase::Cursor::isValid() const
+{
+    return d && d->isValid();
+}
+
+Slice DataStore::NamedDatabase::Cursor::key() const
+{
+    if (!isValid()) {
+        return Slice{nullptr, 0};
+    }
+    return d->key();
+}
+
+Slice DataStore::NamedDatabase::Cursor::value() const
+{
+    if (!isValid()) {
+        return Slice{nullptr, 0};
+    }
+    return d->value();
+}
+
 void DataStore::setMaxRevision(DataStore::Transaction &transaction, qint64 revision)
 {
-    transaction.openDatabase().write("__internal_maxRevision", QByteArray::number(revision));
+    transaction.openDatabase().write("__internal_maxRevision", sizeTToByteArray(revision));
 }
 
 qint64 DataStore::maxRevision(const DataStore::Transaction &transaction)
@@ -86,7 +454,7 @@ qint64 DataStore::maxRevision(const DataStore::Transaction &transaction)
     qint64 r = 0;
     transaction.openDatabase().scan("__internal_maxRevision",
         [&](const QByteArray &, const QByteArray &revision) -> bool {
-            r = revision.toLongLong();
+            r = byteArrayToSizeT(revision);
             return false;
         },
         [](const Error &error) {
@@ -99,7 +467,7 @@ qint64 DataStore::maxRevision(const DataStore::Transaction &transaction)
 
 void DataStore::setCleanedUpRevision(DataStore::Transaction &transaction, qint64 revision)
 {
-    transaction.openDatabase().write("__internal_cleanedUpRevision", QByteArray::number(revision));
+    transaction.openDatabase().write("__internal_cleanedUpRevision", sizeTToByteArray(revision));
 }
 
 qint64 DataStore::cleanedUpRevision(const DataStore::Transaction &transaction)
@@ -107,7 +475,7 @@ qint64 DataStore::cleanedUpRevision(const DataStore::Transaction &transaction)
     qint64 r = 0;
     transaction.openDatabase().scan("__internal_cleanedUpRevision",
         [&](const QByteArray &, const QByteArray &revision) -> bool {
-            r = revision.toLongLong();
+            r = byteArrayToSizeT(revision);
             return false;
         },
         [](const Error &error) {
@@ -121,8 +489,8 @@ qint64 DataStore::cleanedUpRevision(const DataStore::Transaction &transaction)
 QByteArray DataStore::getUidFromRevision(const DataStore::Transaction &transaction, qint64 revision)
 {
     QByteArray uid;
-    transaction.openDatabase("revisions")
-        .scan(QByteArray::number(revision),
+    transaction.openDatabase("revisions", {}, IntegerKeys)
+        .scan(sizeTToByteArray(revision),
             [&](const QByteArray &, const QByteArray &value) -> bool {
                 uid = QByteArray{value.constData(), value.size()};
                 return false;
@@ -134,8 +502,8 @@ QByteArray DataStore::getUidFromRevision(const DataStore::Transaction &transacti
 QByteArray DataStore::getTypeFromRevision(const DataStore::Transaction &transaction, qint64 revision)
 {
     QByteArray type;
-    transaction.openDatabase("revisionType")
-        .scan(QByteArray::number(revision),
+    transaction.openDatabase("revisionType", {}, IntegerKeys)
+        .scan(sizeTToByteArray(revision),
             [&](const QByteArray &, const QByteArray &value) -> bool {
                 type = QByteArray{value.constData(), value.size()};
                 return false;
@@ -146,15 +514,16 @@ QByteArray DataStore::getTypeFromRevision(const DataStore::Transaction &transact
 
 void DataStore::recordRevision(DataStore::Transaction &transaction, qint64 revision, const QByteArray &uid, const QByteArray &type)
 {
-    // TODO use integerkeys
-    transaction.openDatabase("revisions").write(QByteArray::number(revision), uid);
-    transaction.openDatabase("revisionType").write(QByteArray::number(revision), type);
+    const auto key = sizeTToByteArray(revision);
+    transaction.openDatabase("revisions", {}, IntegerKeys).write(key, uid);
+    transaction.openDatabase("revisionType", {}, IntegerKeys).write(key, type);
 }
 
 void DataStore::removeRevision(DataStore::Transaction &transaction, qint64 revision)
 {
-    transaction.openDatabase("revisions").remove(QByteArray::number(revision));
-    transaction.openDatabase("revisionType").remove(QByteArray::number(revision));
+    const auto key = sizeTToByteArray(revision);
+    transaction.openDatabase("revisions", {}, IntegerKeys).remove(key);
+    transaction.openDatabase("revisionType", {}, IntegerKeys).remove(key);
 }
 
 void DataStore::recordUid(DataStore::Transaction &transaction, const QByteArray &uid, const QByteArray &type)
@@ -175,6 +544,21 @@ void DataStore::getUids(const QByteArray &type, const Transaction &transaction,
     });
 }
 
+QVector<QByteArray> DataStore::getUids(const QByteArray &type, const Transaction &transaction, const QByteArray &lastUid, int limit)
+{
+    QVector<QByteArray> uids;
+    auto cursor = transaction.openDatabase(type + "uids").createCursor();
+    bool valid = cursor.seek(lastUid);
+    //The last uid has already been read
+    if (valid && !lastUid.isEmpty() && cursor.key() == lastUid) {
+        valid = cursor.next();
+    }
+    for (; valid && uids.size() < limit; valid = cursor.next()) {
+        uids << cursor.key().toByteArray();
+    }
+    return uids;
+}
+
 bool DataStore::isInternalKey(const char *key)
 {
     return key && strncmp(key, s_internalPrefix, s_internalPrefixSize) == 0;
@@ -194,21 +578,82 @@ bool DataStore::isInternalKey(const QByteArray &key)
     return key.startsWith(s_internalPrefix);
 }
 
+bool DataStore::isInternalKey(const Slice &key)
+{
+    return key.startsWith(s_internalPrefix, s_internalPrefixSize);
+}
+
+QByteArray DataStore::sizeTToByteArray(size_t value)
+{
+    return QByteArray{reinterpret_cast<const char *>(&value), sizeof(value)};
+}
+
+size_t DataStore::byteArrayToSizeT(const QByteArray &value)
+{
+    if (value.size() != sizeof(size_t)) {
+        SinkWarning() << "Invalid size for integer value: " << value.size();
+        return 0;
+    }
+    size_t result;
+    memcpy(&result, value.constData(), sizeof(size_t));
+    return result;
+}
+
+QByteArray DataStore::uidFromKey(const Slice &key)
+{
+    if (key.size() == s_lengthOfKey) {
+        return QUuid::fromRfc4122(QByteArray::fromRawData(key.data(), s_lengthOfBinaryUid)).toByteArray();
+    }
+    return QByteArray(key.data(), qMin<int>(key.size(), s_lengthOfUid));
+}
+
+QByteArray DataStore::keyPrefix(const QByteArray &uid)
+{
+    //QUuid maps anything it can't parse to the null uuid, which would match the keys of an unrelated entity
+    if (uid.size() != s_lengthOfUid) {
+        return {};
+    }
+    const QUuid uuid(uid);
+    if (uuid.isNull()) {
+        return {};
+    }
+    return uuid.toRfc4122();
+}
+
 QByteArray DataStore::assembleKey(const QByteArray &key, qint64 revision)
 {
-    Q_ASSERT(revision <= 9223372036854775807);
-    Q_ASSERT(key.size() == s_lengthOfUid);
-    return key + QByteArray::number(revision).rightJustified(19, '0', false);
+    Q_ASSERT(revision >= 0);
+    auto result = keyPrefix(key);
+    if (result.isEmpty()) {
+        SinkWarning() << "Not a valid uid: " << key;
+        return {};
+    }
+    result.resize(s_lengthOfKey);
+    //Big endian so the keys of one uid sort by revision
+    qToBigEndian<qint64>(revision, reinterpret_cast<uchar *>(result.data() + s_lengthOfBinaryUid));
+    return result;
 }
 
 QByteArray DataStore::uidFromKey(const QByteArray &key)
 {
+    if (key.size() == s_lengthOfKey) {
+        return QUuid::fromRfc4122(key.left(s_lengthOfBinaryUid)).toByteArray();
+    }
+    //Textual key from before the binary format, or a plain uid
     return key.mid(0, s_lengthOfUid);
 }
 
 qint64 DataStore::revisionFromKey(const QByteArray &key)
 {
-    return key.mid(s_lengthOfUid + 1).toLongLong();
+    if (key.size() == s_lengthOfKey) {
+        return qFromBigEndian<qint64>(reinterpret_cast<const uchar *>(key.constData() + s_lengthOfBinaryUid));
+    }
+    return key.mid(s_lengthOfUid).toLongLong();
+}
+
+bool DataStore::isLegacyKey(const QByteArray &key)
+{
+    return key.size() == s_lengthOfUid + 19;
 }
 
 QByteArray DataStore::generateUid()
@@ -223,7 +668,7 @@ DataStore::NamedDatabase DataStore::mainDatabase(const DataStore::Transaction &t
         Q_ASSERT(false);
         return {};
     }
-    return t.openDatabase(type + ".main");
+    return t.openDatabase(type + ".main", {}, Compressed);
 }
 
 bool DataStore::NamedDatabase::contains(const QByteArray &uid)
@@ -259,6 +704,27 @@ qint64 DataStore::databaseVersion(const DataStore::Transaction &transaction)
     return r;
 }
 
+void DataStore::setGeneration(DataStore::Transaction &transaction, const QByteArray &generation)
+{
+    transaction.openDatabase().write("__internal_generation", generation);
+}
+
+QByteArray DataStore::generation(const DataStore::Transaction &transaction)
+{
+    QByteArray r;
+    transaction.openDatabase().scan("__internal_generation",
+        [&](const QByteArray &, const QByteArray &generation) -> bool {
+            r = QByteArray(generation.constData(), generation.size());
+            return false;
+        },
+        [](const Error &error) {
+            if (error.code != DataStore::NotFound) {
+                SinkWarning() << "Couldn't find the generation: " << error;
+            }
+        });
+    return r;
+}
+
 
 }
 } // namespace Sink
@@ -20,31 +20,241 @@
  */
 
 #include "storage.h"
+#include "storage_p.h"
 
 #include <iostream>
 
 #include <QDebug>
 #include <QDir>
 #include <QReadWriteLock>
+#include <QMutex>
+#include <QElapsedTimer>
+#include <QSharedPointer>
+#include <QVector>
 #include <QString>
 #include <QTime>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
 #include <valgrind.h>
 #include <lmdb.h>
 #include "log.h"
+#include "storage/valuecodec.h"
 
 namespace Sink {
 namespace Storage {
 
+//A dbi handle, together with whether the codec of the database is recorded in the flag table
+struct LmdbDbi {
+    MDB_dbi dbi;
+    bool compressed;
+};
+
 extern QReadWriteLock sDbisLock;
 extern QReadWriteLock sEnvironmentsLock;
 extern QHash<QString, MDB_env *> sEnvironments;
-extern QHash<QString, MDB_dbi> sDbis;
+extern QHash<MDB_env *, QHash<QByteArray, LmdbDbi>> sDbis;
+extern QHash<MDB_env *, QSharedPointer<QReadWriteLock>> sMapLocks;
 
 
 QReadWriteLock sDbisLock;
 QReadWriteLock sEnvironmentsLock;
 QHash<QString, MDB_env *> sEnvironments;
-QHash<QString, MDB_dbi> sDbis;
+//The dbi handles of each environment by database name.
+//A dbi is only added once the transaction that opened it has been committed, it is then valid for all future transactions.
+//The codec is cached with it, so the flag table only has to be read when a database is opened for the first time.
+QHash<MDB_env *, QHash<QByteArray, LmdbDbi>> sDbis;
+//Every transaction holds the map lock of its environment for reading.
+//The map can only be resized while the lock is held for writing, because no transaction of this process may be active at that time.
+QHash<MDB_env *, QSharedPointer<QReadWriteLock>> sMapLocks;
+
+//Large enough that the map rarely has to grow, the address space is only reserved and not backed by memory.
+static const size_t sDefaultInitialMapSize = (size_t)1024 * 1024 * 1024; // 1GB
+static size_t sInitialMapSize = sDefaultInitialMapSize;
+static size_t sMaximumMapSize = 0;
+//How long we wait for other transactions of this process to finish when the map has to be resized
+static const int sMapLockTimeout = 1000;
+//The number of map locks the current thread holds for reading, by lock.
+//A thread that holds the lock for another transaction must not wait for the write lock, it would wait for itself.
+static thread_local QHash<QReadWriteLock *, int> sHeldMapLocks;
+//Recorded in the flag table next to the lmdb flags of a db whose values are encoded with the ValueCodec, it is never passed to lmdb
+static const unsigned int sCompressedDbFlag = 0x10000000;
+//The durability of each environment by path, protected by sEnvironmentsLock
+static QHash<QString, DataStore::Durability> sDurabilities;
+//Read-only transactions that have been reset, so they can be renewed instead of beginning a new transaction.
+//Renewing reuses the reader slot and avoids the allocation, which matters for the many short-lived transactions of queries.
+static QMutex sReadTransactionPoolLock;
+static QHash<MDB_env *, QVector<MDB_txn *>> sReadTransactionPool;
+static const int sDefaultReadTransactionPoolSize = 4;
+static int sReadTransactionPoolSize = sDefaultReadTransactionPoolSize;
+
+static size_t maximumMapSize()
+{
+    if (sMaximumMapSize) {
+        return sMaximumMapSize;
+    }
+    if (RUNNING_ON_VALGRIND) {
+        // In order to run valgrind this size must be smaller than half your available RAM
+        // https://github.com/BVLC/caffe/issues/2404
+        return (size_t)10485760 * (size_t)1000; // 10MB * 1000
+    }
+    //This is the maximum size of the db (but will not be used directly), so we make it large enough that we hopefully never run into the limit.
+    return (size_t)10485760 * (size_t)100000; // 10MB * 100000
+}
+
+static size_t currentMapSize(MDB_env *env)
+{
+    MDB_envinfo info;
+    mdb_env_info(env, &info);
+    return info.me_mapsize;
+}
+
+static size_t usedMapSize(MDB_env *env)
+{
+    MDB_envinfo info;
+    mdb_env_info(env, &info);
+    MDB_stat stat;
+    mdb_env_stat(env, &stat);
+    return (info.me_last_pgno + 1) * stat.ms_psize;
+}
+
+/*
+ * The map size of a writer starts at the initial size, or twice the size of the existing data.
+ */
+static size_t initialMapSize(MDB_env *env)
+{
+    return qMin(qMax(sInitialMapSize, usedMapSize(env) * 2), maximumMapSize());
+}
+
+/*
+ * Doubles the map size, up to the maximum map size.
+ *
+ * The map lock of the environment must be held for writing.
+ */
+static bool growMap(MDB_env *env)
+{
+    const size_t mapSize = currentMapSize(env);
+    const size_t maximum = maximumMapSize();
+    if (mapSize >= maximum) {
+        SinkWarning() << "The map has reached the maximum size of " << maximum << " bytes";
+        return false;
+    }
+    const size_t newSize = qMin(mapSize * 2, maximum);
+    if (const int rc = mdb_env_set_mapsize(env, newSize)) {
+        SinkWarning() << "Failed to grow the map: " << QByteArray(mdb_strerror(rc));
+        return false;
+    }
+    SinkTrace() << "Grew the map from " << mapSize << " to " << newSize << " bytes";
+    return true;
+}
+
+//The counters are only ever added and never removed, so the pointers handed out remain valid for the lifetime of the process.
+//Updating them only requires relaxed atomic additions, the lookup happens once per database and transaction.
+struct DatabaseCounters {
+    std::atomic<qint64> writes{0};
+    std::atomic<qint64> removes{0};
+    std::atomic<qint64> scans{0};
+    std::atomic<qint64> findLatest{0};
+    std::atomic<qint64> rowsVisited{0};
+    std::atomic<qint64> bytesRead{0};
+    std::atomic<qint64> bytesWritten{0};
+};
+
+static const int sCommitLatencyBuckets = 6;
+
+struct CommitCounters {
+    std::atomic<qint64> commits{0};
+    std::atomic<qint64> latencyHistogram[sCommitLatencyBuckets]{};
+};
+
+static QMutex sStatisticsLock;
+static QHash<QString, QHash<QByteArray, QSharedPointer<DatabaseCounters>>> sDatabaseCounters;
+static QHash<QString, QSharedPointer<CommitCounters>> sCommitCounters;
+
+static DatabaseCounters *databaseCounters(const QString &environment, const QByteArray &db)
+{
+    QMutexLocker locker(&sStatisticsLock);
+    auto &counters = sDatabaseCounters[environment][db];
+    if (!counters) {
+        counters = QSharedPointer<DatabaseCounters>::create();
+    }
+    return counters.data();
+}
+
+static CommitCounters *commitCounters(const QString &environment)
+{
+    QMutexLocker locker(&sStatisticsLock);
+    auto &counters = sCommitCounters[environment];
+    if (!counters) {
+        counters = QSharedPointer<CommitCounters>::create();
+    }
+    return counters.data();
+}
+
+static void recordCommitLatency(CommitCounters *counters, qint64 nsecs)
+{
+    int bucket = 0;
+    //Decades starting at 100us
+    for (qint64 limit = 100000; bucket < sCommitLatencyBuckets - 1 && nsecs >= limit; limit *= 10) {
+        bucket++;
+    }
+    counters->commits.fetch_add(1, std::memory_order_relaxed);
+    counters->latencyHistogram[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+static MDB_txn *takePooledReadTransaction(MDB_env *env)
+{
+    QMutexLocker locker(&sReadTransactionPoolLock);
+    auto it = sReadTransactionPool.find(env);
+    while (it != sReadTransactionPool.end() && !it->isEmpty()) {
+        auto txn = it->takeLast();
+        if (!mdb_txn_renew(txn)) {
+            return txn;
+        }
+        //I.e. the map has been resized by another process, mdb_txn_begin deals with that.
+        mdb_txn_abort(txn);
+    }
+    return nullptr;
+}
+
+static bool returnReadTransactionToPool(MDB_env *env, MDB_txn *txn)
+{
+    QMutexLocker locker(&sReadTransactionPoolLock);
+    auto &pool = sReadTransactionPool[env];
+    if (pool.size() >= sReadTransactionPoolSize) {
+        return false;
+    }
+    mdb_txn_reset(txn);
+    pool.append(txn);
+    return true;
+}
+
+//Has to be called before the environment is closed
+static void clearReadTransactionPool(MDB_env *env)
+{
+    QMutexLocker locker(&sReadTransactionPoolLock);
+    for (auto txn : sReadTransactionPool.take(env)) {
+        mdb_txn_abort(txn);
+    }
+}
+
+static void applyDurability(MDB_env *env, DataStore::Durability durability)
+{
+    switch (durability) {
+        case DataStore::Strict:
+            mdb_env_set_flags(env, MDB_NOSYNC | MDB_NOMETASYNC, 0);
+            break;
+        case DataStore::Group:
+            mdb_env_set_flags(env, MDB_NOSYNC, 0);
+            mdb_env_set_flags(env, MDB_NOMETASYNC, 1);
+            break;
+        case DataStore::Relaxed:
+            mdb_env_set_flags(env, MDB_NOSYNC, 1);
+            break;
+    }
+}
 
 int getErrorCode(int e)
 {
@@ -95,73 +305,334 @@ static QList<QByteArray> getDatabaseNames(MDB_txn *transaction)
 }
 
 
-class DataStore::NamedDatabase::Private
+class LmdbTransaction : public TransactionBackend
 {
 public:
-    Private(const QByteArray &_db, bool _allowDuplicates, const std::function<void(const DataStore::Error &error)> &_defaultErrorHandler, const QString &_name, MDB_txn *_txn)
-        : db(_db), transaction(_txn), allowDuplicates(_allowDuplicates), defaultErrorHandler(_defaultErrorHandler), name(_name)
+    LmdbTransaction(bool _requestRead, const std::function<void(const DataStore::Error &error)> &_defaultErrorHandler, const QString &_name, MDB_env *_env, const QSharedPointer<QReadWriteLock> &_mapLock, bool _noLock = false)
+        : env(_env), transaction(nullptr), requestedRead(_requestRead), defaultErrorHandler(_defaultErrorHandler), name(_name), modificationCounter(0), noLock(_noLock), mapLock(_mapLock)
+    {
+    }
+    ~LmdbTransaction()
     {
     }
 
-    ~Private()
+    bool isActive() const Q_DECL_OVERRIDE
     {
+        return transaction != nullptr;
     }
 
-    QByteArray db;
+    bool commit(const std::function<void(const DataStore::Error &error)> &errorHandler) Q_DECL_OVERRIDE;
+    void abort() Q_DECL_OVERRIDE;
+    QList<QByteArray> getDatabaseNames() const Q_DECL_OVERRIDE;
+    DatabaseBackend *openDatabase(const QByteArray &db, const std::function<void(const DataStore::Error &error)> &errorHandler, int flags) Q_DECL_OVERRIDE;
+    DataStore::Transaction::Stat stat(bool printDetails) Q_DECL_OVERRIDE;
+
+    MDB_env *env;
     MDB_txn *transaction;
+    bool requestedRead;
+    std::function<void(const DataStore::Error &error)> defaultErrorHandler;
+    QString name;
+    int modificationCounter;
+    bool noLock;
+    QSharedPointer<QReadWriteLock> mapLock;
+    bool holdsMapLock = false;
+
+    //The dbis created or updated by this transaction, they are added to sDbis on commit
+    QHash<QByteArray, LmdbDbi> createdDbs;
+    //A snapshot of the dbis of the environment, so we don't have to lock sDbis for every database we open
+    QHash<QByteArray, LmdbDbi> knownDbis;
+
+    struct OpenedDb {
+        MDB_dbi dbi;
+        bool integerKeys;
+        bool compressed;
+        DatabaseCounters *counters;
+    };
+    //The databases that have already been opened and verified in this transaction
+    QHash<QByteArray, OpenedDb> openedDbs;
+
+    //Scans and cursors that are in use, the transaction can't be restarted while they exist
+    int activeCursors = 0;
+
+    //Everything a read-write transaction did, so it can be replayed in a new transaction once the map has been grown.
+    bool logModifications = false;
+    struct DbiOpen {
+        QByteArray db;
+        unsigned int flags;
+        MDB_dbi dbi;
+    };
+    QVector<DbiOpen> dbiLog;
+    struct Modification {
+        MDB_dbi dbi;
+        bool remove;
+        QByteArray key;
+        QByteArray value;
+    };
+    QVector<Modification> modificationLog;
+
+    //Values that have been decompressed, they are kept until the transaction ends just like the values lmdb returns
+    QList<QByteArray> decodedValues;
+
+    Slice decode(const Slice &value)
+    {
+        QByteArray scratch;
+        const auto decoded = ValueCodec::decode(value, scratch);
+        if (!scratch.isEmpty()) {
+            decodedValues.append(scratch);
+        }
+        return decoded;
+    }
+
+    void acquireMapLock()
+    {
+        mapLock->lockForRead();
+        sHeldMapLocks[mapLock.data()]++;
+        holdsMapLock = true;
+    }
+
+    void releaseMapLock()
+    {
+        if (!--sHeldMapLocks[mapLock.data()]) {
+            sHeldMapLocks.remove(mapLock.data());
+        }
+        mapLock->unlock();
+        holdsMapLock = false;
+    }
+
+    void refreshKnownDbis()
+    {
+        if (!noLock) {
+            sDbisLock.lockForRead();
+        }
+        knownDbis = sDbis.value(env);
+        if (!noLock) {
+            sDbisLock.unlock();
+        }
+    }
+
+    void startTransaction()
+    {
+        Q_ASSERT(!transaction);
+        Q_ASSERT(sEnvironments.values().contains(env));
+        refreshKnownDbis();
+        // auto f = [](const char *msg, void *ctx) -> int {
+        //     qDebug() << msg;
+        //     return 0;
+        // };
+        // mdb_reader_list(env, f, nullptr);
+        // Trace_area("storage." + name.toLatin1()) << "Opening transaction " << requestedRead;
+        if (!requestedRead) {
+            growMapIfNecessary();
+        }
+        acquireMapLock();
+        if (requestedRead && (transaction = takePooledReadTransaction(env))) {
+            return;
+        }
+        int rc = mdb_txn_begin(env, NULL, requestedRead ? MDB_RDONLY : 0, &transaction);
+        if (rc == MDB_MAP_RESIZED) {
+            //Another process has grown the map beyond our mapping, so we adopt the new size
+            releaseMapLock();
+            if (mapLock->tryLockForWrite(sMapLockTimeout)) {
+                mdb_env_set_mapsize(env, 0);
+                mapLock->unlock();
+            }
+            acquireMapLock();
+            rc = mdb_txn_begin(env, NULL, requestedRead ? MDB_RDONLY : 0, &transaction);
+        }
+        // Trace_area("storage." + name.toLatin1()) << "Started transaction " << mdb_txn_id(transaction) << transaction;
+        if (rc) {
+            transaction = nullptr;
+            finishTransaction();
+            defaultErrorHandler(DataStore::Error(name.toLatin1(), DataStore::ErrorCodes::GenericError, "Error while opening transaction: " + QByteArray(mdb_strerror(rc))));
+            return;
+        }
+        //There is no point in keeping a log if the map can't grow anymore
+        logModifications = !requestedRead && currentMapSize(env) < maximumMapSize();
+    }
+
+    /*
+     * Grows the map before a write transaction starts, so at least half of it remains free for the transaction.
+     *
+     * The map can only be resized while no other transaction of this process is active, so we don't wait for them here.
+     * A transaction that runs out of space anyway grows the map in growAndReplay.
+     */
+    void growMapIfNecessary()
+    {
+        if (usedMapSize(env) * 2 <= currentMapSize(env) || currentMapSize(env) >= maximumMapSize()) {
+            return;
+        }
+        if (!mapLock->tryLockForWrite()) {
+            SinkTrace() << "Not growing the map while other transactions are active: " << name;
+            return;
+        }
+        while (usedMapSize(env) * 2 > currentMapSize(env) && growMap(env)) {
+        }
+        mapLock->unlock();
+    }
+
+    /*
+     * Releases everything that was held for the transaction, once it has been committed or aborted.
+     */
+    void finishTransaction()
+    {
+        Q_ASSERT(!transaction);
+        if (holdsMapLock) {
+            releaseMapLock();
+        }
+        createdDbs.clear();
+        openedDbs.clear();
+        dbiLog.clear();
+        modificationLog.clear();
+        decodedValues.clear();
+    }
+
+    int openDbi(const QByteArray &db, unsigned int flags, MDB_dbi *dbi)
+    {
+        const int rc = mdb_dbi_open(transaction, db.constData(), flags, dbi);
+        if (!rc && logModifications) {
+            dbiLog.append({db, flags, *dbi});
+        }
+        return rc;
+    }
+
+    void logModification(MDB_dbi dbi, bool remove, const QByteArray &key, const QByteArray &value)
+    {
+        if (logModifications) {
+            //Deep copies, the data may belong to the caller or the database
+            modificationLog.append({dbi, remove, QByteArray(key.constData(), key.size()), QByteArray(value.constData(), value.size())});
+        }
+    }
+
+    int replay();
+    bool growAndReplay(bool transactionFreed);
+};
+
+class LmdbDatabase : public DatabaseBackend
+{
+public:
+    LmdbDatabase(const QByteArray &_db, int _flags, const std::function<void(const DataStore::Error &error)> &_defaultErrorHandler, const QString &_name, LmdbTransaction *_parent)
+        : db(_db), parent(_parent), allowDuplicates(_flags & DataStore::AllowDuplicates), integerKeys(_flags & DataStore::IntegerKeys), compressed((_flags & DataStore::Compressed) && !allowDuplicates), defaultErrorHandler(_defaultErrorHandler), name(_name)
+    {
+    }
+
+    ~LmdbDatabase()
+    {
+    }
+
+    bool write(const QByteArray &key, const QByteArray &value, const std::function<void(const DataStore::Error &error)> &errorHandler) Q_DECL_OVERRIDE;
+    void remove(const QByteArray &key, const QByteArray &value, const std::function<void(const DataStore::Error &error)> &errorHandler) Q_DECL_OVERRIDE;
+    int scan(const QByteArray &key, FunctionRef<bool(const Slice &key, const Slice &value)> resultHandler,
+        const std::function<void(const DataStore::Error &error)> &errorHandler, bool findSubstringKeys, bool skipInternalKeys) Q_DECL_OVERRIDE;
+    void findLatest(const QByteArray &prefix, FunctionRef<void(const Slice &key, const Slice &value)> resultHandler,
+        const std::function<void(const DataStore::Error &error)> &errorHandler) Q_DECL_OVERRIDE;
+    CursorBackend *createCursor(const QByteArray &upperBound, const std::function<void(const DataStore::Error &error)> &errorHandler) Q_DECL_OVERRIDE;
+    qint64 getSize() Q_DECL_OVERRIDE;
+    DataStore::NamedDatabase::Stat stat() Q_DECL_OVERRIDE;
+    bool allowsDuplicates() const Q_DECL_OVERRIDE;
+
+    QByteArray db;
+    //The transaction is looked up through the parent, so the database remains usable if the transaction has been restarted to grow the map
+    LmdbTransaction *parent;
     MDB_dbi dbi;
     bool allowDuplicates;
+    bool integerKeys;
+    bool compressed;
     std::function<void(const DataStore::Error &error)> defaultErrorHandler;
     QString name;
     bool createdNewDbi = false;
-    QString createdDbName;
+    //The codec has been recorded for an existing dbi
+    bool updatedDbi = false;
+    bool recordedCompressed = false;
+    DatabaseCounters *counters = nullptr;
 
-    bool openDatabase(bool readOnly, std::function<void(const DataStore::Error &error)> errorHandler)
+    MDB_txn *txn() const
     {
+        return parent->transaction;
+    }
+
+    /*
+     * The value as seen by the user, decompressed if necessary.
+     */
+    Slice value(const MDB_val &data) const
+    {
+        const Slice value{static_cast<const char *>(data.mv_data), data.mv_size};
+        if (!compressed) {
+            return value;
+        }
+        return parent->decode(value);
+    }
+
+    bool openDatabase(bool readOnly, const QHash<QByteArray, LmdbDbi> &knownDbis, std::function<void(const DataStore::Error &error)> errorHandler)
+    {
+        MDB_txn *transaction = txn();
         unsigned int flags = 0;
         if (allowDuplicates) {
             flags |= MDB_DUPSORT;
         }
+        if (integerKeys) {
+            flags |= MDB_INTEGERKEY;
+        }
+        if (compressed) {
+            flags |= sCompressedDbFlag;
+        }
+
+        const auto knownDbi = knownDbis.constFind(db);
+        const bool known = knownDbi != knownDbis.constEnd();
+
+        //The flags are recorded when the db is created, so the values can be read correctly whatever flags are requested later on.
+        bool foundFlags = false;
+        MDB_dbi flagtableDbi;
+        int flagtableRc = MDB_NOTFOUND;
+        //Databases created before the codec was recorded only know that they are compressed if it is requested, so they still have to check the flag table
+        if (known && (knownDbi->compressed || !compressed)) {
+            flags = knownDbi->compressed ? flags | sCompressedDbFlag : flags & ~sCompressedDbFlag;
+        } else if ((flagtableRc = parent->openDbi("__flagtable", readOnly ? 0 : MDB_CREATE, &flagtableDbi))) {
+            if (!readOnly) {
+                SinkWarning() << "Failed to to open flagdb: " << QByteArray(mdb_strerror(flagtableRc));
+            }
+        } else {
+            MDB_val key, value;
+            key.mv_data = const_cast<void*>(static_cast<const void*>(db.constData()));
+            key.mv_size = db.size();
+            if (const auto rc = mdb_get(transaction, flagtableDbi, &key, &value)) {
+                //We expect this to fail for new databases
+                if (rc != MDB_NOTFOUND) {
+                    SinkWarning() << "Failed to read flags from flag db: " << QByteArray(mdb_strerror(rc));
+                }
+            } else {
+                //Found the flags
+                const auto ba = QByteArray::fromRawData((char *)value.mv_data, value.mv_size);
+                const unsigned int persistedFlags = ba.toUInt();
+                //Databases created before the codec was recorded only know that they are compressed if it is requested
+                if (!readOnly && compressed && !(persistedFlags & sCompressedDbFlag)) {
+                    writeFlags(flagtableDbi, persistedFlags | sCompressedDbFlag, true);
+                    updatedDbi = true;
+                }
+                flags = persistedFlags | (flags & sCompressedDbFlag);
+                foundFlags = true;
+            }
+        }
+        recordedCompressed = flags & sCompressedDbFlag;
+        compressed = recordedCompressed && !allowDuplicates;
+        flags &= ~sCompressedDbFlag;
 
-        const auto dbiName = name + db;
-        if (sDbis.contains(dbiName)) {
-            dbi = sDbis.value(dbiName);
+        if (known) {
+            dbi = knownDbi->dbi;
             //sDbis can contain dbi's that are not available to this transaction.
             //We use mdb_dbi_flags to check if the dbi is valid for this transaction.
             uint f;
             if (mdb_dbi_flags(transaction, dbi, &f) == EINVAL) {
                 //In readonly mode we can just ignore this. In read-write we would have tried to concurrently create a db.
                 if (!readOnly) {
-                    SinkWarning() << "Tried to create database in second transaction: " << dbiName;
+                    SinkWarning() << "Tried to create database in second transaction: " << name << db;
                 }
                 dbi = 0;
-                transaction = 0;
                 return false;
             }
+            integerKeys = f & MDB_INTEGERKEY;
         } else {
-            MDB_dbi flagtableDbi;
-            if (const int rc = mdb_dbi_open(transaction, "__flagtable", readOnly ? 0 : MDB_CREATE, &flagtableDbi)) {
-                if (!readOnly) {
-                    SinkWarning() << "Failed to to open flagdb: " << QByteArray(mdb_strerror(rc));
-                }
-            } else {
-                MDB_val key, value;
-                key.mv_data = const_cast<void*>(static_cast<const void*>(db.constData()));
-                key.mv_size = db.size();
-                if (const auto rc = mdb_get(transaction, flagtableDbi, &key, &value)) {
-                    //We expect this to fail for new databases
-                    if (rc != MDB_NOTFOUND) {
-                        SinkWarning() << "Failed to read flags from flag db: " << QByteArray(mdb_strerror(rc));
-                    }
-                } else {
-                    //Found the flags
-                    const auto ba = QByteArray::fromRawData((char *)value.mv_data, value.mv_size);
-                    flags = ba.toInt();
-                }
-            }
-
             Q_ASSERT(transaction);
-            if (const int rc = mdb_dbi_open(transaction, db.constData(), flags, &dbi)) {
+            if (const int rc = parent->openDbi(db, flags, &dbi)) {
                 //Create the db if it is not existing already
                 if (rc == MDB_NOTFOUND && !readOnly) {
                     //Sanity check db name
@@ -185,91 +656,167 @@ public:
                             }
                         }
                     }
-                    if (const int rc = mdb_dbi_open(transaction, db.constData(), flags | MDB_CREATE, &dbi)) {
+                    if (const int rc = parent->openDbi(db, flags | MDB_CREATE, &dbi)) {
                         SinkWarning() << "Failed to create db " << QByteArray(mdb_strerror(rc));
-                        Error error(name.toLatin1(), ErrorCodes::GenericError, "Error while creating database: " + QByteArray(mdb_strerror(rc)));
+                        DataStore::Error error(name.toLatin1(), DataStore::ErrorCodes::GenericError, "Error while creating database: " + QByteArray(mdb_strerror(rc)));
                         errorHandler ? errorHandler(error) : defaultErrorHandler(error);
                         return false;
                     }
                     //Record the db flags
-                    MDB_val key, value;
-                    key.mv_data = const_cast<void*>(static_cast<const void*>(db.constData()));
-                    key.mv_size = db.size();
-                    //Store the flags without the create option
-                    const auto ba = QByteArray::number(flags);
-                    value.mv_data = const_cast<void*>(static_cast<const void*>(db.constData()));
-                    value.mv_size = db.size();
-                    if (const int rc = mdb_put(transaction, flagtableDbi, &key, &value, MDB_NOOVERWRITE)) {
-                        //We expect this to fail if we're only creating the dbi but not the db
-                        if (rc != MDB_KEYEXIST) {
-                            SinkWarning() << "Failed to write flags to flag db: " << QByteArray(mdb_strerror(rc));
-                        }
+                    if (!flagtableRc && !foundFlags) {
+                        writeFlags(flagtableDbi, compressed ? flags | sCompressedDbFlag : flags, false);
                     }
                 } else {
                     dbi = 0;
-                    transaction = 0;
                     //It's not an error if we only want to read
                     if (!readOnly) {
                         SinkWarning() << "Failed to open db " << QByteArray(mdb_strerror(rc));
-                        Error error(name.toLatin1(), ErrorCodes::GenericError, "Error while opening database: " + QByteArray(mdb_strerror(rc)));
+                        DataStore::Error error(name.toLatin1(), DataStore::ErrorCodes::GenericError, "Error while opening database: " + QByteArray(mdb_strerror(rc)));
                         errorHandler ? errorHandler(error) : defaultErrorHandler(error);
                     }
                     return false;
                 }
             }
 
+            //The persisted flags take precedence over the requested ones
+            unsigned int f;
+            if (!mdb_dbi_flags(transaction, dbi, &f)) {
+                integerKeys = f & MDB_INTEGERKEY;
+            }
+
             createdNewDbi = true;
-            createdDbName = dbiName;
         }
         return true;
     }
-};
 
-DataStore::NamedDatabase::NamedDatabase() : d(nullptr)
-{
-}
-
-DataStore::NamedDatabase::NamedDatabase(NamedDatabase::Private *prv) : d(prv)
-{
-}
-
-DataStore::NamedDatabase::NamedDatabase(NamedDatabase &&other) : d(nullptr)
-{
-    *this = std::move(other);
-}
+    /*
+     * Stores the flags of the db in the flag table, without the create option.
+     */
+    void writeFlags(MDB_dbi flagtableDbi, unsigned int flags, bool overwrite)
+    {
+        MDB_val key, value;
+        key.mv_data = const_cast<void*>(static_cast<const void*>(db.constData()));
+        key.mv_size = db.size();
+        const auto ba = QByteArray::number(flags);
+        value.mv_data = const_cast<void*>(static_cast<const void*>(ba.constData()));
+        value.mv_size = ba.size();
+        if (const int rc = mdb_put(txn(), flagtableDbi, &key, &value, overwrite ? 0 : MDB_NOOVERWRITE)) {
+            //We expect this to fail if we're only creating the dbi but not the db
+            if (rc != MDB_KEYEXIST) {
+                SinkWarning() << "Failed to write flags to flag db: " << QByteArray(mdb_strerror(rc));
+            }
+        } else {
+            parent->logModification(flagtableDbi, false, db, ba);
+        }
+    }
+};
 
-DataStore::NamedDatabase &DataStore::NamedDatabase::operator=(DataStore::NamedDatabase &&other)
+/*
+ * Repeats all dbi opens and modifications of the transaction in the current (new) transaction.
+ *
+ * The dbis are opened in the same order as before, so lmdb assigns them the same handles and existing NamedDatabase instances remain valid.
+ */
+int LmdbTransaction::replay()
 {
-    if (&other != this) {
-        delete d;
-        d = other.d;
-        other.d = nullptr;
+    for (const auto &open : dbiLog) {
+        MDB_dbi dbi;
+        if (const int rc = mdb_dbi_open(transaction, open.db.constData(), open.flags, &dbi)) {
+            return rc;
+        }
+        if (dbi != open.dbi) {
+            SinkWarning() << "Got a different dbi while replaying the transaction: " << open.db;
+            return MDB_BAD_DBI;
+        }
     }
-    return *this;
+    for (const auto &modification : modificationLog) {
+        MDB_val key, data;
+        key.mv_data = const_cast<void *>(static_cast<const void *>(modification.key.constData()));
+        key.mv_size = modification.key.size();
+        data.mv_data = const_cast<void *>(static_cast<const void *>(modification.value.constData()));
+        data.mv_size = modification.value.size();
+        if (modification.remove) {
+            const int rc = mdb_del(transaction, modification.dbi, &key, modification.value.isEmpty() ? nullptr : &data);
+            if (rc && rc != MDB_NOTFOUND) {
+                return rc;
+            }
+        } else if (const int rc = mdb_put(transaction, modification.dbi, &key, &data, 0)) {
+            return rc;
+        }
+    }
+    return 0;
 }
 
-DataStore::NamedDatabase::~NamedDatabase()
+/*
+ * Restarts the transaction with a larger map after it ran full, and replays everything it did so far.
+ *
+ * Resizing requires that no other transaction of the process is active, so this waits for them to finish.
+ * The transaction is aborted before that, so a transaction we wait for can't be stuck waiting for the lmdb write lock held by this one.
+ * If the map can't be grown the transaction is left as it is.
+ * @param transactionFreed is set if lmdb has already freed the transaction (after a failed commit).
+ */
+bool LmdbTransaction::growAndReplay(bool transactionFreed)
 {
-    delete d;
+    if (!logModifications || activeCursors || currentMapSize(env) >= maximumMapSize()) {
+        return false;
+    }
+    if (sHeldMapLocks.value(mapLock.data()) > 1) {
+        SinkWarning() << "Can't grow the map while this thread has other transactions open: " << name;
+        return false;
+    }
+    if (!transactionFreed) {
+        mdb_txn_abort(transaction);
+    }
+    transaction = nullptr;
+    const size_t mapSize = currentMapSize(env);
+    releaseMapLock();
+    mapLock->lockForWrite();
+    //Another transaction may have grown the map while we were waiting
+    bool grown = currentMapSize(env) > mapSize;
+    bool success = false;
+    while (grown || growMap(env)) {
+        grown = false;
+        if (mdb_txn_begin(env, NULL, 0, &transaction)) {
+            transaction = nullptr;
+            break;
+        }
+        const int rc = replay();
+        if (!rc) {
+            success = true;
+            break;
+        }
+        mdb_txn_abort(transaction);
+        transaction = nullptr;
+        if (rc != MDB_MAP_FULL) {
+            SinkWarning() << "Failed to replay the transaction: " << QByteArray(mdb_strerror(rc));
+            break;
+        }
+    }
+    mapLock->unlock();
+    acquireMapLock();
+    if (!success) {
+        //The transaction is lost
+        error = true;
+        finishTransaction();
+    }
+    return success;
 }
 
-bool DataStore::NamedDatabase::write(const QByteArray &sKey, const QByteArray &sValue, const std::function<void(const DataStore::Error &error)> &errorHandler)
+bool LmdbDatabase::write(const QByteArray &sKey, const QByteArray &sValue, const std::function<void(const DataStore::Error &error)> &errorHandler)
 {
-    if (!d || !d->transaction) {
-        Error error("", ErrorCodes::GenericError, "Not open");
-        if (d) {
-            errorHandler ? errorHandler(error) : d->defaultErrorHandler(error);
-        }
+    if (!txn()) {
+        DataStore::Error error("", DataStore::ErrorCodes::GenericError, "Not open");
+        errorHandler ? errorHandler(error) : defaultErrorHandler(error);
         return false;
     }
     const void *keyPtr = sKey.data();
     const size_t keySize = sKey.size();
-    const void *valuePtr = sValue.data();
-    const size_t valueSize = sValue.size();
+    const QByteArray encodedValue = compressed ? ValueCodec::encode(sValue) : sValue;
+    const void *valuePtr = encodedValue.data();
+    const size_t valueSize = encodedValue.size();
 
     if (!keyPtr || keySize == 0) {
-        Error error(d->name.toLatin1() + d->db, ErrorCodes::GenericError, "Tried to write empty key.");
-        errorHandler ? errorHandler(error) : d->defaultErrorHandler(error);
+        DataStore::Error error(name.toLatin1() + db, DataStore::ErrorCodes::GenericError, "Tried to write empty key.");
+        errorHandler ? errorHandler(error) : defaultErrorHandler(error);
         return false;
     }
 
@@ -279,28 +826,30 @@ bool DataStore::NamedDatabase::write(const QByteArray &sKey, const QByteArray &s
     key.mv_data = const_cast<void *>(keyPtr);
     data.mv_size = valueSize;
     data.mv_data = const_cast<void *>(valuePtr);
-    rc = mdb_put(d->transaction, d->dbi, &key, &data, 0);
+    rc = mdb_put(txn(), dbi, &key, &data, 0);
+    while (rc == MDB_MAP_FULL && parent->growAndReplay(false)) {
+        rc = mdb_put(txn(), dbi, &key, &data, 0);
+    }
 
     if (rc) {
-        Error error(d->name.toLatin1() + d->db, ErrorCodes::GenericError, "mdb_put: " + QByteArray(mdb_strerror(rc)) + " Key: " + sKey + " Value: " + sValue);
-        errorHandler ? errorHandler(error) : d->defaultErrorHandler(error);
+        DataStore::Error error(name.toLatin1() + db, DataStore::ErrorCodes::GenericError, "mdb_put: " + QByteArray(mdb_strerror(rc)) + " Key: " + sKey + " Value: " + sValue);
+        errorHandler ? errorHandler(error) : defaultErrorHandler(error);
+    } else {
+        parent->logModification(dbi, false, sKey, encodedValue);
+        if (counters) {
+            counters->writes.fetch_add(1, std::memory_order_relaxed);
+            counters->bytesWritten.fetch_add(keySize + valueSize, std::memory_order_relaxed);
+        }
     }
 
     return !rc;
 }
 
-void DataStore::NamedDatabase::remove(const QByteArray &k, const std::function<void(const DataStore::Error &error)> &errorHandler)
+void LmdbDatabase::remove(const QByteArray &k, const QByteArray &value, const std::function<void(const DataStore::Error &error)> &errorHandler)
 {
-    remove(k, QByteArray(), errorHandler);
-}
-
-void DataStore::NamedDatabase::remove(const QByteArray &k, const QByteArray &value, const std::function<void(const DataStore::Error &error)> &errorHandler)
-{
-    if (!d || !d->transaction) {
-        if (d) {
-            Error error(d->name.toLatin1() + d->db, ErrorCodes::GenericError, "Not open");
-            errorHandler ? errorHandler(error) : d->defaultErrorHandler(error);
-        }
+    if (!txn()) {
+        DataStore::Error error(name.toLatin1() + db, DataStore::ErrorCodes::GenericError, "Not open");
+        errorHandler ? errorHandler(error) : defaultErrorHandler(error);
         return;
     }
 
@@ -308,29 +857,33 @@ void DataStore::NamedDatabase::remove(const QByteArray &k, const QByteArray &val
     MDB_val key;
     key.mv_size = k.size();
     key.mv_data = const_cast<void *>(static_cast<const void *>(k.data()));
-    if (value.isEmpty()) {
-        rc = mdb_del(d->transaction, d->dbi, &key, 0);
-    } else {
-        MDB_val data;
-        data.mv_size = value.size();
-        data.mv_data = const_cast<void *>(static_cast<const void *>(value.data()));
-        rc = mdb_del(d->transaction, d->dbi, &key, &data);
+    MDB_val data;
+    data.mv_size = value.size();
+    data.mv_data = const_cast<void *>(static_cast<const void *>(value.data()));
+    rc = mdb_del(txn(), dbi, &key, value.isEmpty() ? nullptr : &data);
+    while (rc == MDB_MAP_FULL && parent->growAndReplay(false)) {
+        rc = mdb_del(txn(), dbi, &key, value.isEmpty() ? nullptr : &data);
     }
 
     if (rc) {
-        auto errorCode = ErrorCodes::GenericError;
+        auto errorCode = DataStore::ErrorCodes::GenericError;
         if (rc == MDB_NOTFOUND) {
-            errorCode = ErrorCodes::NotFound;
+            errorCode = DataStore::ErrorCodes::NotFound;
+        }
+        DataStore::Error error(name.toLatin1() + db, errorCode, QString("Error on mdb_del: %1 %2").arg(rc).arg(mdb_strerror(rc)).toLatin1());
+        errorHandler ? errorHandler(error) : defaultErrorHandler(error);
+    } else {
+        parent->logModification(dbi, true, k, value);
+        if (counters) {
+            counters->removes.fetch_add(1, std::memory_order_relaxed);
         }
-        Error error(d->name.toLatin1() + d->db, errorCode, QString("Error on mdb_del: %1 %2").arg(rc).arg(mdb_strerror(rc)).toLatin1());
-        errorHandler ? errorHandler(error) : d->defaultErrorHandler(error);
     }
 }
 
-int DataStore::NamedDatabase::scan(const QByteArray &k, const std::function<bool(const QByteArray &key, const QByteArray &value)> &resultHandler,
-    const std::function<void(const DataStore::Error &error)> &errorHandler, bool findSubstringKeys, bool skipInternalKeys) const
+int LmdbDatabase::scan(const QByteArray &k, FunctionRef<bool(const Slice &key, const Slice &value)> resultHandler,
+    const std::function<void(const DataStore::Error &error)> &errorHandler, bool findSubstringKeys, bool skipInternalKeys)
 {
-    if (!d || !d->transaction) {
+    if (!txn()) {
         // Not an error. We rely on this to read nothing from non-existing databases.
         return 0;
     }
@@ -343,44 +896,51 @@ int DataStore::NamedDatabase::scan(const QByteArray &k, const std::function<bool
     key.mv_data = (void *)k.constData();
     key.mv_size = k.size();
 
-    rc = mdb_cursor_open(d->transaction, d->dbi, &cursor);
+    rc = mdb_cursor_open(txn(), dbi, &cursor);
     if (rc) {
         //Invalid arguments can mean that the transaction doesn't contain the db dbi
-        Error error(d->name.toLatin1() + d->db, getErrorCode(rc), QByteArray("Error during mdb_cursor_open: ") + QByteArray(mdb_strerror(rc)) + ". Key: " + k);
-        errorHandler ? errorHandler(error) : d->defaultErrorHandler(error);
+        DataStore::Error error(name.toLatin1() + db, getErrorCode(rc), QByteArray("Error during mdb_cursor_open: ") + QByteArray(mdb_strerror(rc)) + ". Key: " + k);
+        errorHandler ? errorHandler(error) : defaultErrorHandler(error);
         return 0;
     }
+    parent->activeCursors++;
 
     int numberOfRetrievedValues = 0;
+    qint64 rowsVisited = 0;
+    qint64 bytesRead = 0;
 
-    if (k.isEmpty() || d->allowDuplicates || findSubstringKeys) {
-        MDB_cursor_op op = d->allowDuplicates ? MDB_SET : MDB_FIRST;
+    if (k.isEmpty() || allowDuplicates || findSubstringKeys) {
+        MDB_cursor_op op = allowDuplicates ? MDB_SET : MDB_FIRST;
         if (findSubstringKeys) {
             op = MDB_SET_RANGE;
         }
         if ((rc = mdb_cursor_get(cursor, &key, &data, op)) == 0) {
-            const auto current = QByteArray::fromRawData((char *)key.mv_data, key.mv_size);
+            rowsVisited++;
+            bytesRead += key.mv_size + data.mv_size;
+            const Slice current{static_cast<const char *>(key.mv_data), key.mv_size};
             // The first lookup will find a key that is equal or greather than our key
             if (current.startsWith(k)) {
-                const bool callResultHandler =  !(skipInternalKeys && isInternalKey(current));
+                const bool callResultHandler =  !(skipInternalKeys && DataStore::isInternalKey(current));
                 if (callResultHandler) {
                     numberOfRetrievedValues++;
                 }
-                if (!callResultHandler || resultHandler(current, QByteArray::fromRawData((char *)data.mv_data, data.mv_size))) {
+                if (!callResultHandler || resultHandler(current, value(data))) {
                     if (findSubstringKeys) {
                         // Reset the key to what we search for
                         key.mv_data = (void *)k.constData();
                         key.mv_size = k.size();
                     }
-                    MDB_cursor_op nextOp = (d->allowDuplicates && !findSubstringKeys) ? MDB_NEXT_DUP : MDB_NEXT;
+                    MDB_cursor_op nextOp = (allowDuplicates && !findSubstringKeys) ? MDB_NEXT_DUP : MDB_NEXT;
                     while ((rc = mdb_cursor_get(cursor, &key, &data, nextOp)) == 0) {
-                        const auto current = QByteArray::fromRawData((char *)key.mv_data, key.mv_size);
+                        rowsVisited++;
+                        bytesRead += key.mv_size + data.mv_size;
+                        const Slice current{static_cast<const char *>(key.mv_data), key.mv_size};
                         // Every consequitive lookup simply iterates through the list
                         if (current.startsWith(k)) {
-                            const bool callResultHandler =  !(skipInternalKeys && isInternalKey(current));
+                            const bool callResultHandler =  !(skipInternalKeys && DataStore::isInternalKey(current));
                             if (callResultHandler) {
                                 numberOfRetrievedValues++;
-                                if (!resultHandler(current, QByteArray::fromRawData((char *)data.mv_data, data.mv_size))) {
+                                if (!resultHandler(current, value(data))) {
                                     break;
                                 }
                             }
@@ -397,30 +957,39 @@ int DataStore::NamedDatabase::scan(const QByteArray &k, const std::function<bool
     } else {
         if ((rc = mdb_cursor_get(cursor, &key, &data, MDB_SET)) == 0) {
             numberOfRetrievedValues++;
-            resultHandler(QByteArray::fromRawData((char *)key.mv_data, key.mv_size), QByteArray::fromRawData((char *)data.mv_data, data.mv_size));
+            rowsVisited++;
+            bytesRead += key.mv_size + data.mv_size;
+            resultHandler(Slice{static_cast<const char *>(key.mv_data), key.mv_size}, value(data));
         }
     }
 
     mdb_cursor_close(cursor);
+    parent->activeCursors--;
+
+    if (counters) {
+        counters->scans.fetch_add(1, std::memory_order_relaxed);
+        counters->rowsVisited.fetch_add(rowsVisited, std::memory_order_relaxed);
+        counters->bytesRead.fetch_add(bytesRead, std::memory_order_relaxed);
+    }
 
     if (rc) {
-        Error error(d->name.toLatin1() + d->db, getErrorCode(rc), QByteArray("Error during scan. Key: ") + k + " : " + QByteArray(mdb_strerror(rc)));
-        errorHandler ? errorHandler(error) : d->defaultErrorHandler(error);
+        DataStore::Error error(name.toLatin1() + db, getErrorCode(rc), QByteArray("Error during scan. Key: ") + k + " : " + QByteArray(mdb_strerror(rc)));
+        errorHandler ? errorHandler(error) : defaultErrorHandler(error);
     }
 
     return numberOfRetrievedValues;
 }
 
-void DataStore::NamedDatabase::findLatest(const QByteArray &k, const std::function<void(const QByteArray &key, const QByteArray &value)> &resultHandler,
-    const std::function<void(const DataStore::Error &error)> &errorHandler) const
+void LmdbDatabase::findLatest(const QByteArray &k, FunctionRef<void(const Slice &key, const Slice &value)> resultHandler,
+    const std::function<void(const DataStore::Error &error)> &errorHandler)
 {
-    if (!d || !d->transaction) {
+    if (!txn()) {
         // Not an error. We rely on this to read nothing from non-existing databases.
         return;
     }
     if (k.isEmpty()) {
-        Error error(d->name.toLatin1() + d->db, GenericError, QByteArray("Can't use findLatest with empty key."));
-        errorHandler ? errorHandler(error) : d->defaultErrorHandler(error);
+        DataStore::Error error(name.toLatin1() + db, DataStore::GenericError, QByteArray("Can't use findLatest with empty key."));
+        errorHandler ? errorHandler(error) : defaultErrorHandler(error);
         return;
     }
 
@@ -429,38 +998,44 @@ void DataStore::NamedDatabase::findLatest(const QByteArray &k, const std::functi
     MDB_val data;
     MDB_cursor *cursor;
 
-    key.mv_data = (void *)k.constData();
-    key.mv_size = k.size();
-
-    rc = mdb_cursor_open(d->transaction, d->dbi, &cursor);
+    rc = mdb_cursor_open(txn(), dbi, &cursor);
     if (rc) {
-        Error error(d->name.toLatin1() + d->db, getErrorCode(rc), QByteArray("Error during mdb_cursor_open: ") + QByteArray(mdb_strerror(rc)));
-        errorHandler ? errorHandler(error) : d->defaultErrorHandler(error);
+        DataStore::Error error(name.toLatin1() + db, getErrorCode(rc), QByteArray("Error during mdb_cursor_open: ") + QByteArray(mdb_strerror(rc)));
+        errorHandler ? errorHandler(error) : defaultErrorHandler(error);
         return;
     }
+    parent->activeCursors++;
 
     bool foundValue = false;
-    MDB_cursor_op op = MDB_SET_RANGE;
-    if ((rc = mdb_cursor_get(cursor, &key, &data, op)) == 0) {
-        // The first lookup will find a key that is equal or greather than our key
-        if (QByteArray::fromRawData((char *)key.mv_data, key.mv_size).startsWith(k)) {
-            //Read next value until we no longer match
-            while (QByteArray::fromRawData((char *)key.mv_data, key.mv_size).startsWith(k)) {
-                MDB_cursor_op nextOp = MDB_NEXT;
-                rc = mdb_cursor_get(cursor, &key, &data, nextOp);
-                if (rc) {
-                    break;
-                }
-            }
-            //Now read the previous value, and that's the latest one
-            MDB_cursor_op prefOp = MDB_PREV;
-            // We read past the end above, just take the last value
-            if (rc == MDB_NOTFOUND) {
-                prefOp = MDB_LAST;
-            }
-            rc = mdb_cursor_get(cursor, &key, &data, prefOp);
+    //Position the cursor on the first key past the prefix range, the latest value is the one before.
+    //This avoids walking over all values that share the prefix.
+    const auto upperBound = prefixUpperBound(k);
+    if (upperBound.isEmpty()) {
+        rc = mdb_cursor_get(cursor, &key, &data, MDB_LAST);
+    } else {
+        key.mv_data = (void *)upperBound.constData();
+        key.mv_size = upperBound.size();
+        rc = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+        if (rc == 0) {
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_PREV);
+        } else if (rc == MDB_NOTFOUND) {
+            // We read past the end, just take the last value
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_LAST);
+        }
+    }
+    if (rc == 0) {
+        const Slice current{static_cast<const char *>(key.mv_data), key.mv_size};
+        if (current.startsWith(k)) {
             foundValue = true;
-            resultHandler(QByteArray::fromRawData((char *)key.mv_data, key.mv_size), QByteArray::fromRawData((char *)data.mv_data, data.mv_size));
+            resultHandler(current, value(data));
+        }
+    }
+
+    if (counters) {
+        counters->findLatest.fetch_add(1, std::memory_order_relaxed);
+        if (rc == 0) {
+            counters->rowsVisited.fetch_add(1, std::memory_order_relaxed);
+            counters->bytesRead.fetch_add(key.mv_size + data.mv_size, std::memory_order_relaxed);
         }
     }
 
@@ -470,42 +1045,192 @@ void DataStore::NamedDatabase::findLatest(const QByteArray &k, const std::functi
     }
 
     mdb_cursor_close(cursor);
+    parent->activeCursors--;
 
     if (rc) {
-        Error error(d->name.toLatin1(), getErrorCode(rc), QByteArray("Error during find latest. Key: ") + k + " : " + QByteArray(mdb_strerror(rc)));
-        errorHandler ? errorHandler(error) : d->defaultErrorHandler(error);
+        DataStore::Error error(name.toLatin1() + db, getErrorCode(rc), QByteArray("Error during find latest. Key: ") + k + " : " + QByteArray(mdb_strerror(rc)));
+        errorHandler ? errorHandler(error) : defaultErrorHandler(error);
     } else if (!foundValue) {
-        Error error(d->name.toLatin1(), 1, QByteArray("Error during find latest. Key: ") + k + " : No value found");
-        errorHandler ? errorHandler(error) : d->defaultErrorHandler(error);
+        DataStore::Error error(name.toLatin1() + db, 1, QByteArray("Error during find latest. Key: ") + k + " : No value found");
+        errorHandler ? errorHandler(error) : defaultErrorHandler(error);
+    }
+}
+
+class LmdbCursor : public CursorBackend
+{
+public:
+    LmdbCursor(LmdbTransaction *_parent, MDB_dbi _dbi, MDB_cursor *_cursor, const QByteArray &_upperBound, const std::function<void(const DataStore::Error &error)> &_errorHandler, const QByteArray &_store, bool _compressed)
+        : transaction(_parent->transaction), dbi(_dbi), cursor(_cursor), upperBound(_upperBound), errorHandler(_errorHandler), store(_store),
+        parent(_parent), writeTransaction(_parent->requestedRead ? nullptr : _parent), compressed(_compressed)
+    {
+        if (writeTransaction) {
+            writeTransaction->activeCursors++;
+        }
+        currentKey.mv_data = nullptr;
+        currentKey.mv_size = 0;
+        currentData.mv_data = nullptr;
+        currentData.mv_size = 0;
+    }
+
+    ~LmdbCursor()
+    {
+        mdb_cursor_close(cursor);
+        if (writeTransaction) {
+            writeTransaction->activeCursors--;
+        }
+    }
+
+    bool withinBound()
+    {
+        if (upperBound.isEmpty()) {
+            return true;
+        }
+        MDB_val bound;
+        bound.mv_data = (void *)upperBound.constData();
+        bound.mv_size = upperBound.size();
+        //Use the comparison function of the database, so the bound also works for integer keys
+        return mdb_cmp(transaction, dbi, &currentKey, &bound) < 0;
     }
 
-    return;
+    /*
+     * Moves the cursor with @param op and then with @param skipOp over internal keys.
+     */
+    bool move(MDB_cursor_op op, MDB_cursor_op skipOp)
+    {
+        int rc = mdb_cursor_get(cursor, &currentKey, &currentData, op);
+        while (rc == 0 && DataStore::isInternalKey(currentKey.mv_data, currentKey.mv_size)) {
+            rc = mdb_cursor_get(cursor, &currentKey, &currentData, skipOp);
+        }
+        if (rc && rc != MDB_NOTFOUND) {
+            DataStore::Error error(store, getErrorCode(rc), QByteArray("Error while moving cursor: ") + QByteArray(mdb_strerror(rc)));
+            errorHandler(error);
+        }
+        valid = (rc == 0) && withinBound();
+        return valid;
+    }
+
+    bool seek(const QByteArray &k) Q_DECL_OVERRIDE
+    {
+        if (k.isEmpty()) {
+            return move(MDB_FIRST, MDB_NEXT);
+        }
+        currentKey.mv_data = (void *)k.constData();
+        currentKey.mv_size = k.size();
+        return move(MDB_SET_RANGE, MDB_NEXT);
+    }
+
+    bool seekLast() Q_DECL_OVERRIDE
+    {
+        if (upperBound.isEmpty()) {
+            return move(MDB_LAST, MDB_PREV);
+        }
+        currentKey.mv_data = (void *)upperBound.constData();
+        currentKey.mv_size = upperBound.size();
+        int rc = mdb_cursor_get(cursor, &currentKey, &currentData, MDB_SET_RANGE);
+        if (rc == MDB_NOTFOUND) {
+            //All keys are below the bound
+            return move(MDB_LAST, MDB_PREV);
+        }
+        return move(MDB_PREV, MDB_PREV);
+    }
+
+    bool next() Q_DECL_OVERRIDE
+    {
+        if (!valid) {
+            return false;
+        }
+        return move(MDB_NEXT, MDB_NEXT);
+    }
+
+    bool prev() Q_DECL_OVERRIDE
+    {
+        if (!currentKey.mv_data) {
+            return false;
+        }
+        return move(MDB_PREV, MDB_PREV);
+    }
+
+    bool isValid() const Q_DECL_OVERRIDE
+    {
+        return valid;
+    }
+
+    Slice key() const Q_DECL_OVERRIDE
+    {
+        return Slice{static_cast<const char *>(currentKey.mv_data), currentKey.mv_size};
+    }
+
+    Slice value() const Q_DECL_OVERRIDE
+    {
+        const Slice value{static_cast<const char *>(currentData.mv_data), currentData.mv_size};
+        if (!compressed) {
+            return value;
+        }
+        //Every value is only decompressed once, no matter how often it's requested
+        if (currentData.mv_data != decodedData) {
+            decodedData = currentData.mv_data;
+            decodedValue = parent->decode(value);
+        }
+        return decodedValue;
+    }
+
+    MDB_txn *transaction;
+    MDB_dbi dbi;
+    MDB_cursor *cursor;
+    QByteArray upperBound;
+    std::function<void(const DataStore::Error &error)> errorHandler;
+    QByteArray store;
+    LmdbTransaction *parent;
+    //Only read-write transactions can be restarted, so only they need to know about cursors
+    LmdbTransaction *writeTransaction;
+    MDB_val currentKey;
+    MDB_val currentData;
+    bool valid = false;
+    bool compressed;
+    //The decompressed value of the current position, it is owned by the transaction
+    mutable const void *decodedData = nullptr;
+    mutable Slice decodedValue{nullptr, 0};
+};
+
+CursorBackend *LmdbDatabase::createCursor(const QByteArray &upperBound, const std::function<void(const DataStore::Error &error)> &errorHandler)
+{
+    if (!txn()) {
+        // Not an error. We rely on this to read nothing from non-existing databases.
+        return nullptr;
+    }
+    MDB_cursor *cursor;
+    if (const int rc = mdb_cursor_open(txn(), dbi, &cursor)) {
+        DataStore::Error error(name.toLatin1() + db, getErrorCode(rc), QByteArray("Error during mdb_cursor_open: ") + QByteArray(mdb_strerror(rc)));
+        errorHandler ? errorHandler(error) : defaultErrorHandler(error);
+        return nullptr;
+    }
+    return new LmdbCursor(parent, dbi, cursor, upperBound, errorHandler ? errorHandler : defaultErrorHandler, name.toLatin1() + db, compressed);
 }
 
-qint64 DataStore::NamedDatabase::getSize()
+qint64 LmdbDatabase::getSize()
 {
-    if (!d || !d->transaction) {
+    if (!txn()) {
         return -1;
     }
 
     int rc;
     MDB_stat stat;
-    rc = mdb_stat(d->transaction, d->dbi, &stat);
+    rc = mdb_stat(txn(), dbi, &stat);
     if (rc) {
         SinkWarning() << "Something went wrong " << QByteArray(mdb_strerror(rc));
     }
     return stat.ms_psize * (stat.ms_leaf_pages + stat.ms_branch_pages + stat.ms_overflow_pages);
 }
 
-DataStore::NamedDatabase::Stat DataStore::NamedDatabase::stat()
+DataStore::NamedDatabase::Stat LmdbDatabase::stat()
 {
-    if (!d || !d->transaction) {
+    if (!txn()) {
         return {};
     }
 
     int rc;
     MDB_stat stat;
-    rc = mdb_stat(d->transaction, d->dbi, &stat);
+    rc = mdb_stat(txn(), dbi, &stat);
     if (rc) {
         SinkWarning() << "Something went wrong " << QByteArray(mdb_strerror(rc));
         return {};
@@ -522,233 +1247,167 @@ DataStore::NamedDatabase::Stat DataStore::NamedDatabase::stat()
     // std::cout << "entries: " << stat.ms_entries << std::endl;
 }
 
-bool DataStore::NamedDatabase::allowsDuplicates() const
+bool LmdbDatabase::allowsDuplicates() const
 {
     unsigned int flags;
-    mdb_dbi_flags(d->transaction, d->dbi, &flags);
+    mdb_dbi_flags(txn(), dbi, &flags);
     return flags & MDB_DUPSORT;
 }
 
 
-class DataStore::Transaction::Private
-{
-public:
-    Private(bool _requestRead, const std::function<void(const DataStore::Error &error)> &_defaultErrorHandler, const QString &_name, MDB_env *_env, bool _noLock = false)
-        : env(_env), transaction(nullptr), requestedRead(_requestRead), defaultErrorHandler(_defaultErrorHandler), name(_name), implicitCommit(false), error(false), modificationCounter(0), noLock(_noLock)
-    {
-    }
-    ~Private()
-    {
-    }
-
-    MDB_env *env;
-    MDB_txn *transaction;
-    bool requestedRead;
-    std::function<void(const DataStore::Error &error)> defaultErrorHandler;
-    QString name;
-    bool implicitCommit;
-    bool error;
-    int modificationCounter;
-    bool noLock;
-
-    QMap<QString, MDB_dbi> createdDbs;
-
-    void startTransaction()
-    {
-        Q_ASSERT(!transaction);
-        Q_ASSERT(sEnvironments.values().contains(env));
-        // auto f = [](const char *msg, void *ctx) -> int {
-        //     qDebug() << msg;
-        //     return 0;
-        // };
-        // mdb_reader_list(env, f, nullptr);
-        // Trace_area("storage." + name.toLatin1()) << "Opening transaction " << requestedRead;
-        const int rc = mdb_txn_begin(env, NULL, requestedRead ? MDB_RDONLY : 0, &transaction);
-        // Trace_area("storage." + name.toLatin1()) << "Started transaction " << mdb_txn_id(transaction) << transaction;
-        if (rc) {
-            defaultErrorHandler(Error(name.toLatin1(), ErrorCodes::GenericError, "Error while opening transaction: " + QByteArray(mdb_strerror(rc))));
-        }
-    }
-};
-
-DataStore::Transaction::Transaction() : d(nullptr)
-{
-}
-
-DataStore::Transaction::Transaction(Transaction::Private *prv) : d(prv)
-{
-    d->startTransaction();
-}
-
-DataStore::Transaction::Transaction(Transaction &&other) : d(nullptr)
-{
-    *this = std::move(other);
-}
-
-DataStore::Transaction &DataStore::Transaction::operator=(DataStore::Transaction &&other)
+bool LmdbTransaction::commit(const std::function<void(const DataStore::Error &error)> &errorHandler)
 {
-    if (&other != this) {
-        abort();
-        delete d;
-        d = other.d;
-        other.d = nullptr;
+    if (!transaction) {
+        return false;
     }
-    return *this;
-}
 
-DataStore::Transaction::~Transaction()
-{
-    if (d && d->transaction) {
-        if (d->implicitCommit && !d->error) {
-            commit();
-        } else {
-            // Trace_area("storage." + d->name.toLatin1()) << "Aborting transaction" << mdb_txn_id(d->transaction) << d->transaction;
-            abort();
-        }
+    // Trace_area("storage." + name.toLatin1()) << "Committing transaction" << mdb_txn_id(transaction) << transaction;
+    Q_ASSERT(sEnvironments.values().contains(env));
+    //A read transaction has nothing to commit, so we can reset and reuse it.
+    //If it opened new dbis we have to commit them for them to become visible to other transactions.
+    if (requestedRead && createdDbs.isEmpty() && returnReadTransactionToPool(env, transaction)) {
+        transaction = nullptr;
+        finishTransaction();
+        return true;
     }
-    delete d;
-}
-
-DataStore::Transaction::operator bool() const
-{
-    return (d && d->transaction);
-}
-
-bool DataStore::Transaction::commit(const std::function<void(const DataStore::Error &error)> &errorHandler)
-{
-    if (!d || !d->transaction) {
-        return false;
+    QElapsedTimer time;
+    time.start();
+    int rc = mdb_txn_commit(transaction);
+    //The commit can also run out of space
+    while (rc == MDB_MAP_FULL && growAndReplay(true)) {
+        rc = mdb_txn_commit(transaction);
     }
-
-    // Trace_area("storage." + d->name.toLatin1()) << "Committing transaction" << mdb_txn_id(d->transaction) << d->transaction;
-    Q_ASSERT(sEnvironments.values().contains(d->env));
-    const int rc = mdb_txn_commit(d->transaction);
     if (rc) {
-        abort();
-        Error error(d->name.toLatin1(), ErrorCodes::TransactionError, "Error during transaction commit: " + QByteArray(mdb_strerror(rc)));
-        errorHandler ? errorHandler(error) : d->defaultErrorHandler(error);
+        //A failed commit frees the transaction as well
+        transaction = nullptr;
+        finishTransaction();
+        DataStore::Error error(name.toLatin1(), DataStore::ErrorCodes::TransactionError, "Error during transaction commit: " + QByteArray(mdb_strerror(rc)));
+        errorHandler ? errorHandler(error) : defaultErrorHandler(error);
         //If transactions start failing we're in an unrecoverable situation (i.e. out of diskspace). So throw an exception that will terminate the application.
         throw std::runtime_error("Fatal error while committing transaction.");
     }
-    d->transaction = nullptr;
+    transaction = nullptr;
+    if (!requestedRead) {
+        recordCommitLatency(commitCounters(name), time.nsecsElapsed());
+    }
 
     //Add the created dbis to the shared environment
-    if (!d->createdDbs.isEmpty()) {
-        if (!d->noLock) {
+    if (!createdDbs.isEmpty()) {
+        if (!noLock) {
             sDbisLock.lockForWrite();
         }
-        for (auto it = d->createdDbs.constBegin(); it != d->createdDbs.constEnd(); it++) {
-            Q_ASSERT(!sDbis.contains(it.key()));
-            sDbis.insert(it.key(), it.value());
+        auto &dbis = sDbis[env];
+        for (auto it = createdDbs.constBegin(); it != createdDbs.constEnd(); it++) {
+            dbis.insert(it.key(), it.value());
         }
-        d->createdDbs.clear();
-        if (!d->noLock) {
+        if (!noLock) {
             sDbisLock.unlock();
         }
     }
+    finishTransaction();
 
     return !rc;
 }
 
-void DataStore::Transaction::abort()
+void LmdbTransaction::abort()
 {
-    if (!d || !d->transaction) {
+    if (!transaction) {
         return;
     }
 
-    d->createdDbs.clear();
-    // Trace_area("storage." + d->name.toLatin1()) << "Aborting transaction" << mdb_txn_id(d->transaction) << d->transaction;
-    Q_ASSERT(sEnvironments.values().contains(d->env));
-    mdb_txn_abort(d->transaction);
-    d->transaction = nullptr;
+    // Trace_area("storage." + name.toLatin1()) << "Aborting transaction" << mdb_txn_id(transaction) << transaction;
+    Q_ASSERT(sEnvironments.values().contains(env));
+    if (!requestedRead || !returnReadTransactionToPool(env, transaction)) {
+        mdb_txn_abort(transaction);
+    }
+    transaction = nullptr;
+    finishTransaction();
 }
 
 //Ensure that we opened the correct database by comparing the expected identifier with the one
 //we write to the database on first open.
-static bool ensureCorrectDb(DataStore::NamedDatabase &database, const QByteArray &db, bool readOnly)
+static bool ensureCorrectDb(LmdbDatabase &database, const QByteArray &db, bool readOnly)
 {
     bool openedTheWrongDatabase = false;
-    auto count = database.scan("__internal_dbname", [db, &openedTheWrongDatabase](const QByteArray &key, const QByteArray &value) ->bool {
-        if (value != db) {
-            SinkWarning() << "Opened the wrong database, got " << value << " instead of " << db;
+    auto count = database.scan("__internal_dbname", [db, &openedTheWrongDatabase](const Slice &, const Slice &value) ->bool {
+        if (!(value == db)) {
+            SinkWarning() << "Opened the wrong database, got " << value.toByteArray() << " instead of " << db;
             openedTheWrongDatabase = true;
         }
         return false;
     },
     [&](const DataStore::Error &) {
-    }, false);
+    }, false, true);
     //This is the first time we open this database in a write transaction, write the db name
     if (!count) {
         if (!readOnly) {
-            database.write("__internal_dbname", db);
+            database.write("__internal_dbname", db, {});
         }
     }
     return !openedTheWrongDatabase;
 }
 
-DataStore::NamedDatabase DataStore::Transaction::openDatabase(const QByteArray &db, const std::function<void(const DataStore::Error &error)> &errorHandler, bool allowDuplicates) const
+DatabaseBackend *LmdbTransaction::openDatabase(const QByteArray &db, const std::function<void(const DataStore::Error &error)> &errorHandler, int flags)
 {
-    if (!d) {
-        SinkError() << "Tried to open database on invalid transaction: " << db;
-        return DataStore::NamedDatabase();
+    auto p = new LmdbDatabase(db, flags, defaultErrorHandler, name, this);
+
+    //Fast path for databases that we already opened in this transaction
+    const auto openedDb = openedDbs.constFind(db);
+    if (openedDb != openedDbs.constEnd()) {
+        p->dbi = openedDb->dbi;
+        p->integerKeys = openedDb->integerKeys;
+        p->compressed = openedDb->compressed;
+        p->counters = openedDb->counters;
+        return p;
     }
-    Q_ASSERT(d->transaction);
-    // We don't now if anything changed
-    d->implicitCommit = true;
-    auto p = new DataStore::NamedDatabase::Private(db, allowDuplicates, d->defaultErrorHandler, d->name, d->transaction);
-    if (!d->noLock) {
-        sDbisLock.lockForRead();
+
+    //Another transaction may have added the dbi since we took the snapshot
+    if (!knownDbis.contains(db) && !noLock) {
+        refreshKnownDbis();
     }
-    if (!p->openDatabase(d->requestedRead, errorHandler)) {
-        if (!d->noLock) {
-            sDbisLock.unlock();
-        }
+    if (!p->openDatabase(requestedRead, knownDbis, errorHandler)) {
         delete p;
-        return DataStore::NamedDatabase();
-    }
-    if (!d->noLock) {
-        sDbisLock.unlock();
+        return nullptr;
     }
-    if (p->createdNewDbi) {
-        d->createdDbs.insert(p->createdDbName, p->dbi);
+    if (p->createdNewDbi || p->updatedDbi) {
+        createdDbs.insert(db, {p->dbi, p->recordedCompressed});
     }
-    auto database = DataStore::NamedDatabase(p);
-    if (!ensureCorrectDb(database, db, d->requestedRead)) {
+    //Integer keyed databases can't hold the textual __internal_dbname key
+    if (!p->integerKeys && !ensureCorrectDb(*p, db, requestedRead)) {
         SinkWarning() << "Failed to open the database correctly" << db;
         Q_ASSERT(false);
-        return DataStore::NamedDatabase();
+        delete p;
+        return nullptr;
     }
-    return database;
+    //Counted from here on, so the internal database name check doesn't show up
+    p->counters = databaseCounters(name, db);
+    openedDbs.insert(db, {p->dbi, p->integerKeys, p->compressed, p->counters});
+    return p;
 }
 
-QList<QByteArray> DataStore::Transaction::getDatabaseNames() const
+QList<QByteArray> LmdbTransaction::getDatabaseNames() const
 {
-    if (!d) {
-        SinkWarning() << "Invalid transaction";
-        return QList<QByteArray>();
-    }
-    return Sink::Storage::getDatabaseNames(d->transaction);
-
+    return Sink::Storage::getDatabaseNames(transaction);
 }
 
 
-DataStore::Transaction::Stat DataStore::Transaction::stat(bool printDetails)
+DataStore::Transaction::Stat LmdbTransaction::stat(bool printDetails)
 {
     const int freeDbi = 0;
     const int mainDbi = 1;
 
 	MDB_envinfo mei;
-    mdb_env_info(d->env, &mei);
+    mdb_env_info(env, &mei);
 
     MDB_stat mst;
-    mdb_stat(d->transaction, freeDbi, &mst);
-    auto freeStat = NamedDatabase::Stat{mst.ms_branch_pages,
+    mdb_stat(transaction, freeDbi, &mst);
+    auto freeStat = DataStore::NamedDatabase::Stat{mst.ms_branch_pages,
             mst.ms_leaf_pages,
             mst.ms_overflow_pages,
             mst.ms_entries};
 
-    mdb_stat(d->transaction, mainDbi, &mst);
-    auto mainStat = NamedDatabase::Stat{mst.ms_branch_pages,
+    mdb_stat(transaction, mainDbi, &mst);
+    auto mainStat = DataStore::NamedDatabase::Stat{mst.ms_branch_pages,
             mst.ms_leaf_pages,
             mst.ms_overflow_pages,
             mst.ms_entries};
@@ -757,7 +1416,7 @@ DataStore::Transaction::Stat DataStore::Transaction::stat(bool printDetails)
     MDB_val key, data;
     size_t freePages = 0, *iptr;
 
-    int rc = mdb_cursor_open(d->transaction, freeDbi, &cursor);
+    int rc = mdb_cursor_open(transaction, freeDbi, &cursor);
     if (rc) {
         fprintf(stderr, "mdb_cursor_open failed, error %d %s\n", rc, mdb_strerror(rc));
         return {};
@@ -797,17 +1456,23 @@ DataStore::Transaction::Stat DataStore::Transaction::stat(bool printDetails)
 }
 
 
-class DataStore::Private
+class LmdbStore : public StorageBackend
 {
 public:
-    Private(const QString &s, const QString &n, AccessMode m, const DbLayout &layout = {});
-    ~Private();
+    LmdbStore(const QString &s, const QString &n, DataStore::AccessMode m, const DbLayout &layout);
+    ~LmdbStore();
 
-    QString storageRoot;
-    QString name;
+    bool exists() const Q_DECL_OVERRIDE
+    {
+        return env != nullptr;
+    }
+
+    TransactionBackend *createTransaction(bool requestedRead, const std::function<void(const DataStore::Error &error)> &defaultErrorHandler) Q_DECL_OVERRIDE;
+    qint64 diskUsage() const Q_DECL_OVERRIDE;
+    void removeFromDisk(const std::function<void(const DataStore::Error &error)> &errorHandler) Q_DECL_OVERRIDE;
+    bool compact(const std::function<void(const DataStore::Error &error)> &errorHandler) Q_DECL_OVERRIDE;
 
     MDB_env *env;
-    AccessMode mode;
     Sink::Log::Context logCtx;
 
     void initEnvironment(const QString &fullPath, const DbLayout &layout)
@@ -826,7 +1491,7 @@ public:
                 } else {
                     //Limit large enough to accomodate all our named dbs. This only starts to matter if the number gets large, otherwise it's just a bunch of extra entries in the main table.
                     mdb_env_set_maxdbs(env, 50);
-                    const bool readOnly = (mode == ReadOnly);
+                    const bool readOnly = (mode == DataStore::ReadOnly);
                     unsigned int flags = MDB_NOTLS;
                     if (readOnly) {
                         flags |= MDB_RDONLY;
@@ -840,39 +1505,40 @@ public:
                         mdb_env_close(env);
                         env = 0;
                     } else {
-                        if (RUNNING_ON_VALGRIND) {
-                            // In order to run valgrind this size must be smaller than half your available RAM
-                            // https://github.com/BVLC/caffe/issues/2404
-                            mdb_env_set_mapsize(env, (size_t)10485760 * (size_t)1000); // 1MB * 1000
-                        } else {
-                            //This is the maximum size of the db (but will not be used directly), so we make it large enough that we hopefully never run into the limit.
-                            mdb_env_set_mapsize(env, (size_t)10485760 * (size_t)100000); // 1MB * 1000
+                        //Readers use the map size that is recorded in the environment, the writer starts small and grows the map on demand.
+                        if (!readOnly) {
+                            mdb_env_set_mapsize(env, initialMapSize(env));
+                            applyDurability(env, sDurabilities.value(fullPath, DataStore::Strict));
                         }
                         Q_ASSERT(env);
                         sEnvironments.insert(fullPath, env);
+                        auto mapLock = QSharedPointer<QReadWriteLock>::create(QReadWriteLock::Recursive);
+                        sMapLocks.insert(env, mapLock);
                         //Open all available dbi's
                         bool noLock = true;
-                        auto t = Transaction(new Transaction::Private(readOnly, nullptr, name, env, noLock));
-                        if (!layout.tables.isEmpty()) {
-
-                            //TODO upgrade db if the layout has changed:
-                            //* read existing layout
-                            //* if layout is not the same create new layout
-                        //If the db is read only, abort if the db is not yet existing.
-                        //If the db is not read-only but is not existing, ensure we have a layout and create all tables.
-
-                            for (auto it = layout.tables.constBegin(); it != layout.tables.constEnd(); it++) {
-                                bool allowDuplicates = it.value();
-                                t.openDatabase(it.key(), {}, allowDuplicates);
-                            }
-                        } else {
-                            for (const auto &db : t.getDatabaseNames()) {
-                                //Get dbi to store for future use.
-                                t.openDatabase(db);
+                        LmdbTransaction t(readOnly, nullptr, name, env, mapLock, noLock);
+                        t.startTransaction();
+                        if (t.isActive()) {
+                            if (!layout.tables.isEmpty()) {
+
+                                //TODO upgrade db if the layout has changed:
+                                //* read existing layout
+                                //* if layout is not the same create new layout
+                            //If the db is read only, abort if the db is not yet existing.
+                            //If the db is not read-only but is not existing, ensure we have a layout and create all tables.
+
+                                for (auto it = layout.tables.constBegin(); it != layout.tables.constEnd(); it++) {
+                                    delete t.openDatabase(it.key(), {}, it.value());
+                                }
+                            } else {
+                                for (const auto &db : t.getDatabaseNames()) {
+                                    //Get dbi to store for future use.
+                                    delete t.openDatabase(db, {}, 0);
+                                }
                             }
+                            //To persist the dbis (this is also necessary for read-only transactions)
+                            t.commit({});
                         }
-                        //To persist the dbis (this is also necessary for read-only transactions)
-                        t.commit();
                     }
                 }
             }
@@ -881,106 +1547,286 @@ public:
 
 };
 
-DataStore::Private::Private(const QString &s, const QString &n, AccessMode m, const DbLayout &layout) : storageRoot(s), name(n), env(0), mode(m), logCtx(n.toLatin1())
+LmdbStore::LmdbStore(const QString &s, const QString &n, DataStore::AccessMode m, const DbLayout &layout) : StorageBackend(s, n, m), env(0), logCtx(n.toLatin1())
 {
 
     const QString fullPath(storageRoot + '/' + name);
     QFileInfo dirInfo(fullPath);
-    if (!dirInfo.exists() && mode == ReadWrite) {
+    if (!dirInfo.exists() && mode == DataStore::ReadWrite) {
         QDir().mkpath(fullPath);
         dirInfo.refresh();
     }
-    if (mode == ReadWrite && !dirInfo.permission(QFile::WriteOwner)) {
+    if (mode == DataStore::ReadWrite && !dirInfo.permission(QFile::WriteOwner)) {
         qCritical() << fullPath << "does not have write permissions. Aborting";
     } else if (dirInfo.exists()) {
         initEnvironment(fullPath, layout);
     }
 }
 
-DataStore::Private::~Private()
+LmdbStore::~LmdbStore()
 {
     //We never close the environment (unless we remove the db), since we should only open the environment once per process (as per lmdb docs)
     //and create storage instance from all over the place. Thus, we're not closing it here on purpose.
 }
 
-DataStore::DataStore(const QString &storageRoot, const QString &name, AccessMode mode) : d(new Private(storageRoot, name, mode))
+StorageBackend *createLmdbBackend(const QString &storageRoot, const QString &name, DataStore::AccessMode mode, const DbLayout &layout)
 {
+    return new LmdbStore(storageRoot, name, mode, layout);
 }
 
-DataStore::DataStore(const QString &storageRoot, const DbLayout &dbLayout, AccessMode mode) : d(new Private(storageRoot, dbLayout.name, mode, dbLayout))
+TransactionBackend *LmdbStore::createTransaction(bool requestedRead, const std::function<void(const DataStore::Error &error)> &defaultErrorHandler)
 {
+    QReadLocker locker(&sEnvironmentsLock);
+    if (!sEnvironments.values().contains(env)) {
+        return nullptr;
+    }
+    auto transaction = new LmdbTransaction(requestedRead, defaultErrorHandler, name, env, sMapLocks.value(env));
+    transaction->startTransaction();
+    return transaction;
 }
 
-DataStore::~DataStore()
+qint64 LmdbStore::diskUsage() const
 {
-    delete d;
+    QFileInfo info(storageRoot + '/' + name + "/data.mdb");
+    if (!info.exists()) {
+        SinkWarning() << "Tried to get filesize for non-existant file: " << info.path();
+    }
+    return info.size();
 }
 
-bool DataStore::exists() const
+void LmdbStore::removeFromDisk(const std::function<void(const DataStore::Error &error)> &errorHandler)
 {
-    return (d->env != 0);
+    const QString fullPath(storageRoot + '/' + name);
+    QWriteLocker dbiLocker(&sDbisLock);
+    QWriteLocker envLocker(&sEnvironmentsLock);
+    SinkTrace() << "Removing database from disk: " << fullPath;
+    auto env = sEnvironments.take(fullPath);
+    sDbis.remove(env);
+    sMapLocks.remove(env);
+    clearReadTransactionPool(env);
+    mdb_env_close(env);
+    QDir dir(fullPath);
+    if (!dir.removeRecursively()) {
+        DataStore::Error error(name.toLatin1(), DataStore::ErrorCodes::GenericError, QString("Failed to remove directory %1 %2").arg(storageRoot).arg(name).toLatin1());
+        errorHandler(error);
+    }
 }
 
-DataStore::Transaction DataStore::createTransaction(AccessMode type, const std::function<void(const DataStore::Error &error)> &errorHandlerArg)
+/*
+ * Takes the lock that lmdb holds on the lock file while an environment is open, so we know that no other process is using the environment.
+ *
+ * Processes that try to open the environment meanwhile block until the returned file descriptor is closed.
+ * The environment must not be open in this process, because the lock is per process.
+ */
+static int lockEnvironmentExclusively(const QString &fullPath)
 {
-    auto errorHandler = errorHandlerArg ? errorHandlerArg : defaultErrorHandler();
-    if (!d->env) {
-        errorHandler(Error(d->name.toLatin1(), ErrorCodes::GenericError, "Failed to create transaction: Missing database environment"));
-        return Transaction();
-    }
-
-    bool requestedRead = type == ReadOnly;
-
-    if (d->mode == ReadOnly && !requestedRead) {
-        errorHandler(Error(d->name.toLatin1(), ErrorCodes::GenericError, "Failed to create transaction: Requested read/write transaction in read-only mode."));
-        return Transaction();
+    const int fd = ::open(QFile::encodeName(fullPath + "/lock.mdb").constData(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
     }
-    QReadLocker locker(&sEnvironmentsLock);
-    if (!sEnvironments.values().contains(d->env)) {
-        return {};
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = 0;
+    lock.l_len = 1;
+    if (fcntl(fd, F_SETLK, &lock)) {
+        ::close(fd);
+        return -1;
     }
-    return Transaction(new Transaction::Private(requestedRead, defaultErrorHandler(), d->name, d->env));
+    return fd;
 }
 
-qint64 DataStore::diskUsage() const
+/*
+ * Writes a compacted copy of the environment at @param fullPath to @param compactPath.
+ *
+ * The environment is opened without locking, the caller has to hold the exclusive lock.
+ */
+static int copyCompacted(const QString &fullPath, const QString &compactPath)
 {
-    QFileInfo info(d->storageRoot + '/' + d->name + "/data.mdb");
-    if (!info.exists()) {
-        SinkWarning() << "Tried to get filesize for non-existant file: " << info.path();
+    MDB_env *env;
+    if (const int rc = mdb_env_create(&env)) {
+        return rc;
     }
-    return info.size();
+    mdb_env_set_maxdbs(env, 50);
+    int rc = mdb_env_open(env, QFile::encodeName(fullPath).constData(), MDB_RDONLY | MDB_NOLOCK | MDB_NOTLS, 0664);
+    if (!rc) {
+        rc = mdb_env_copy2(env, QFile::encodeName(compactPath).constData(), MDB_CP_COMPACT);
+    }
+    mdb_env_close(env);
+    return rc;
 }
 
-void DataStore::removeFromDisk() const
+bool LmdbStore::compact(const std::function<void(const DataStore::Error &error)> &errorHandler)
 {
-    const QString fullPath(d->storageRoot + '/' + d->name);
-    QWriteLocker dbiLocker(&sDbisLock);
-    QWriteLocker envLocker(&sEnvironmentsLock);
-    SinkTrace() << "Removing database from disk: " << fullPath;
-    sEnvironments.take(fullPath);
-    for (const auto &key : sDbis.keys()) {
-        if (key.startsWith(d->name)) {
-            sDbis.remove(key);
+    const QString fullPath(storageRoot + '/' + name);
+    const QString compactPath(fullPath + ".compact");
+    if (!env || mode != DataStore::ReadWrite) {
+        errorHandler(DataStore::Error(name.toLatin1(), DataStore::ErrorCodes::GenericError, "Failed to compact: The environment is not open for writing."));
+        return false;
+    }
+    {
+        QWriteLocker dbiLocker(&sDbisLock);
+        QWriteLocker envLocker(&sEnvironmentsLock);
+        if (!sEnvironments.values().contains(env)) {
+            errorHandler(DataStore::Error(name.toLatin1(), DataStore::ErrorCodes::GenericError, "Failed to compact: The environment has been closed."));
+            return false;
         }
+        auto mapLock = sMapLocks.value(env);
+        //Wait for the transactions of this process to finish and block new ones
+        if (!mapLock->tryLockForWrite(sMapLockTimeout)) {
+            errorHandler(DataStore::Error(name.toLatin1(), DataStore::ErrorCodes::GenericError, "Failed to compact: The environment is in use."));
+            return false;
+        }
+        //Close the environment, so this process no longer holds the lock on it. It is reopened below.
+        sEnvironments.remove(fullPath);
+        sDbis.remove(env);
+        sMapLocks.remove(env);
+        clearReadTransactionPool(env);
+        mdb_env_close(env);
+        env = nullptr;
+        mapLock->unlock();
     }
-    auto env = sEnvironments.take(fullPath);
-    mdb_env_close(env);
-    QDir dir(fullPath);
-    if (!dir.removeRecursively()) {
-        Error error(d->name.toLatin1(), ErrorCodes::GenericError, QString("Failed to remove directory %1 %2").arg(d->storageRoot).arg(d->name).toLatin1());
-        defaultErrorHandler()(error);
+
+    //Other processes would continue to use the old file after we replaced it, so we only compact if nobody else has the environment open
+    const int lockFd = lockEnvironmentExclusively(fullPath);
+    if (lockFd < 0) {
+        errorHandler(DataStore::Error(name.toLatin1(), DataStore::ErrorCodes::GenericError, "Failed to compact: The environment is in use by another process."));
+        initEnvironment(fullPath, {});
+        return false;
+    }
+    SinkTraceCtx(logCtx) << "Compacting: " << fullPath;
+    bool success = false;
+    QDir(compactPath).removeRecursively();
+    QDir().mkpath(compactPath);
+    if (const int rc = copyCompacted(fullPath, compactPath)) {
+        errorHandler(DataStore::Error(name.toLatin1(), DataStore::ErrorCodes::GenericError, "Failed to compact: " + QByteArray(mdb_strerror(rc))));
+    } else if (std::rename(QFile::encodeName(compactPath + "/data.mdb").constData(), QFile::encodeName(fullPath + "/data.mdb").constData())) {
+        //Replacing the file is atomic, so we either end up with the old or the compacted file
+        errorHandler(DataStore::Error(name.toLatin1(), DataStore::ErrorCodes::GenericError, "Failed to compact: Couldn't replace the database file."));
+    } else {
+        //The lock file still describes the old file
+        QFile::remove(fullPath + "/lock.mdb");
+        success = true;
     }
+    QDir(compactPath).removeRecursively();
+    ::close(lockFd);
+
+    initEnvironment(fullPath, {});
+    return success && env != nullptr;
 }
 
 void DataStore::clearEnv()
 {
     QWriteLocker locker(&sEnvironmentsLock);
     for (auto env : sEnvironments) {
+        clearReadTransactionPool(env);
         mdb_env_close(env);
     }
     sDbis.clear();
+    sMapLocks.clear();
     sEnvironments.clear();
 }
 
+void DataStore::setMapSizeLimits(size_t initialSize, size_t maximumSize)
+{
+    sInitialMapSize = initialSize ? initialSize : sDefaultInitialMapSize;
+    sMaximumMapSize = maximumSize;
+}
+
+QMap<QString, DataStore::EnvironmentStatistics> DataStore::statistics()
+{
+    QMutexLocker locker(&sStatisticsLock);
+    QMap<QString, EnvironmentStatistics> result;
+    for (auto it = sCommitCounters.constBegin(); it != sCommitCounters.constEnd(); it++) {
+        auto &environment = result[it.key()];
+        environment.commits = (*it)->commits.load(std::memory_order_relaxed);
+        for (int i = 0; i < sCommitLatencyBuckets; i++) {
+            environment.commitLatencyHistogram << (*it)->latencyHistogram[i].load(std::memory_order_relaxed);
+        }
+    }
+    for (auto env = sDatabaseCounters.constBegin(); env != sDatabaseCounters.constEnd(); env++) {
+        auto &environment = result[env.key()];
+        if (environment.commitLatencyHistogram.isEmpty()) {
+            environment.commitLatencyHistogram.fill(0, sCommitLatencyBuckets);
+        }
+        for (auto it = env->constBegin(); it != env->constEnd(); it++) {
+            const auto &counters = *it.value();
+            DatabaseStatistics db;
+            db.writes = counters.writes.load(std::memory_order_relaxed);
+            db.removes = counters.removes.load(std::memory_order_relaxed);
+            db.scans = counters.scans.load(std::memory_order_relaxed);
+            db.findLatest = counters.findLatest.load(std::memory_order_relaxed);
+            db.rowsVisited = counters.rowsVisited.load(std::memory_order_relaxed);
+            db.bytesRead = counters.bytesRead.load(std::memory_order_relaxed);
+            db.bytesWritten = counters.bytesWritten.load(std::memory_order_relaxed);
+            environment.databases.insert(it.key(), db);
+        }
+    }
+    return result;
+}
+
+void DataStore::resetStatistics()
+{
+    QMutexLocker locker(&sStatisticsLock);
+    for (const auto &counters : sCommitCounters) {
+        counters->commits = 0;
+        for (auto &bucket : counters->latencyHistogram) {
+            bucket = 0;
+        }
+    }
+    for (const auto &env : sDatabaseCounters) {
+        for (const auto &counters : env) {
+            counters->writes = 0;
+            counters->removes = 0;
+            counters->scans = 0;
+            counters->findLatest = 0;
+            counters->rowsVisited = 0;
+            counters->bytesRead = 0;
+            counters->bytesWritten = 0;
+        }
+    }
+}
+
+void DataStore::setReadTransactionPoolSize(int size)
+{
+    QMutexLocker locker(&sReadTransactionPoolLock);
+    sReadTransactionPoolSize = size >= 0 ? size : sDefaultReadTransactionPoolSize;
+    for (auto &pool : sReadTransactionPool) {
+        while (pool.size() > sReadTransactionPoolSize) {
+            mdb_txn_abort(pool.takeLast());
+        }
+    }
+}
+
+void DataStore::setDurability(const QString &storageRoot, const QString &name, Durability durability)
+{
+    const QString fullPath(storageRoot + '/' + name);
+    QWriteLocker locker(&sEnvironmentsLock);
+    sDurabilities.insert(fullPath, durability);
+    if (auto env = sEnvironments.value(fullPath)) {
+        applyDurability(env, durability);
+    }
+}
+
+bool DataStore::syncToDisk(const QString &storageRoot, const QString &name)
+{
+    QReadLocker locker(&sEnvironmentsLock);
+    auto env = sEnvironments.value(storageRoot + '/' + name);
+    if (!env) {
+        return false;
+    }
+    unsigned int flags = 0;
+    mdb_env_get_flags(env, &flags);
+    if (flags & MDB_RDONLY) {
+        return false;
+    }
+    if (const int rc = mdb_env_sync(env, 1)) {
+        SinkWarning() << "mdb_env_sync: " << rc << " " << mdb_strerror(rc);
+        return false;
+    }
+    return true;
+}
+
 }
 } // namespace Sink
@@ -0,0 +1,707 @@
+/*
+ * Copyright (C) 2017 Christian Mollekopf <mollekopf@kolabsys.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "storage.h"
+#include "storage_p.h"
+
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "log.h"
+
+namespace Sink {
+namespace Storage {
+
+/*
+ * The in-memory backend keeps every database as an ordered set of key-value pairs, sorted the way lmdb sorts them:
+ * By key (numerically for integer keys), and by value for the duplicates of a key.
+ *
+ * Every transaction works on a snapshot of the databases of the environment, and a commit replaces the snapshot of the environment.
+ * The databases of a snapshot are never modified while they are shared, a write transaction copies a database before it modifies it.
+ * A database is split into chunks of a bounded size that are shared between the copies, so a copy only duplicates the list of chunks,
+ * and a write only copies the chunk it modifies.
+ * That gives readers the same isolation as lmdb, and scans and cursors of the write transaction keep iterating over the data they started with.
+ * Like with lmdb there is a single writer per environment, further writers block until the transaction has been finished.
+ */
+
+struct MemoryEntry {
+    QByteArray key;
+    QByteArray value;
+};
+
+static int compareBytes(const QByteArray &a, const QByteArray &b)
+{
+    if (const int result = memcmp(a.constData(), b.constData(), qMin(a.size(), b.size()))) {
+        return result;
+    }
+    return a.size() - b.size();
+}
+
+static int compareKeys(const QByteArray &a, const QByteArray &b, bool integerKeys)
+{
+    //Integer keys are native size_t values, as written by DataStore::sizeTToByteArray
+    if (integerKeys && a.size() == sizeof(size_t) && b.size() == sizeof(size_t)) {
+        const size_t x = DataStore::byteArrayToSizeT(a);
+        const size_t y = DataStore::byteArrayToSizeT(b);
+        return x < y ? -1 : (x > y ? 1 : 0);
+    }
+    return compareBytes(a, b);
+}
+
+struct MemoryEntryCompare {
+    bool integerKeys;
+
+    bool operator()(const MemoryEntry &a, const MemoryEntry &b) const
+    {
+        if (const int result = compareKeys(a.key, b.key, integerKeys)) {
+            return result < 0;
+        }
+        return compareBytes(a.value, b.value) < 0;
+    }
+};
+
+//A sorted run of entries, never empty
+typedef std::vector<MemoryEntry> MemoryChunk;
+
+//Chunks are split once they grow beyond this, which bounds what a write has to copy
+static const size_t sMaxChunkSize = 512;
+
+struct MemoryDatabaseData {
+    //The position of an entry, the end position is one past the last chunk
+    struct Position {
+        size_t chunk;
+        size_t index;
+
+        bool operator==(const Position &other) const
+        {
+            return chunk == other.chunk && index == other.index;
+        }
+
+        bool operator!=(const Position &other) const
+        {
+            return !(*this == other);
+        }
+    };
+
+    MemoryDatabaseData(int _flags)
+        : flags(_flags), compare{static_cast<bool>(flags & DataStore::IntegerKeys)}
+    {
+    }
+
+    Position begin() const
+    {
+        return {0, 0};
+    }
+
+    Position end() const
+    {
+        return {chunks.size(), 0};
+    }
+
+    const MemoryEntry &at(const Position &position) const
+    {
+        return (*chunks[position.chunk])[position.index];
+    }
+
+    void next(Position &position) const
+    {
+        if (++position.index == chunks[position.chunk]->size()) {
+            position.chunk++;
+            position.index = 0;
+        }
+    }
+
+    //Must not be called on the first position
+    void prev(Position &position) const
+    {
+        if (position.index == 0) {
+            position.chunk--;
+            position.index = chunks[position.chunk]->size() - 1;
+        } else {
+            position.index--;
+        }
+    }
+
+    //The position of the first entry that doesn't sort before @param entry.
+    Position lowerBound(const MemoryEntry &entry) const
+    {
+        const auto chunk = std::lower_bound(chunks.begin(), chunks.end(), entry, [&](const std::shared_ptr<MemoryChunk> &c, const MemoryEntry &e) {
+            return compare(c->back(), e);
+        });
+        if (chunk == chunks.end()) {
+            return end();
+        }
+        const auto it = std::lower_bound((*chunk)->begin(), (*chunk)->end(), entry, compare);
+        return {static_cast<size_t>(chunk - chunks.begin()), static_cast<size_t>(it - (*chunk)->begin())};
+    }
+
+    //The first entry with @param key, or the position it would be inserted at.
+    Position lowerBound(const QByteArray &key) const
+    {
+        //The empty value sorts before all other values of the key
+        return lowerBound(MemoryEntry{key, QByteArray{}});
+    }
+
+    //The chunk for modification, it is copied first if it's still shared with another copy of the database.
+    MemoryChunk &writableChunk(size_t chunk)
+    {
+        auto &data = chunks[chunk];
+        if (data.use_count() > 1) {
+            data = std::make_shared<MemoryChunk>(*data);
+        }
+        return *data;
+    }
+
+    //Returns false if the entry already exists.
+    bool insert(const MemoryEntry &entry)
+    {
+        auto position = lowerBound(entry);
+        if (position != end() && !compare(entry, at(position))) {
+            return false;
+        }
+        if (chunks.empty()) {
+            chunks.push_back(std::make_shared<MemoryChunk>());
+            position = begin();
+        } else if (position == end()) {
+            //Append to the last chunk
+            position = {chunks.size() - 1, chunks.back()->size()};
+        }
+        auto &chunk = writableChunk(position.chunk);
+        chunk.insert(chunk.begin() + position.index, entry);
+        if (chunk.size() > sMaxChunkSize) {
+            const auto middle = chunk.begin() + chunk.size() / 2;
+            auto second = std::make_shared<MemoryChunk>(middle, chunk.end());
+            chunk.erase(middle, chunk.end());
+            chunks.insert(chunks.begin() + position.chunk + 1, second);
+        }
+        count++;
+        return true;
+    }
+
+    //Returns the position of the entry following the erased one.
+    Position erase(const Position &position)
+    {
+        auto &chunk = writableChunk(position.chunk);
+        chunk.erase(chunk.begin() + position.index);
+        count--;
+        if (chunk.empty()) {
+            chunks.erase(chunks.begin() + position.chunk);
+            return {position.chunk, 0};
+        }
+        if (position.index == chunk.size()) {
+            return {position.chunk + 1, 0};
+        }
+        return position;
+    }
+
+    qint64 dataSize() const
+    {
+        qint64 size = 0;
+        for (const auto &chunk : chunks) {
+            for (const auto &entry : *chunk) {
+                size += entry.key.size() + entry.value.size();
+            }
+        }
+        return size;
+    }
+
+    int flags;
+    MemoryEntryCompare compare;
+    std::vector<std::shared_ptr<MemoryChunk>> chunks;
+    size_t count = 0;
+};
+
+//std::shared_ptr, so a write transaction can tell with use_count whether a database is still shared
+typedef QHash<QByteArray, std::shared_ptr<MemoryDatabaseData>> MemorySnapshot;
+
+struct MemoryEnvironment {
+    //Protects the snapshot
+    QMutex lock;
+    MemorySnapshot snapshot;
+    //Held for the lifetime of a write transaction
+    QMutex writeLock;
+};
+
+static QMutex sMemoryEnvironmentsLock;
+static QHash<QString, QSharedPointer<MemoryEnvironment>> sMemoryEnvironments;
+
+class MemoryTransaction : public TransactionBackend
+{
+public:
+    MemoryTransaction(bool _requestedRead, const std::function<void(const DataStore::Error &error)> &_defaultErrorHandler, const QString &_name, const QSharedPointer<MemoryEnvironment> &_env)
+        : env(_env), requestedRead(_requestedRead), defaultErrorHandler(_defaultErrorHandler), name(_name)
+    {
+    }
+
+    ~MemoryTransaction()
+    {
+        Q_ASSERT(!active);
+    }
+
+    void startTransaction()
+    {
+        if (!requestedRead) {
+            env->writeLock.lock();
+        }
+        QMutexLocker locker(&env->lock);
+        snapshot = env->snapshot;
+        active = true;
+    }
+
+    void finishTransaction()
+    {
+        snapshot.clear();
+        active = false;
+        if (!requestedRead) {
+            env->writeLock.unlock();
+        }
+    }
+
+    bool isActive() const Q_DECL_OVERRIDE
+    {
+        return active;
+    }
+
+    bool commit(const std::function<void(const DataStore::Error &error)> &) Q_DECL_OVERRIDE
+    {
+        if (!active) {
+            return false;
+        }
+        if (!requestedRead) {
+            QMutexLocker locker(&env->lock);
+            env->snapshot = snapshot;
+        }
+        finishTransaction();
+        return true;
+    }
+
+    void abort() Q_DECL_OVERRIDE
+    {
+        if (!active) {
+            return;
+        }
+        finishTransaction();
+    }
+
+    QList<QByteArray> getDatabaseNames() const Q_DECL_OVERRIDE
+    {
+        return snapshot.keys();
+    }
+
+    DatabaseBackend *openDatabase(const QByteArray &db, const std::function<void(const DataStore::Error &error)> &errorHandler, int flags) Q_DECL_OVERRIDE;
+
+    DataStore::Transaction::Stat stat(bool) Q_DECL_OVERRIDE
+    {
+        return {};
+    }
+
+    std::shared_ptr<const MemoryDatabaseData> data(const QByteArray &db) const
+    {
+        return snapshot.value(db);
+    }
+
+    /*
+     * The data of @param db for modification, it is copied first if it's still shared with the environment, another transaction, a scan or a cursor.
+     * The copy shares the chunks with the original.
+     */
+    MemoryDatabaseData *writableData(const QByteArray &db)
+    {
+        auto &data = snapshot[db];
+        Q_ASSERT(data);
+        if (data.use_count() > 1) {
+            data = std::make_shared<MemoryDatabaseData>(*data);
+        }
+        return data.get();
+    }
+
+    QSharedPointer<MemoryEnvironment> env;
+    bool requestedRead;
+    std::function<void(const DataStore::Error &error)> defaultErrorHandler;
+    QString name;
+    MemorySnapshot snapshot;
+    bool active = false;
+};
+
+class MemoryCursor : public CursorBackend
+{
+public:
+    MemoryCursor(const std::shared_ptr<const MemoryDatabaseData> &_data, const QByteArray &_upperBound)
+        : data(_data), it(data->end()), upperBound(_upperBound)
+    {
+    }
+
+    bool withinBound() const
+    {
+        return upperBound.isEmpty() || compareKeys(data->at(it).key, upperBound, data->compare.integerKeys) < 0;
+    }
+
+    bool skipForward()
+    {
+        while (it != data->end() && DataStore::isInternalKey(data->at(it).key)) {
+            data->next(it);
+        }
+        positioned = true;
+        valid = it != data->end() && withinBound();
+        return valid;
+    }
+
+    bool skipBackward()
+    {
+        positioned = true;
+        while (DataStore::isInternalKey(data->at(it).key)) {
+            if (it == data->begin()) {
+                valid = false;
+                return false;
+            }
+            data->prev(it);
+        }
+        valid = withinBound();
+        return valid;
+    }
+
+    bool seek(const QByteArray &key) Q_DECL_OVERRIDE
+    {
+        it = key.isEmpty() ? data->begin() : data->lowerBound(key);
+        return skipForward();
+    }
+
+    bool seekLast() Q_DECL_OVERRIDE
+    {
+        it = upperBound.isEmpty() ? data->end() : data->lowerBound(upperBound);
+        if (it == data->begin()) {
+            positioned = true;
+            valid = false;
+            return false;
+        }
+        data->prev(it);
+        return skipBackward();
+    }
+
+    bool next() Q_DECL_OVERRIDE
+    {
+        if (!valid) {
+            return false;
+        }
+        data->next(it);
+        return skipForward();
+    }
+
+    bool prev() Q_DECL_OVERRIDE
+    {
+        if (!positioned || it == data->begin()) {
+            valid = false;
+            return false;
+        }
+        data->prev(it);
+        return skipBackward();
+    }
+
+    bool isValid() const Q_DECL_OVERRIDE
+    {
+        return valid;
+    }
+
+    Slice key() const Q_DECL_OVERRIDE
+    {
+        const auto &entry = data->at(it);
+        return Slice{entry.key.constData(), static_cast<size_t>(entry.key.size())};
+    }
+
+    Slice value() const Q_DECL_OVERRIDE
+    {
+        const auto &entry = data->at(it);
+        return Slice{entry.value.constData(), static_cast<size_t>(entry.value.size())};
+    }
+
+    //Keeps the data alive, modifications of the transaction go to a copy
+    std::shared_ptr<const MemoryDatabaseData> data;
+    MemoryDatabaseData::Position it;
+    QByteArray upperBound;
+    bool positioned = false;
+    bool valid = false;
+};
+
+class MemoryDatabase : public DatabaseBackend
+{
+public:
+    MemoryDatabase(const QByteArray &_db, int _flags, const std::function<void(const DataStore::Error &error)> &_defaultErrorHandler, const QString &_name, MemoryTransaction *_parent)
+        : db(_db), parent(_parent), allowDuplicates(_flags & DataStore::AllowDuplicates), defaultErrorHandler(_defaultErrorHandler), name(_name)
+    {
+    }
+
+    void reportError(const std::function<void(const DataStore::Error &error)> &errorHandler, int code, const QByteArray &message) const
+    {
+        DataStore::Error error(name.toLatin1() + db, code, message);
+        errorHandler ? errorHandler(error) : defaultErrorHandler(error);
+    }
+
+    bool write(const QByteArray &key, const QByteArray &value, const std::function<void(const DataStore::Error &error)> &errorHandler) Q_DECL_OVERRIDE
+    {
+        if (!parent->isActive()) {
+            reportError(errorHandler, DataStore::GenericError, "Not open");
+            return false;
+        }
+        if (key.isEmpty()) {
+            reportError(errorHandler, DataStore::GenericError, "Tried to write empty key.");
+            return false;
+        }
+        auto data = parent->writableData(db);
+        if (!allowDuplicates) {
+            const auto it = data->lowerBound(key);
+            if (it != data->end() && data->at(it).key == key) {
+                data->erase(it);
+            }
+        }
+        //Deep copies, the data may belong to the caller
+        data->insert(MemoryEntry{QByteArray(key.constData(), key.size()), QByteArray(value.constData(), value.size())});
+        return true;
+    }
+
+    void remove(const QByteArray &key, const QByteArray &value, const std::function<void(const DataStore::Error &error)> &errorHandler) Q_DECL_OVERRIDE
+    {
+        if (!parent->isActive()) {
+            reportError(errorHandler, DataStore::GenericError, "Not open");
+            return;
+        }
+        auto data = parent->writableData(db);
+        bool removed = false;
+        if (allowDuplicates && !value.isEmpty()) {
+            const MemoryEntry entry{key, value};
+            const auto it = data->lowerBound(entry);
+            if (it != data->end() && !data->compare(entry, data->at(it))) {
+                data->erase(it);
+                removed = true;
+            }
+        } else {
+            auto it = data->lowerBound(key);
+            while (it != data->end() && data->at(it).key == key) {
+                it = data->erase(it);
+                removed = true;
+            }
+        }
+        if (!removed) {
+            reportError(errorHandler, DataStore::NotFound, "Error on remove: Not found");
+        }
+    }
+
+    int scan(const QByteArray &k, FunctionRef<bool(const Slice &key, const Slice &value)> resultHandler,
+        const std::function<void(const DataStore::Error &error)> &errorHandler, bool findSubstringKeys, bool skipInternalKeys) Q_DECL_OVERRIDE
+    {
+        //Held for the duration of the scan, so the result handler can modify the database
+        const auto data = parent->data(db);
+        if (!data) {
+            // Not an error. We rely on this to read nothing from non-existing databases.
+            return 0;
+        }
+        int numberOfRetrievedValues = 0;
+        if (k.isEmpty() || allowDuplicates || findSubstringKeys) {
+            for (auto it = k.isEmpty() ? data->begin() : data->lowerBound(k); it != data->end(); data->next(it)) {
+                const auto &entry = data->at(it);
+                const Slice key{entry.key.constData(), static_cast<size_t>(entry.key.size())};
+                //Without substring matching only the duplicates of the key are returned
+                if (!(findSubstringKeys || k.isEmpty() ? key.startsWith(k) : key == k)) {
+                    break;
+                }
+                if (skipInternalKeys && DataStore::isInternalKey(key)) {
+                    continue;
+                }
+                numberOfRetrievedValues++;
+                if (!resultHandler(key, Slice{entry.value.constData(), static_cast<size_t>(entry.value.size())})) {
+                    break;
+                }
+            }
+        } else {
+            const auto it = data->lowerBound(k);
+            if (it != data->end() && data->at(it).key == k) {
+                const auto &entry = data->at(it);
+                numberOfRetrievedValues++;
+                resultHandler(Slice{entry.key.constData(), static_cast<size_t>(entry.key.size())}, Slice{entry.value.constData(), static_cast<size_t>(entry.value.size())});
+            } else {
+                reportError(errorHandler, DataStore::NotFound, "Error during scan. Key: " + k + " : Not found");
+            }
+        }
+        return numberOfRetrievedValues;
+    }
+
+    void findLatest(const QByteArray &k, FunctionRef<void(const Slice &key, const Slice &value)> resultHandler,
+        const std::function<void(const DataStore::Error &error)> &errorHandler) Q_DECL_OVERRIDE
+    {
+        const auto data = parent->data(db);
+        if (!data) {
+            // Not an error. We rely on this to read nothing from non-existing databases.
+            return;
+        }
+        if (k.isEmpty()) {
+            reportError(errorHandler, DataStore::GenericError, "Can't use findLatest with empty key.");
+            return;
+        }
+        //The latest value is the one before the first key past the prefix range
+        const auto upperBound = prefixUpperBound(k);
+        auto it = upperBound.isEmpty() ? data->end() : data->lowerBound(upperBound);
+        if (it != data->begin()) {
+            data->prev(it);
+            const auto &entry = data->at(it);
+            const Slice key{entry.key.constData(), static_cast<size_t>(entry.key.size())};
+            if (key.startsWith(k)) {
+                resultHandler(key, Slice{entry.value.constData(), static_cast<size_t>(entry.value.size())});
+                return;
+            }
+        }
+        reportError(errorHandler, 1, "Error during find latest. Key: " + k + " : No value found");
+    }
+
+    CursorBackend *createCursor(const QByteArray &upperBound, const std::function<void(const DataStore::Error &error)> &) Q_DECL_OVERRIDE
+    {
+        const auto data = parent->data(db);
+        if (!data) {
+            // Not an error. We rely on this to read nothing from non-existing databases.
+            return nullptr;
+        }
+        return new MemoryCursor(data, upperBound);
+    }
+
+    qint64 getSize() Q_DECL_OVERRIDE
+    {
+        const auto data = parent->data(db);
+        if (!data) {
+            return -1;
+        }
+        return data->dataSize();
+    }
+
+    DataStore::NamedDatabase::Stat stat() Q_DECL_OVERRIDE
+    {
+        const auto data = parent->data(db);
+        if (!data) {
+            return {};
+        }
+        return {0, 0, 0, data->count};
+    }
+
+    bool allowsDuplicates() const Q_DECL_OVERRIDE
+    {
+        return allowDuplicates;
+    }
+
+    QByteArray db;
+    //The data is looked up through the parent, because it is replaced whenever the transaction copies it
+    MemoryTransaction *parent;
+    bool allowDuplicates;
+    std::function<void(const DataStore::Error &error)> defaultErrorHandler;
+    QString name;
+};
+
+DatabaseBackend *MemoryTransaction::openDatabase(const QByteArray &db, const std::function<void(const DataStore::Error &error)> &, int flags)
+{
+    const auto existing = snapshot.constFind(db);
+    if (existing != snapshot.constEnd()) {
+        //The flags of an existing database take precedence over the requested ones
+        return new MemoryDatabase(db, (*existing)->flags, defaultErrorHandler, name, this);
+    }
+    if (requestedRead) {
+        return nullptr;
+    }
+    //Values are not compressed in memory, so there is no codec to record
+    const int persistedFlags = flags & (DataStore::AllowDuplicates | DataStore::IntegerKeys);
+    snapshot.insert(db, std::make_shared<MemoryDatabaseData>(persistedFlags));
+    return new MemoryDatabase(db, persistedFlags, defaultErrorHandler, name, this);
+}
+
+class MemoryStore : public StorageBackend
+{
+public:
+    MemoryStore(const QString &s, const QString &n, DataStore::AccessMode m, const DbLayout &layout)
+        : StorageBackend(s, n, m)
+    {
+        const QString fullPath(storageRoot + '/' + name);
+        QMutexLocker locker(&sMemoryEnvironmentsLock);
+        env = sMemoryEnvironments.value(fullPath);
+        if (!env && mode == DataStore::ReadWrite) {
+            env = QSharedPointer<MemoryEnvironment>::create();
+            for (auto it = layout.tables.constBegin(); it != layout.tables.constEnd(); it++) {
+                env->snapshot.insert(it.key(), std::make_shared<MemoryDatabaseData>(it.value() & (DataStore::AllowDuplicates | DataStore::IntegerKeys)));
+            }
+            sMemoryEnvironments.insert(fullPath, env);
+        }
+    }
+
+    bool exists() const Q_DECL_OVERRIDE
+    {
+        return env;
+    }
+
+    TransactionBackend *createTransaction(bool requestedRead, const std::function<void(const DataStore::Error &error)> &defaultErrorHandler) Q_DECL_OVERRIDE
+    {
+        {
+            QMutexLocker locker(&sMemoryEnvironmentsLock);
+            //The environment has been removed
+            if (sMemoryEnvironments.value(storageRoot + '/' + name) != env) {
+                return nullptr;
+            }
+        }
+        auto transaction = new MemoryTransaction(requestedRead, defaultErrorHandler, name, env);
+        transaction->startTransaction();
+        return transaction;
+    }
+
+    qint64 diskUsage() const Q_DECL_OVERRIDE
+    {
+        if (!env) {
+            return 0;
+        }
+        MemorySnapshot snapshot;
+        {
+            QMutexLocker locker(&env->lock);
+            snapshot = env->snapshot;
+        }
+        //The size of the data, which is what would end up on disk
+        qint64 size = 0;
+        for (const auto &data : snapshot) {
+            size += data->dataSize();
+        }
+        return size;
+    }
+
+    void removeFromDisk(const std::function<void(const DataStore::Error &error)> &) Q_DECL_OVERRIDE
+    {
+        QMutexLocker locker(&sMemoryEnvironmentsLock);
+        SinkTrace() << "Removing in-memory database: " << storageRoot + '/' + name;
+        sMemoryEnvironments.remove(storageRoot + '/' + name);
+    }
+
+    bool compact(const std::function<void(const DataStore::Error &error)> &) Q_DECL_OVERRIDE
+    {
+        //There are no free pages to get rid of
+        return exists();
+    }
+
+    QSharedPointer<MemoryEnvironment> env;
+};
+
+StorageBackend *createMemoryBackend(const QString &storageRoot, const QString &name, DataStore::AccessMode mode, const DbLayout &layout)
+{
+    return new MemoryStore(storageRoot, name, mode, layout);
+}
+
+}
+} // namespace Sink
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2017 Christian Mollekopf <mollekopf@kolabsys.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "storage.h"
+
+namespace Sink {
+namespace Storage {
+
+/*
+ * The interfaces that are implemented by a storage backend.
+ *
+ * DataStore, Transaction, NamedDatabase and Cursor only forward to these, and take care of the checks that are the same for all backends.
+ * The LMDB backend is implemented in storage_lmdb.cpp, the in-memory backend in storage_memory.cpp.
+ * Errors are reported to the passed error handler, or to the default error handler if none is passed.
+ */
+
+class CursorBackend
+{
+public:
+    virtual ~CursorBackend() {}
+
+    virtual bool seek(const QByteArray &key) = 0;
+    virtual bool seekLast() = 0;
+    virtual bool next() = 0;
+    virtual bool prev() = 0;
+    virtual bool isValid() const = 0;
+    virtual Slice key() const = 0;
+    virtual Slice value() const = 0;
+};
+
+class DatabaseBackend
+{
+public:
+    virtual ~DatabaseBackend() {}
+
+    virtual bool write(const QByteArray &key, const QByteArray &value, const std::function<void(const DataStore::Error &error)> &errorHandler) = 0;
+    /*
+     * Removes all values of @param key if @param value is empty.
+     */
+    virtual void remove(const QByteArray &key, const QByteArray &value, const std::function<void(const DataStore::Error &error)> &errorHandler) = 0;
+    virtual int scan(const QByteArray &key, FunctionRef<bool(const Slice &key, const Slice &value)> resultHandler,
+        const std::function<void(const DataStore::Error &error)> &errorHandler, bool findSubstringKeys, bool skipInternalKeys) = 0;
+    virtual void findLatest(const QByteArray &prefix, FunctionRef<void(const Slice &key, const Slice &value)> resultHandler,
+        const std::function<void(const DataStore::Error &error)> &errorHandler) = 0;
+    virtual CursorBackend *createCursor(const QByteArray &upperBound, const std::function<void(const DataStore::Error &error)> &errorHandler) = 0;
+    virtual qint64 getSize() = 0;
+    virtual DataStore::NamedDatabase::Stat stat() = 0;
+    virtual bool allowsDuplicates() const = 0;
+};
+
+class TransactionBackend
+{
+public:
+    virtual ~TransactionBackend() {}
+
+    virtual bool isActive() const = 0;
+    virtual bool commit(const std::function<void(const DataStore::Error &error)> &errorHandler) = 0;
+    virtual void abort() = 0;
+    virtual QList<QByteArray> getDatabaseNames() const = 0;
+    /*
+     * Returns nullptr if the database doesn't exist and can't be created.
+     */
+    virtual DatabaseBackend *openDatabase(const QByteArray &db, const std::function<void(const DataStore::Error &error)> &errorHandler, int flags) = 0;
+    virtual DataStore::Transaction::Stat stat(bool printDetails) = 0;
+
+    //Once a database has been opened we don't know if anything changed, so the transaction is committed when it goes out of scope
+    bool implicitCommit = false;
+    //The transaction has been lost and must not be committed implicitly
+    bool error = false;
+};
+
+class StorageBackend
+{
+public:
+    StorageBackend(const QString &_storageRoot, const QString &_name, DataStore::AccessMode _mode)
+        : storageRoot(_storageRoot), name(_name), mode(_mode)
+    {
+    }
+    virtual ~StorageBackend() {}
+
+    virtual bool exists() const = 0;
+    /*
+     * Creates and starts a transaction, or returns nullptr if the environment has been closed in the meantime.
+     */
+    virtual TransactionBackend *createTransaction(bool requestedRead, const std::function<void(const DataStore::Error &error)> &defaultErrorHandler) = 0;
+    virtual qint64 diskUsage() const = 0;
+    virtual void removeFromDisk(const std::function<void(const DataStore::Error &error)> &errorHandler) = 0;
+    virtual bool compact(const std::function<void(const DataStore::Error &error)> &errorHandler) = 0;
+
+    const QString storageRoot;
+    const QString name;
+    const DataStore::AccessMode mode;
+};
+
+StorageBackend *createLmdbBackend(const QString &storageRoot, const QString &name, DataStore::AccessMode mode, const DbLayout &layout);
+StorageBackend *createMemoryBackend(const QString &storageRoot, const QString &name, DataStore::AccessMode mode, const DbLayout &layout);
+
+/*
+ * Returns the smallest key that is larger than all keys starting with @param prefix,
+ * or an empty QByteArray if no such key exists (the prefix consists only of 0xFF bytes).
+ */
+QByteArray prefixUpperBound(const QByteArray &prefix);
+
+}
+}
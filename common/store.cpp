@@ -346,6 +346,18 @@ static KAsync::Job<Store::UpgradeResult> upgrade(const QByteArray &resource)
         .then(KAsync::value(Store::UpgradeResult{true}));
 }
 
+KAsync::Job<void> Store::compact(const QByteArray &identifier)
+{
+    SinkTrace() << "Compact " << identifier;
+    auto resourceAccess = ResourceAccessFactory::instance().getAccess(identifier, ResourceConfig::getResourceType(identifier));
+    resourceAccess->open();
+    return resourceAccess->sendCommand(Sink::Commands::CompactCommand)
+        .addToContext(resourceAccess)
+        .then([identifier]() {
+            SinkTrace() << "Compaction complete " << identifier;
+        });
+}
+
 KAsync::Job<Store::UpgradeResult> Store::upgrade()
 {
     SinkLog() << "Upgrading...";
@@ -120,6 +120,14 @@ KAsync::Job<void> SINK_EXPORT synchronize(const Sink::SyncScope &query);
  */
 KAsync::Job<void> SINK_EXPORT removeDataFromDisk(const QByteArray &resourceIdentifier);
 
+/**
+ * Compacts the local databases of the resource.
+ *
+ * This rewrites the databases without their unused pages, so the disk space is returned to the filesystem.
+ * Databases that are in use by other processes are not compacted, because they would continue to use the old files.
+ */
+KAsync::Job<void> SINK_EXPORT compact(const QByteArray &resourceIdentifier);
+
 struct UpgradeResult {
     bool upgradeExecuted;
 };
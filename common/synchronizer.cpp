@@ -38,6 +38,7 @@ Synchronizer::Synchronizer(const Sink::ResourceContext &context)
     mLogCtx{"synchronizer"},
     mResourceContext(context),
     mEntityStore(Storage::EntityStore::Ptr::create(mResourceContext, mLogCtx)),
+    mRemoteIdFilters(QSharedPointer<SynchronizerStore::RemoteIdFilters>::create()),
     mSyncStorage(Sink::storageLocation(), mResourceContext.instanceId() + ".synchronization", Sink::Storage::DataStore::DataStore::ReadWrite),
     mSyncInProgress(false)
 {
@@ -85,7 +86,7 @@ Storage::EntityStore &Synchronizer::store()
 SynchronizerStore &Synchronizer::syncStore()
 {
     if (!mSyncStore) {
-        mSyncStore = QSharedPointer<SynchronizerStore>::create(syncTransaction());
+        mSyncStore = QSharedPointer<SynchronizerStore>::create(syncTransaction(), mRemoteIdFilters);
     }
     return *mSyncStore;
 }
@@ -193,8 +194,10 @@ void Synchronizer::createOrModify(const QByteArray &bufferType, const QByteArray
 {
     SinkTraceCtx(mLogCtx) << "Create or modify" << bufferType << remoteId;
     Storage::EntityStore store(mResourceContext, mLogCtx);
-    const auto sinkId = syncStore().resolveRemoteId(bufferType, remoteId);
-    const auto found = store.contains(bufferType, sinkId);
+    bool created = false;
+    const auto sinkId = syncStore().resolveRemoteId(bufferType, remoteId, &created);
+    //A newly created id can't be in the store yet
+    const auto found = !created && store.contains(bufferType, sinkId);
     if (!found) {
         SinkTraceCtx(mLogCtx) << "Found a new entity: " << remoteId;
         createEntity(sinkId, bufferType, entity);
@@ -208,9 +211,10 @@ void Synchronizer::createOrModify(const QByteArray &bufferType, const QByteArray
 {
 
     SinkTraceCtx(mLogCtx) << "Create or modify" << bufferType << remoteId;
-    const auto sinkId = syncStore().resolveRemoteId(bufferType, remoteId);
+    bool created = false;
+    const auto sinkId = syncStore().resolveRemoteId(bufferType, remoteId, &created);
     Storage::EntityStore store(mResourceContext, mLogCtx);
-    const auto found = store.contains(bufferType, sinkId);
+    const auto found = !created && store.contains(bufferType, sinkId);
     if (!found) {
         if (!mergeCriteria.isEmpty()) {
             Sink::Query query;
@@ -546,6 +550,9 @@ KAsync::Job<void> Synchronizer::processSyncQueue()
 void Synchronizer::commit()
 {
     mMessageQueue->commit();
+    if (mSyncStore) {
+        mSyncStore->flush();
+    }
     mSyncTransaction.commit();
     mSyncStore.clear();
     if (mSyncInProgress) {
@@ -658,6 +665,9 @@ KAsync::Job<void> Synchronizer::replay(const QByteArray &type, const QByteArray
     })
     .then([this](const KAsync::Error &error) {
         //We need to commit here otherwise the next change-replay step will abort the transaction
+        if (mSyncStore) {
+            mSyncStore->flush();
+        }
         mSyncStore.clear();
         mSyncTransaction.commit();
         if (error) {
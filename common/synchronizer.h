@@ -221,6 +221,8 @@ private:
     Sink::ResourceContext mResourceContext;
     Sink::Storage::EntityStore::Ptr mEntityStore;
     QSharedPointer<SynchronizerStore> mSyncStore;
+    //Kept across transactions, so the sync store doesn't read the filters again in every transaction
+    QSharedPointer<SynchronizerStore::RemoteIdFilters> mRemoteIdFilters;
     Sink::Storage::DataStore mSyncStorage;
     Sink::Storage::DataStore::Transaction mSyncTransaction;
     std::function<void(int commandId, const QByteArray &data)> mEnqueue;
@@ -24,16 +24,302 @@
 
 using namespace Sink;
 
-SynchronizerStore::SynchronizerStore(Sink::Storage::DataStore::Transaction &transaction)
-    : mTransaction(transaction)
+static const int sBlockSize = 512;
+static const int sBitsPerBlock = sBlockSize * 8;
+static const int sBitsPerRemoteId = 10;
+static const int sNumberOfHashes = 7;
+static const int sMinimumNumberOfBlocks = 16;
+
+static quint64 mix(quint64 hash)
+{
+    //The finalizer of MurmurHash3
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static quint64 hashRemoteId(const QByteArray &remoteId)
+{
+    //FNV-1a, because the filter is persisted and qHash is neither stable across Qt versions nor across platforms
+    quint64 hash = 14695981039346656037ULL;
+    for (const char c : remoteId) {
+        hash ^= static_cast<quint8>(c);
+        hash *= 1099511628211ULL;
+    }
+    return mix(hash);
+}
+
+/*
+ * A blocked bloom filter over the remote ids of a type.
+ *
+ * Most remote ids of an initial sync are not in the rid.mapping index yet, and the filter allows to skip the lookup for those.
+ * Every remote id maps to a single block of the filter, in which it sets sNumberOfHashes bits.
+ * The filter is stored in the "rid.filter.$TYPE" database with an entry per block. It is only changed in memory, and flush writes the blocks
+ * that have changed once per transaction. A stamp that changes with every flush tells whether the stored filter is still the one in memory,
+ * so the filter can be kept for the next transaction. The stamp is removed as soon as the filter changes, so a transaction that is committed
+ * without flushing can't leave an outdated filter behind.
+ * Removed remote ids remain in the filter, which only results in false positives, until the filter is rebuilt from the index
+ * with twice the capacity once it is full.
+ */
+class SynchronizerStore::RemoteIdFilter
+{
+public:
+    RemoteIdFilter(const QByteArray &bufferType)
+        : mBufferType(bufferType)
+    {
+    }
+
+    /*
+     * Prepares the filter for use in @param transaction, which only reads the stored filter if it has changed meanwhile.
+     */
+    void open(Sink::Storage::DataStore::Transaction &transaction)
+    {
+        mTransaction = &transaction;
+        mDb = transaction.openDatabase("rid.filter." + mBufferType);
+        mStampRemoved = false;
+        if (!mDb) {
+            SinkWarning() << "Failed to open the remote id filter: " << mBufferType;
+            mBlocks.clear();
+            mDirtyBlocks.clear();
+            return;
+        }
+        if (mBlocks.isEmpty() || mStamp.isEmpty() || read("stamp") != mStamp) {
+            if (!load()) {
+                rebuild();
+            }
+        } else if (!mDirtyBlocks.isEmpty()) {
+            //Left over from a transaction that has been aborted
+            removeStamp();
+        }
+    }
+
+    bool mightContain(const QByteArray &remoteId) const
+    {
+        if (mBlocks.isEmpty()) {
+            return true;
+        }
+        const auto hash = hashRemoteId(remoteId);
+        const auto &block = mBlocks.at(hash % mBlocks.size());
+        return forEachBit(hash, [&](int bit) {
+            return block.at(bit / 8) & (1 << (bit % 8));
+        });
+    }
+
+    void add(const QByteArray &remoteId)
+    {
+        if (mBlocks.isEmpty()) {
+            return;
+        }
+        const auto hash = hashRemoteId(remoteId);
+        const int blockIndex = hash % mBlocks.size();
+        //A remote id that is already in the filter doesn't fill it up any further
+        if (!setBits(mBlocks[blockIndex], hash)) {
+            return;
+        }
+        markDirty(blockIndex);
+        mCount++;
+        if (mCount > capacity()) {
+            SinkTrace() << "The remote id filter is full, rebuilding: " << mBufferType << mCount;
+            rebuild();
+        }
+    }
+
+    void flush()
+    {
+        if (mDirtyBlocks.isEmpty() || !mDb) {
+            return;
+        }
+        for (const auto blockIndex : mDirtyBlocks) {
+            writeBlock(blockIndex);
+        }
+        for (auto i = static_cast<size_t>(mBlocks.size()); i < mStoredNumberOfBlocks; i++) {
+            mDb.remove(blockKey(i));
+        }
+        mStoredNumberOfBlocks = mBlocks.size();
+        mDb.write("blocks", Sink::Storage::DataStore::sizeTToByteArray(mStoredNumberOfBlocks));
+        mDb.write("count", Sink::Storage::DataStore::sizeTToByteArray(mCount));
+        mStamp = Sink::Storage::DataStore::generateUid();
+        mDb.write("stamp", mStamp);
+        mDirtyBlocks.clear();
+        mStampRemoved = false;
+    }
+
+private:
+    size_t capacity() const
+    {
+        return static_cast<size_t>(mBlocks.size()) * sBitsPerBlock / sBitsPerRemoteId;
+    }
+
+    //Calls @param check for all bits of @param hash until it returns false
+    template <typename F>
+    static bool forEachBit(quint64 hash, F check)
+    {
+        const auto second = mix(hash);
+        const quint32 h1 = static_cast<quint32>(second);
+        const quint32 h2 = static_cast<quint32>(second >> 32);
+        for (quint32 i = 0; i < sNumberOfHashes; i++) {
+            if (!check((h1 + i * h2) % sBitsPerBlock)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool setBits(QByteArray &block, quint64 hash)
+    {
+        bool changed = false;
+        forEachBit(hash, [&](int bit) {
+            const char mask = static_cast<char>(1 << (bit % 8));
+            if (!(block.at(bit / 8) & mask)) {
+                block[bit / 8] = block.at(bit / 8) | mask;
+                changed = true;
+            }
+            return true;
+        });
+        return changed;
+    }
+
+    static QByteArray blockKey(int blockIndex)
+    {
+        return "block" + QByteArray::number(blockIndex);
+    }
+
+    void markDirty(int blockIndex)
+    {
+        removeStamp();
+        mDirtyBlocks.insert(blockIndex);
+    }
+
+    void removeStamp()
+    {
+        if (mStampRemoved) {
+            return;
+        }
+        mStampRemoved = true;
+        mDb.remove("stamp", [](const Sink::Storage::DataStore::Error &) {
+            //Ignore errors because there may be no stamp
+        });
+    }
+
+    void writeBlock(int blockIndex)
+    {
+        mDb.write(blockKey(blockIndex), mBlocks.at(blockIndex), [&](const Sink::Storage::DataStore::Error &error) {
+            SinkWarning() << "Failed to write the remote id filter: " << mBufferType << error;
+        });
+    }
+
+    QByteArray read(const QByteArray &key) const
+    {
+        QByteArray value;
+        mDb.scan(key, [&value](const QByteArray &, const QByteArray &v) {
+            value = QByteArray(v.constData(), v.size());
+            return false;
+        }, [](const Sink::Storage::DataStore::Error &) {
+            //Ignore errors because we may not find the value
+        });
+        return value;
+    }
+
+    size_t readSize(const QByteArray &key) const
+    {
+        const auto value = read(key);
+        return value.isEmpty() ? 0 : Sink::Storage::DataStore::byteArrayToSizeT(value);
+    }
+
+    bool load()
+    {
+        mBlocks.clear();
+        mDirtyBlocks.clear();
+        mStamp.clear();
+        mStoredNumberOfBlocks = readSize("blocks");
+        if (!mStoredNumberOfBlocks) {
+            return false;
+        }
+        const auto stamp = read("stamp");
+        if (stamp.isEmpty()) {
+            SinkTrace() << "The remote id filter hasn't been flushed: " << mBufferType;
+            return false;
+        }
+        mCount = readSize("count");
+        mBlocks.reserve(mStoredNumberOfBlocks);
+        for (size_t i = 0; i < mStoredNumberOfBlocks; i++) {
+            const auto block = read(blockKey(i));
+            if (block.size() != sBlockSize) {
+                SinkWarning() << "The remote id filter is corrupt: " << mBufferType;
+                mBlocks.clear();
+                return false;
+            }
+            mBlocks << block;
+        }
+        if (mCount > capacity()) {
+            mBlocks.clear();
+            return false;
+        }
+        mStamp = stamp;
+        return true;
+    }
+
+    void rebuild()
+    {
+        auto mapping = mTransaction->openDatabase("rid.mapping." + mBufferType, {}, Sink::Storage::DataStore::AllowDuplicates);
+        const auto numberOfRemoteIds = mapping ? mapping.stat().numEntries : 0;
+
+        //Leave room for as many remote ids as there already are
+        int numberOfBlocks = sMinimumNumberOfBlocks;
+        while (static_cast<size_t>(numberOfBlocks) * sBitsPerBlock / sBitsPerRemoteId < 2 * numberOfRemoteIds) {
+            numberOfBlocks *= 2;
+        }
+
+        mBlocks = QVector<QByteArray>(numberOfBlocks, QByteArray(sBlockSize, '\0'));
+        mCount = 0;
+        if (mapping) {
+            mapping.scan("", [&](const Sink::Storage::Slice &key, const Sink::Storage::Slice &) {
+                const auto hash = hashRemoteId(key.toRawByteArray());
+                if (setBits(mBlocks[hash % mBlocks.size()], hash)) {
+                    mCount++;
+                }
+                return true;
+            });
+        }
+        for (int i = 0; i < mBlocks.size(); i++) {
+            markDirty(i);
+        }
+        SinkTrace() << "Rebuilt the remote id filter: " << mBufferType << mCount << numberOfBlocks;
+    }
+
+    QByteArray mBufferType;
+    Sink::Storage::DataStore::Transaction *mTransaction = nullptr;
+    Sink::Storage::DataStore::NamedDatabase mDb;
+    QVector<QByteArray> mBlocks;
+    QSet<int> mDirtyBlocks;
+    size_t mStoredNumberOfBlocks = 0;
+    size_t mCount = 0;
+    QByteArray mStamp;
+    bool mStampRemoved = false;
+};
+
+SynchronizerStore::SynchronizerStore(Sink::Storage::DataStore::Transaction &transaction, const QSharedPointer<RemoteIdFilters> &remoteIdFilters)
+    : mTransaction(transaction),
+    mRemoteIdFilters(remoteIdFilters ? remoteIdFilters : QSharedPointer<RemoteIdFilters>::create())
 {
 
 }
 
+void SynchronizerStore::flush()
+{
+    for (const auto &bufferType : mOpenedRemoteIdFilters) {
+        mRemoteIdFilters->value(bufferType)->flush();
+    }
+}
+
 void SynchronizerStore::recordRemoteId(const QByteArray &bufferType, const QByteArray &localId, const QByteArray &remoteId)
 {
     Index("rid.mapping." + bufferType, mTransaction).add(remoteId, localId);
     Index("localid.mapping." + bufferType, mTransaction).add(localId, remoteId);
+    remoteIdFilter(bufferType).add(remoteId);
 }
 
 void SynchronizerStore::removeRemoteId(const QByteArray &bufferType, const QByteArray &localId, const QByteArray &remoteId)
@@ -49,7 +335,21 @@ void SynchronizerStore::updateRemoteId(const QByteArray &bufferType, const QByte
     recordRemoteId(bufferType, localId, remoteId);
 }
 
-QByteArray SynchronizerStore::resolveRemoteId(const QByteArray &bufferType, const QByteArray &remoteId)
+SynchronizerStore::RemoteIdFilter &SynchronizerStore::remoteIdFilter(const QByteArray &bufferType)
+{
+    auto filter = mRemoteIdFilters->value(bufferType);
+    if (!filter) {
+        filter = QSharedPointer<RemoteIdFilter>::create(bufferType);
+        mRemoteIdFilters->insert(bufferType, filter);
+    }
+    if (!mOpenedRemoteIdFilters.contains(bufferType)) {
+        filter->open(mTransaction);
+        mOpenedRemoteIdFilters.insert(bufferType);
+    }
+    return *filter;
+}
+
+QByteArray SynchronizerStore::resolveRemoteId(const QByteArray &bufferType, const QByteArray &remoteId, bool *created)
 {
     if (remoteId.isEmpty()) {
         SinkWarning() << "Cannot resolve empty remote id for type: " << bufferType;
@@ -57,11 +357,20 @@ QByteArray SynchronizerStore::resolveRemoteId(const QByteArray &bufferType, cons
     }
     // Lookup local id for remote id, or insert a new pair otherwise
     Index index("rid.mapping." + bufferType, mTransaction);
-    QByteArray sinkId = index.lookup(remoteId);
+    auto &filter = remoteIdFilter(bufferType);
+    QByteArray sinkId;
+    //The filter has no false negatives, so we only have to look up the remote ids it might contain
+    if (filter.mightContain(remoteId)) {
+        sinkId = index.lookup(remoteId);
+    }
     if (sinkId.isEmpty()) {
         sinkId = Sink::Storage::DataStore::generateUid();
         index.add(remoteId, sinkId);
         Index("localid.mapping." + bufferType, mTransaction).add(sinkId, remoteId);
+        filter.add(remoteId);
+        if (created) {
+            *created = true;
+        }
     }
     return sinkId;
 }
@@ -23,6 +23,9 @@
 
 #include "storage.h"
 #include <QByteArrayList>
+#include <QHash>
+#include <QSet>
+#include <QSharedPointer>
 
 namespace Sink {
 
@@ -32,7 +35,23 @@ namespace Sink {
 class SINK_EXPORT SynchronizerStore
 {
 public:
-    SynchronizerStore(Sink::Storage::DataStore::Transaction &);
+    class RemoteIdFilter;
+
+    /**
+     * The remote id filters of a store by type.
+     *
+     * Passing them on to the SynchronizerStore of the next transaction on the same store avoids reading them again.
+     */
+    typedef QHash<QByteArray, QSharedPointer<RemoteIdFilter>> RemoteIdFilters;
+
+    SynchronizerStore(Sink::Storage::DataStore::Transaction &, const QSharedPointer<RemoteIdFilters> &remoteIdFilters = {});
+
+    /**
+     * Writes what has only been changed in memory, which currently are the remote id filters.
+     *
+     * This has to be called before the transaction is committed.
+     */
+    void flush();
 
     /**
      * Records a localId to remoteId mapping
@@ -45,8 +64,9 @@ public:
      * Tries to find a local id for the remote id, and creates a new local id otherwise.
      *
      * The new local id is recorded in the local to remote id mapping.
+     * If @param created is set, it is set to true if a new local id has been created, so the entity can't exist yet.
      */
-    QByteArray resolveRemoteId(const QByteArray &type, const QByteArray &remoteId);
+    QByteArray resolveRemoteId(const QByteArray &type, const QByteArray &remoteId, bool *created = nullptr);
 
     /**
      * Tries to find a remote id for a local id.
@@ -64,7 +84,11 @@ public:
     void writeValue(const QByteArray &prefix, const QByteArray &key, const QByteArray &value);
 
 private:
+    RemoteIdFilter &remoteIdFilter(const QByteArray &bufferType);
+
     Sink::Storage::DataStore::Transaction &mTransaction;
+    QSharedPointer<RemoteIdFilters> mRemoteIdFilters;
+    QSet<QByteArray> mOpenedRemoteIdFilters;
 };
 
 }
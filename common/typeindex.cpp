@@ -23,16 +23,27 @@
 #include "fulltextindex.h"
 #include <QDateTime>
 #include <QDataStream>
+#include <QtEndian>
+#include <algorithm>
+#include <limits>
 
 using namespace Sink;
 
+static QByteArray toSortableKey(const QDateTime &date)
+{
+    //Big endian with the sign bit flipped, so the keys sort like the dates
+    const auto msecs = qToBigEndian(static_cast<quint64>(date.toMSecsSinceEpoch()) ^ (quint64{1} << 63));
+    return QByteArray{reinterpret_cast<const char *>(&msecs), sizeof(msecs)};
+}
+
 static QByteArray getByteArray(const QVariant &value)
 {
     if (value.type() == QVariant::DateTime) {
-        QByteArray result;
-        QDataStream ds(&result, QIODevice::WriteOnly);
-        ds << value.toDateTime();
-        return result;
+        const auto date = value.toDateTime();
+        if (date.isValid()) {
+            return toSortableKey(date);
+        }
+        return "toplevel";
     }
     if (value.type() == QVariant::Bool) {
         return value.toBool() ? "t" : "f";
@@ -60,6 +71,89 @@ static QByteArray toSortableByteArray(const QDateTime &date)
 }
 
 
+//Marks a complete set of index statistics
+static const QByteArray sStatisticsVersionKey{"\x02version"};
+
+//An index that doesn't provide the requested sorting requires the results to be sorted in memory, which we count as twice the cost
+static const qint64 sUnsortedCostFactor = 2;
+
+//Reading an index entry is much cheaper than reading and filtering an entity,
+//so we intersect with another index as long as it doesn't have more than this many entries per candidate
+static const qint64 sIntersectionCostFactor = 10;
+
+static QByteArray statisticsKey(const QByteArray &property, const QByteArray &key)
+{
+    return property + '\0' + key;
+}
+
+static qint64 readCount(const Sink::Storage::DataStore::NamedDatabase &db, const QByteArray &key)
+{
+    qint64 count = 0;
+    db.scan(key,
+        [&](const QByteArray &, const QByteArray &value) -> bool {
+            count = value.toLongLong();
+            return false;
+        },
+        [](const Sink::Storage::DataStore::Error &error) {
+            if (error.code != Sink::Storage::DataStore::NotFound) {
+                SinkWarning() << "Failed to read index statistics: " << error.message;
+            }
+        });
+    return count;
+}
+
+static QByteArrayList lookupKeys(const QueryBase::Comparator &filter)
+{
+    if (filter.comparator == Query::Comparator::Equals) {
+        return {getByteArray(filter.value)};
+    }
+    Q_ASSERT(filter.comparator == Query::Comparator::In);
+    return filter.value.value<QByteArrayList>();
+}
+
+static bool isRange(const QueryBase::Comparator &filter)
+{
+    return filter.comparator == Query::Comparator::LessThan || filter.comparator == Query::Comparator::GreaterThan || filter.comparator == Query::Comparator::Within;
+}
+
+//Returns the lower and upper bound of a range filter, an invalid bound leaves that side of the range open
+static QPair<QVariant, QVariant> rangeBounds(const QueryBase::Comparator &filter)
+{
+    switch (filter.comparator) {
+        case Query::Comparator::LessThan:
+            return qMakePair(QVariant{}, filter.value);
+        case Query::Comparator::GreaterThan:
+            return qMakePair(filter.value, QVariant{});
+        case Query::Comparator::Within: {
+            const auto range = filter.value.toList();
+            if (range.size() == 2) {
+                return qMakePair(range.at(0), range.at(1));
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    return {};
+}
+
+/*
+ * Returns the range of value index keys that covers a range filter, with an exclusive upper bound.
+ *
+ * The range may include keys that don't match (such as the lower bound of GreaterThan), the filter is applied on the entities anyways.
+ */
+static QPair<QByteArray, QByteArray> keyRange(const QueryBase::Comparator &filter)
+{
+    const auto bounds = rangeBounds(filter);
+    const auto lower = bounds.first.isValid() ? getByteArray(bounds.first) : QByteArray{};
+    auto upper = bounds.second.isValid() ? getByteArray(bounds.second) : QByteArray{};
+    if (!upper.isEmpty() && filter.comparator != Query::Comparator::LessThan) {
+        //Include the upper bound itself
+        upper += '\0';
+    }
+    return qMakePair(lower, upper);
+}
+
 TypeIndex::TypeIndex(const QByteArray &type, const Sink::Log::Context &ctx) : mLogCtx(ctx), mType(type)
 {
 }
@@ -85,6 +179,7 @@ void TypeIndex::addProperty<QByteArray>(const QByteArray &property)
     };
     mIndexer.insert(property, indexer);
     mProperties << property;
+    mRangeProperties << property;
 }
 
 template <>
@@ -114,6 +209,7 @@ void TypeIndex::addProperty<QString>(const QByteArray &property)
     };
     mIndexer.insert(property, indexer);
     mProperties << property;
+    mRangeProperties << property;
 }
 
 template <>
@@ -129,6 +225,7 @@ void TypeIndex::addProperty<QDateTime>(const QByteArray &property)
     };
     mIndexer.insert(property, indexer);
     mProperties << property;
+    mRangeProperties << property;
 }
 
 template <>
@@ -159,12 +256,149 @@ void TypeIndex::addPropertyWithSorting<ApplicationDomain::Reference, QDateTime>(
     addPropertyWithSorting<QByteArray, QDateTime>(property, sortProperty);
 }
 
+void TypeIndex::updateStatistics(bool add, const QByteArray &property, const QByteArray &key, Sink::Storage::DataStore::Transaction &transaction)
+{
+    auto db = transaction.openDatabase(mType + ".index.stats");
+    const auto count = readCount(db, statisticsKey(property, key));
+    //Don't go negative if an entry is removed that hasn't been counted
+    if (!add && !count) {
+        return;
+    }
+    const auto newCount = add ? count + 1 : count - 1;
+    if (newCount) {
+        db.write(statisticsKey(property, key), QByteArray::number(newCount));
+    } else {
+        db.remove(statisticsKey(property, key));
+    }
+}
+
+void TypeIndex::ensureStatistics(Sink::Storage::DataStore::Transaction &transaction)
+{
+    //Checked once per transaction
+    if (mStatisticsChecked) {
+        return;
+    }
+    mStatisticsChecked = true;
+    auto db = transaction.openDatabase(mType + ".index.stats");
+    if (db.contains(sStatisticsVersionKey)) {
+        return;
+    }
+    SinkTraceCtx(mLogCtx) << "Building the index statistics of " << mType;
+    for (const auto &property : mProperties) {
+        QHash<QByteArray, qint64> counts;
+        transaction.openDatabase(indexName(property), {}, Sink::Storage::DataStore::AllowDuplicates)
+            .scan(QByteArray{},
+                [&](const Sink::Storage::Slice &key, const Sink::Storage::Slice &) -> bool {
+                    counts[key.toByteArray()]++;
+                    return true;
+                },
+                [&](const Sink::Storage::DataStore::Error &error) {
+                    if (error.code != Sink::Storage::DataStore::NotFound) {
+                        SinkWarningCtx(mLogCtx) << "Failed to read the index: " << error.message;
+                    }
+                }, true);
+        for (auto it = counts.constBegin(); it != counts.constEnd(); it++) {
+            db.write(statisticsKey(property, it.key()), QByteArray::number(it.value()));
+        }
+    }
+    db.write(sStatisticsVersionKey, "1");
+}
+
+//Decodes the date keys that were used up to database version 4
+static bool fromLegacyDateKey(const QByteArray &key, QDateTime &date)
+{
+    //The serialized julian day starts with zeroes for any realistic date and with 0x80 for an invalid one, which no textual key does
+    static const QByteArray invalidDatePrefix = QByteArray(1, '\x80') + QByteArray(7, '\0');
+    if (key.size() < 13 || !(key.startsWith(QByteArray(4, '\0')) || key.startsWith(invalidDatePrefix))) {
+        return false;
+    }
+    QDataStream ds(key);
+    ds >> date;
+    return ds.status() == QDataStream::Ok && ds.atEnd();
+}
+
+void TypeIndex::upgradeDateKeys(Sink::Storage::DataStore::Transaction &transaction)
+{
+    using Sink::Storage::DataStore;
+    for (const auto &name : transaction.getDatabaseNames()) {
+        if (!name.contains(".index.") || name.contains(".sort.")) {
+            continue;
+        }
+        //Statistics are keyed by the property and the index key
+        const bool isStatistics = name.endsWith(".index.stats");
+        auto db = transaction.openDatabase(name, {}, isStatistics ? 0 : DataStore::AllowDuplicates);
+        QList<QPair<QByteArray, QByteArray>> legacyEntries;
+        db.scan(QByteArray{},
+            [&](const Sink::Storage::Slice &key, const Sink::Storage::Slice &value) -> bool {
+                const auto rawKey = key.toRawByteArray();
+                QDateTime date;
+                if (fromLegacyDateKey(isStatistics ? rawKey.mid(rawKey.indexOf('\0') + 1) : rawKey, date)) {
+                    legacyEntries << qMakePair(key.toByteArray(), value.toByteArray());
+                }
+                return true;
+            },
+            [&](const DataStore::Error &error) {
+                SinkWarning() << "Error while reading legacy date keys: " << error.message;
+            }, true);
+        if (legacyEntries.isEmpty()) {
+            continue;
+        }
+        if (isStatistics) {
+            //Dates in different timezones may now share a key, so it's simpler to start over
+            for (const auto &entry : legacyEntries) {
+                db.remove(entry.first);
+            }
+            db.remove(sStatisticsVersionKey);
+        } else {
+            for (const auto &entry : legacyEntries) {
+                QDateTime date;
+                fromLegacyDateKey(entry.first, date);
+                db.remove(entry.first, entry.second);
+                db.write(getByteArray(date), entry.second);
+            }
+        }
+        SinkLog() << "Converted " << legacyEntries.size() << " date keys in " << name;
+    }
+}
+
+qint64 TypeIndex::estimateLookup(const QByteArray &property, const Sink::QueryBase::Comparator &filter, Sink::Storage::DataStore::Transaction &transaction)
+{
+    if (!mProperties.contains(property)) {
+        return -1;
+    }
+    //Stores that predate the statistics don't have the database until they are written to
+    auto db = transaction.openDatabase(mType + ".index.stats", [](const Sink::Storage::DataStore::Error &) {});
+    if (!db.contains(sStatisticsVersionKey)) {
+        return -1;
+    }
+    qint64 estimate = 0;
+    if (isRange(filter)) {
+        if (!mRangeProperties.contains(property)) {
+            return -1;
+        }
+        //The statistics are sorted by key as well, so we can sum up the same range
+        const auto range = keyRange(filter);
+        const auto upperBound = range.second.isEmpty() ? property + '\x01' : statisticsKey(property, range.second);
+        auto cursor = db.createCursor(upperBound);
+        for (auto valid = cursor.seek(statisticsKey(property, range.first)); valid; valid = cursor.next()) {
+            estimate += cursor.value().toByteArray().toLongLong();
+        }
+        return estimate;
+    }
+    for (const auto &key : lookupKeys(filter)) {
+        estimate += readCount(db, statisticsKey(property, key));
+    }
+    return estimate;
+}
+
 void TypeIndex::updateIndex(bool add, const QByteArray &identifier, const Sink::ApplicationDomain::ApplicationDomainType &entity, Sink::Storage::DataStore::Transaction &transaction, const QByteArray &resourceInstanceId)
 {
+    ensureStatistics(transaction);
     for (const auto &property : mProperties) {
         const auto value = entity.getProperty(property);
         auto indexer = mIndexer.value(property);
         indexer(add, identifier, value, transaction);
+        updateStatistics(add, property, getByteArray(value), transaction);
     }
     for (auto it = mSortedProperties.constBegin(); it != mSortedProperties.constEnd(); it++) {
         const auto value = entity.getProperty(it.key());
@@ -185,6 +419,7 @@ void TypeIndex::updateIndex(bool add, const QByteArray &identifier, const Sink::
 
 void TypeIndex::commitTransaction()
 {
+    mStatisticsChecked = false;
     for (const auto &indexer : mCustomIndexer) {
         indexer->commitTransaction();
     }
@@ -192,6 +427,7 @@ void TypeIndex::commitTransaction()
 
 void TypeIndex::abortTransaction()
 {
+    mStatisticsChecked = false;
     for (const auto &indexer : mCustomIndexer) {
         indexer->abortTransaction();
     }
@@ -210,22 +446,46 @@ void TypeIndex::remove(const QByteArray &identifier, const Sink::ApplicationDoma
 static QVector<QByteArray> indexLookup(Index &index, QueryBase::Comparator filter)
 {
     QVector<QByteArray> keys;
-    QByteArrayList lookupKeys;
-    if (filter.comparator == Query::Comparator::Equals) {
-        lookupKeys << getByteArray(filter.value);
-    } else if (filter.comparator == Query::Comparator::In) {
-        lookupKeys = filter.value.value<QByteArrayList>();
-    } else {
-        Q_ASSERT(false);
-    }
-
-    for (const auto &lookupKey : lookupKeys) {
+    for (const auto &lookupKey : lookupKeys(filter)) {
         index.lookup(lookupKey, [&](const QByteArray &value) { keys << value; },
             [lookupKey](const Index::Error &error) { SinkWarning() << "Lookup error in index: " << error.message << lookupKey; }, true);
     }
     return keys;
 }
 
+static QVector<QByteArray> rangeLookup(Index &index, const QueryBase::Comparator &filter)
+{
+    QVector<QByteArray> keys;
+    const auto range = keyRange(filter);
+    index.rangeLookup(range.first, range.second, [&](const QByteArray &value) { keys << value; },
+        [](const Index::Error &error) { SinkWarning() << "Range lookup error in index: " << error.message; });
+    return keys;
+}
+
+/*
+ * Looks up a date range per value in a sorted index.
+ *
+ * The sorted index stores the newest dates first, so the upper bound of the date range is the start of the key range.
+ */
+static QVector<QByteArray> sortedRangeLookup(Index &index, const QueryBase::Comparator &filter, const QueryBase::Comparator &sortFilter)
+{
+    QVector<QByteArray> keys;
+    const auto bounds = rangeBounds(sortFilter);
+    const auto errorHandler = [](const Index::Error &error) { SinkWarning() << "Range lookup error in index: " << error.message; };
+    for (const auto &lookupKey : lookupKeys(filter)) {
+        const auto lower = bounds.second.isValid() ? lookupKey + toSortableByteArray(bounds.second.toDateTime()) : lookupKey;
+        //The sortable dates are decimal numbers, and ':' sorts after all digits
+        const auto upper = bounds.first.isValid() ? lookupKey + toSortableByteArray(bounds.first.toDateTime()) + '\0' : lookupKey + ':';
+        index.rangeLookup(lower, upper, [&](const QByteArray &value) { keys << value; }, errorHandler);
+        //Dates before the epoch all end up in the first key, so we have to look them up separately
+        const auto beforeEpoch = lookupKey + '0';
+        if (lower > beforeEpoch && (!bounds.first.isValid() || bounds.first.toDateTime().toMSecsSinceEpoch() < 0)) {
+            index.lookup(beforeEpoch, [&](const QByteArray &value) { keys << value; }, errorHandler);
+        }
+    }
+    return keys;
+}
+
 QVector<QByteArray> TypeIndex::query(const Sink::QueryBase &query, QSet<QByteArray> &appliedFilters, QByteArray &appliedSorting, Sink::Storage::DataStore::Transaction &transaction, const QByteArray &resourceInstanceId)
 {
     const auto baseFilters = query.getBaseFilters();
@@ -239,27 +499,121 @@ QVector<QByteArray> TypeIndex::query(const Sink::QueryBase &query, QSet<QByteArr
         }
     }
 
+    struct Plan {
+        QByteArray property;
+        QByteArray sortProperty;
+        //The property of a range filter that is applied by the lookup, either the property itself or the sort property of a sorted index
+        QByteArray rangeProperty;
+        qint64 estimate;
+        qint64 cost;
+    };
+    const auto isLookup = [](const QueryBase::Comparator &filter) {
+        return filter.comparator == Query::Comparator::Equals || filter.comparator == Query::Comparator::In;
+    };
+    const auto plan = [&](const QByteArray &property, const QByteArray &sortProperty, const QByteArray &rangeProperty) {
+        //For a range in a sorted index the estimate of the property is an upper bound
+        const auto estimate = estimateLookup(property, query.getFilter(property), transaction);
+        //Without statistics we can't tell, so we keep the order in which the candidates are considered
+        auto cost = estimate < 0 ? std::numeric_limits<qint64>::max() : estimate;
+        if (sortProperty != query.sortProperty() && !query.sortProperty().isEmpty() && estimate >= 0) {
+            cost *= sUnsortedCostFactor;
+        }
+        return Plan{property, sortProperty, rangeProperty, estimate, cost};
+    };
+    const auto hasRange = [&](const QByteArray &property) {
+        return query.hasFilter(property) && isRange(query.getFilter(property));
+    };
+
+    QVector<Plan> candidates;
     for (auto it = mSortedProperties.constBegin(); it != mSortedProperties.constEnd(); it++) {
-        if (query.hasFilter(it.key()) && query.sortProperty() == it.value()) {
-            Index index(indexName(it.key(), it.value()), transaction);
-            const auto keys = indexLookup(index, query.getFilter(it.key()));
-            appliedFilters << it.key();
-            appliedSorting = it.value();
-            SinkTraceCtx(mLogCtx) << "Sorted index lookup on " << it.key() << it.value() << " found " << keys.size() << " keys.";
-            return keys;
+        if (query.hasFilter(it.key()) && isLookup(query.getFilter(it.key()))) {
+            if (hasRange(it.value())) {
+                candidates << plan(it.key(), it.value(), it.value());
+            } else if (query.sortProperty() == it.value()) {
+                candidates << plan(it.key(), it.value(), {});
+            }
         }
     }
     for (const auto &property : mProperties) {
-        if (query.hasFilter(property)) {
-            Index index(indexName(property), transaction);
-            const auto keys = indexLookup(index, query.getFilter(property));
-            appliedFilters << property;
-            SinkTraceCtx(mLogCtx) << "Index lookup on " << property << " found " << keys.size() << " keys.";
-            return keys;
+        if (query.hasFilter(property) && isLookup(query.getFilter(property))) {
+            candidates << plan(property, {}, {});
+        } else if (mRangeProperties.contains(property) && hasRange(property)) {
+            candidates << plan(property, {}, property);
         }
     }
-    SinkTraceCtx(mLogCtx) << "No matching index";
-    return {};
+    const auto lookup = [&](const Plan &candidate) {
+        Index index(indexName(candidate.property, candidate.sortProperty), transaction);
+        if (candidate.rangeProperty.isEmpty()) {
+            return indexLookup(index, query.getFilter(candidate.property));
+        }
+        if (candidate.sortProperty.isEmpty()) {
+            return rangeLookup(index, query.getFilter(candidate.property));
+        }
+        return sortedRangeLookup(index, query.getFilter(candidate.property), query.getFilter(candidate.sortProperty));
+    };
+    if (candidates.isEmpty()) {
+        SinkTraceCtx(mLogCtx) << "No matching index";
+        return {};
+    }
+
+    //Use the most selective index
+    auto best = candidates.constBegin();
+    for (auto it = candidates.constBegin(); it != candidates.constEnd(); it++) {
+        if (it->cost < best->cost) {
+            best = it;
+        }
+    }
+    for (const auto &candidate : candidates) {
+        SinkTraceCtx(mLogCtx) << "Query plan: " << (&candidate == &*best ? "using" : "rejected") << " index on " << candidate.property
+            << (candidate.sortProperty.isEmpty() ? QByteArray{} : " sorted by " + candidate.sortProperty)
+            << (candidate.rangeProperty.isEmpty() ? QByteArray{} : " in a range of " + candidate.rangeProperty)
+            << " with an estimate of " << (candidate.estimate < 0 ? QByteArray{"unknown"} : QByteArray::number(candidate.estimate)) << " keys.";
+    }
+
+    auto keys = lookup(*best);
+    appliedFilters << best->property;
+    if (!best->rangeProperty.isEmpty()) {
+        appliedFilters << best->rangeProperty;
+    }
+    if (!best->sortProperty.isEmpty()) {
+        if (query.sortProperty() == best->sortProperty) {
+            appliedSorting = best->sortProperty;
+        }
+        SinkTraceCtx(mLogCtx) << "Sorted index lookup on " << best->property << best->sortProperty << " found " << keys.size() << " keys.";
+    } else {
+        SinkTraceCtx(mLogCtx) << "Index lookup on " << best->property << " found " << keys.size() << " keys.";
+    }
+
+    //Narrow the candidates down with the remaining value indexes, so we don't have to read entities that are filtered anyways.
+    //The most selective indexes are intersected first.
+    QVector<Plan> intersections;
+    for (const auto &candidate : candidates) {
+        if (candidate.sortProperty.isEmpty() && !appliedFilters.contains(candidate.property) && candidate.estimate >= 0) {
+            intersections << candidate;
+        }
+    }
+    std::sort(intersections.begin(), intersections.end(), [](const Plan &left, const Plan &right) {
+        return left.estimate < right.estimate;
+    });
+    for (const auto &candidate : intersections) {
+        if (keys.size() <= 1 || candidate.estimate > sIntersectionCostFactor * keys.size()) {
+            SinkTraceCtx(mLogCtx) << "Query plan: not intersecting with index on " << candidate.property << " with an estimate of " << candidate.estimate << " keys.";
+            continue;
+        }
+        const auto matches = lookup(candidate);
+        QSet<QByteArray> matchSet;
+        matchSet.reserve(matches.size());
+        for (const auto &match : matches) {
+            matchSet.insert(match);
+        }
+        //Filter in place to retain the order of a sorted lookup
+        keys.erase(std::remove_if(keys.begin(), keys.end(), [&](const QByteArray &key) {
+            return !matchSet.contains(key);
+        }), keys.end());
+        appliedFilters << candidate.property;
+        SinkTraceCtx(mLogCtx) << "Query plan: intersected with index on " << candidate.property << ", " << keys.size() << " keys remaining.";
+    }
+    return keys;
 }
 
 QVector<QByteArray> TypeIndex::lookup(const QByteArray &property, const QVariant &value, Sink::Storage::DataStore::Transaction &transaction)
@@ -107,19 +107,43 @@ public:
     void commitTransaction();
     void abortTransaction();
 
+    /**
+     * Converts the date keys of the value indexes from the serialized dates used up to database version 4 to sortable keys.
+     *
+     * The statistics of the affected types are rebuilt on the next write.
+     */
+    static void upgradeDateKeys(Sink::Storage::DataStore::Transaction &transaction);
+
 
 private:
     friend class Sink::Storage::EntityStore;
     void updateIndex(bool add, const QByteArray &identifier, const Sink::ApplicationDomain::ApplicationDomainType &entity, Sink::Storage::DataStore::Transaction &transaction, const QByteArray &resourceInstanceId);
     QByteArray indexName(const QByteArray &property, const QByteArray &sortProperty = QByteArray()) const;
+    /*
+     * The statistics record the number of index entries per value of every property with a value index,
+     * so the query can estimate the cost of an index lookup.
+     */
+    void updateStatistics(bool add, const QByteArray &property, const QByteArray &key, Sink::Storage::DataStore::Transaction &transaction);
+    /*
+     * Builds the statistics from the value indexes if they don't exist yet, e.g. because the store predates them.
+     */
+    void ensureStatistics(Sink::Storage::DataStore::Transaction &transaction);
+    /*
+     * Returns the estimated number of keys a lookup or range scan of @param filter in the index of @param property returns, or -1 if that is unknown.
+     */
+    qint64 estimateLookup(const QByteArray &property, const Sink::QueryBase::Comparator &filter, Sink::Storage::DataStore::Transaction &transaction);
     Sink::Log::Context mLogCtx;
     QByteArray mType;
     QByteArrayList mProperties;
+    //Properties with value index keys that sort like the values, so ranges can be looked up
+    QByteArrayList mRangeProperties;
     QMap<QByteArray, QByteArray> mSortedProperties;
     //<Property, ResultProperty>
     QMap<QByteArray, QByteArray> mSecondaryProperties;
     QList<Sink::Indexer::Ptr> mCustomIndexer;
     Sink::Storage::DataStore::Transaction *mTransaction;
+    //Whether ensureStatistics already ran in the current transaction
+    bool mStatisticsChecked = false;
     QHash<QByteArray, std::function<void(bool, const QByteArray &identifier, const QVariant &value, Sink::Storage::DataStore::Transaction &transaction)>> mIndexer;
     QHash<QByteArray, std::function<void(bool, const QByteArray &identifier, const QVariant &value, const QVariant &sortValue, Sink::Storage::DataStore::Transaction &transaction)>> mSortIndexer;
 };
@@ -172,7 +172,8 @@ public:
             SinkLog() << "Looking for mails to send.";
             store().readAll<ApplicationDomain::Mail>([&](const ApplicationDomain::Mail &mail) {
                 if (!mail.getSent()) {
-                    toSend << mail;
+                    //The entity is only valid during the callback
+                    toSend << *ApplicationDomain::ApplicationDomainType::getInMemoryRepresentation<ApplicationDomain::Mail>(mail, mail.availableProperties());
                 }
             });
             SinkLog() << "Found " << toSend.size() << " mails to send";
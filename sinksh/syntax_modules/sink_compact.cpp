@@ -0,0 +1,63 @@
+/*
+ *   Copyright (C) 2017 Christian Mollekopf <mollekopf@kolabsys.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#include <QDebug>
+#include <QObject> // tr()
+
+#include "common/store.h"
+
+#include "sinksh_utils.h"
+#include "state.h"
+#include "syntaxtree.h"
+
+namespace SinkCompact
+{
+
+bool compact(const QStringList &args, State &state)
+{
+    if (args.isEmpty()) {
+        state.printError(QObject::tr("Please provide at least one resource to compact."));
+        return false;
+    }
+
+    for (const auto &arg : args) {
+        const auto resource = SinkshUtils::parseUid(arg.toUtf8());
+        state.print(QObject::tr("Compacting %1...").arg(QString::fromUtf8(resource)));
+        auto result = Sink::Store::compact(resource).exec();
+        result.waitForFinished();
+        if (result.errorCode()) {
+            state.printLine(QObject::tr("failed: %1").arg(result.errorMessage()));
+        } else {
+            state.printLine(QObject::tr("done"));
+        }
+    }
+    return false;
+}
+
+Syntax::List syntax()
+{
+    Syntax compact("compact", QObject::tr("Compacts the storage of the resources requested, returning unused space to the filesystem. The resources must not be in use by other clients."), &SinkCompact::compact, Syntax::NotInteractive);
+    compact.completer = &SinkshUtils::resourceCompleter;
+
+    return Syntax::List() << compact;
+}
+
+REGISTER_SYNTAX(SinkCompact)
+
+}
@@ -69,7 +69,7 @@ bool inspect(const QStringList &args, State &state)
                 [&] (const Sink::Storage::DataStore::Error &e) {
                     Q_ASSERT(false);
                     state.printError(e.message);
-                }, false);
+                }, Sink::Storage::DataStore::Compressed);
 
         auto ridMap = syncTransaction.openDatabase("localid.mapping." + type,
                 [&] (const Sink::Storage::DataStore::Error &e) {
@@ -175,7 +175,7 @@ bool inspect(const QStringList &args, State &state)
             [&] (const Sink::Storage::DataStore::Error &e) {
                 Q_ASSERT(false);
                 state.printError(e.message);
-            }, false);
+            }, isMainDb ? Sink::Storage::DataStore::Compressed : 0);
 
     if (showInternal) {
         //Print internal keys
@@ -191,6 +191,13 @@ bool inspect(const QStringList &args, State &state)
         QByteArray filter;
         if (!idFilter.isEmpty()) {
             filter = idFilter.first().toUtf8();
+            if (isMainDb) {
+                filter = Sink::Storage::DataStore::keyPrefix(filter);
+                if (filter.isEmpty()) {
+                    state.printError(QObject::tr("Not a valid id: ") + idFilter.first());
+                    return false;
+                }
+            }
         }
 
         //Print rest of db
@@ -203,10 +210,10 @@ bool inspect(const QStringList &args, State &state)
                     if (isMainDb) {
                         Sink::EntityBuffer buffer(const_cast<const char *>(data.data()), data.size());
                         if (!buffer.isValid()) {
-                            state.printError("Read invalid buffer from disk: " + key);
+                            state.printError("Read invalid buffer from disk: " + Sink::Storage::DataStore::uidFromKey(key));
                         } else {
                             const auto metadata = flatbuffers::GetRoot<Sink::Metadata>(buffer.metadataBuffer());
-                            state.printLine("Key: " + key
+                            state.printLine("Key: " + Sink::Storage::DataStore::uidFromKey(key) + " Revision: " + QString::number(Sink::Storage::DataStore::revisionFromKey(key))
                                           + " Operation: " + QString::number(metadata->operation())
                                           + " Replay: " + (metadata->replayToSource() ? "true" : "false")
                                           + ((metadata->modifiedProperties() && metadata->modifiedProperties()->size() != 0) ? (" [" + Sink::BufferUtils::fromVector(*metadata->modifiedProperties()).join(", ")) + "]": "")
@@ -21,6 +21,10 @@
 #include <QObject> // tr()
 #include <QTimer>
 #include <QDir>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
 
 #include "common/resource.h"
 #include "common/storage.h"
@@ -28,6 +32,7 @@
 #include "common/log.h"
 #include "common/storage.h"
 #include "common/definitions.h"
+#include "common/resourcecontrol.h"
 
 #include "sinksh_utils.h"
 #include "state.h"
@@ -79,19 +84,85 @@ void statResource(const QString &resource, const State &state)
     state.printLine();
 }
 
-bool statAllResources(State &state)
+void statStorage(const QByteArray &resource, const State &state)
+{
+    state.printLine("Storage statistics of resource " + QString::fromUtf8(resource) + ":");
+    auto result = Sink::ResourceControl::dumpStorageStatistics(resource).exec();
+    result.waitForFinished();
+    if (result.errorCode()) {
+        state.printError(QObject::tr("Failed to retrieve the storage statistics: %1").arg(result.errorMessage()));
+        return;
+    }
+    QFile file(Sink::storageStatisticsLocation(resource));
+    if (!file.open(QIODevice::ReadOnly)) {
+        state.printError(QObject::tr("Failed to read the storage statistics from: %1").arg(file.fileName()));
+        return;
+    }
+    auto count = [](const QJsonValue &value) {
+        return qint64(value.toDouble());
+    };
+    const auto statistics = QJsonDocument::fromJson(file.readAll()).object();
+    const auto environments = statistics.value("environments").toObject();
+    for (auto env = environments.constBegin(); env != environments.constEnd(); env++) {
+        const auto environment = env.value().toObject();
+        QStringList histogram;
+        for (const auto &bucket : environment.value("commitLatencyHistogram").toArray()) {
+            histogram << QString::number(count(bucket));
+        }
+        state.printLine(QObject::tr("%1: %2 commits, latencies (< 100us, < 1ms, < 10ms, < 100ms, < 1s, >= 1s): %3")
+                .arg(env.key()).arg(count(environment.value("commits"))).arg(histogram.join(", ")), 1);
+        const auto databases = environment.value("databases").toObject();
+        for (auto db = databases.constBegin(); db != databases.constEnd(); db++) {
+            const auto counters = db.value().toObject();
+            state.printLine(QObject::tr("%1:\twrites: %2, removes: %3, scans: %4, findLatest: %5, rows visited: %6, read: %7 [kb], written: %8 [kb]")
+                    .arg(db.key())
+                    .arg(count(counters.value("writes")))
+                    .arg(count(counters.value("removes")))
+                    .arg(count(counters.value("scans")))
+                    .arg(count(counters.value("findLatest")))
+                    .arg(count(counters.value("rowsVisited")))
+                    .arg(count(counters.value("bytesRead")) / 1024)
+                    .arg(count(counters.value("bytesWritten")) / 1024), 2);
+        }
+    }
+    const auto cache = statistics.value("entityCache").toObject();
+    state.printLine(QObject::tr("Entity cache: %1 hits, %2 misses, %3 of %4 entries")
+            .arg(count(cache.value("hits")))
+            .arg(count(cache.value("misses")))
+            .arg(count(cache.value("size")))
+            .arg(count(cache.value("capacity"))), 1);
+    state.printLine();
+}
+
+bool statAllResources(State &state, bool storage)
 {
     Sink::Query query;
     for (const auto &r : SinkshUtils::getStore("resource").read(query)) {
-        statResource(SinkshUtils::parseUid(r.identifier()), state);
+        if (storage) {
+            statStorage(SinkshUtils::parseUid(r.identifier()), state);
+        } else {
+            statResource(SinkshUtils::parseUid(r.identifier()), state);
+        }
     }
     return false;
 }
 
 bool stat(const QStringList &args, State &state)
 {
+    auto options = SyntaxTree::parseOptions(args);
+    if (options.options.contains("storage")) {
+        const auto resources = options.positionalArguments + options.options.value("storage");
+        if (resources.isEmpty()) {
+            return statAllResources(state, true);
+        }
+        for (const auto &r : resources) {
+            statStorage(SinkshUtils::parseUid(r.toUtf8()), state);
+        }
+        return false;
+    }
+
     if (args.isEmpty()) {
-        return statAllResources(state);
+        return statAllResources(state, false);
     }
 
     for (const auto &r : args) {
@@ -102,7 +173,7 @@ bool stat(const QStringList &args, State &state)
 
 Syntax::List syntax()
 {
-    Syntax state("stat", QObject::tr("Shows database usage for the resources requested"), &SinkStat::stat, Syntax::NotInteractive);
+    Syntax state("stat", QObject::tr("Shows database usage for the resources requested. With --storage the storage statistics of the running resources are shown instead."), &SinkStat::stat, Syntax::NotInteractive);
     state.completer = &SinkshUtils::resourceCompleter;
 
     return Syntax::List() << state;
@@ -2,6 +2,7 @@
 
 #include <QDebug>
 #include <QString>
+#include <QUuid>
 
 #include "common/storage/entitystore.h"
 #include "common/adaptorfactoryregistry.h"
@@ -24,6 +25,7 @@ private slots:
     {
         Sink::Storage::DataStore storage(Sink::storageLocation(), resourceInstanceIdentifier);
         storage.removeFromDisk();
+        QDir{Sink::blobStorageLocation(resourceInstanceIdentifier.toUtf8())}.removeRecursively();
     }
 
     void testCleanup()
@@ -83,6 +85,417 @@ private slots:
         store.abortTransaction();
 
     }
+
+    void readLatestBatch()
+    {
+        using namespace Sink;
+        ResourceContext resourceContext{resourceInstanceIdentifier.toUtf8(), "dummy", AdaptorFactoryRegistry::instance().getFactories("test")};
+        Storage::EntityStore store(resourceContext, {});
+
+        QVector<QByteArray> uids;
+        store.startTransaction(Storage::DataStore::ReadWrite);
+        for (int i = 0; i < 10; i++) {
+            auto mail = ApplicationDomain::ApplicationDomainType::createEntity<ApplicationDomain::Mail>("res1");
+            mail.setExtractedSubject("subject");
+            store.add("mail", mail, false);
+            mail.setExtractedSubject(QString::number(i));
+            store.modify("mail", mail, QByteArrayList{}, false);
+            uids << mail.identifier();
+        }
+        store.commitTransaction();
+
+        //Request in reverse order, with a duplicate and a uid that doesn't exist
+        QVector<QByteArray> requested;
+        for (int i = uids.size() - 1; i >= 0; i--) {
+            requested << uids.at(i);
+        }
+        requested << uids.first();
+        requested << QUuid::createUuid().toByteArray();
+
+        store.startTransaction(Storage::DataStore::ReadOnly);
+        {
+            QVector<QByteArray> result;
+            store.readLatestBatch("mail", requested, [&] (const ApplicationDomain::ApplicationDomainType &entity) {
+                QCOMPARE(entity.getProperty(ApplicationDomain::Mail::Subject::name).toString(), QString::number(uids.indexOf(entity.identifier())));
+                result << entity.identifier();
+            });
+            QCOMPARE(result, requested.mid(0, requested.size() - 1));
+        }
+
+        {
+            QVector<QByteArray> result;
+            store.readLatestBatch("mail", requested, [&] (const ApplicationDomain::ApplicationDomainType &entity) {
+                QCOMPARE(entity.getProperty(ApplicationDomain::Mail::Subject::name).toString(), QString::number(uids.indexOf(entity.identifier())));
+                result << entity.identifier();
+            }, true);
+            //Every entity is delivered once, in the order of the database
+            QCOMPARE(result.size(), uids.size());
+            for (int i = 1; i < result.size(); i++) {
+                QVERIFY(Storage::DataStore::keyPrefix(result.at(i - 1)) < Storage::DataStore::keyPrefix(result.at(i)));
+            }
+        }
+
+        {
+            //Projected reads with the operation, and an invalid uid that is skipped
+            QVector<QByteArray> result;
+            store.readLatestBatch("mail", requested + QVector<QByteArray>{"invalid"}, {ApplicationDomain::Mail::Subject::name}, [&] (const ApplicationDomain::ApplicationDomainType &entity, Operation operation) {
+                QCOMPARE(operation, Operation_Modification);
+                QCOMPARE(entity.getProperty(ApplicationDomain::Mail::Subject::name).toString(), QString::number(uids.indexOf(entity.identifier())));
+                result << entity.identifier();
+            });
+            QCOMPARE(result, requested.mid(0, requested.size() - 1));
+        }
+        store.abortTransaction();
+    }
+
+    void testIndexSelection()
+    {
+        using namespace Sink;
+        ResourceContext resourceContext{resourceInstanceIdentifier.toUtf8(), "dummy", AdaptorFactoryRegistry::instance().getFactories("test")};
+        Storage::EntityStore store(resourceContext, {});
+
+        store.startTransaction(Storage::DataStore::ReadWrite);
+        for (int i = 0; i < 10; i++) {
+            auto mail = ApplicationDomain::ApplicationDomainType::createEntity<ApplicationDomain::Mail>("res1");
+            mail.setFolder(QByteArray{"folder1"});
+            mail.setDraft(i == 0);
+            store.add("mail", mail, false);
+        }
+        store.commitTransaction();
+
+        //The folder index is considered first, but the draft index is more selective
+        Query query;
+        query.filter<ApplicationDomain::Mail::Folder>(QByteArray{"folder1"});
+        query.filter<ApplicationDomain::Mail::Draft>(true);
+        {
+            QSet<QByteArray> appliedFilters;
+            QByteArray appliedSorting;
+            QCOMPARE(store.indexLookup("mail", query, appliedFilters, appliedSorting).size(), 1);
+            QCOMPARE(appliedFilters, QSet<QByteArray>{ApplicationDomain::Mail::Draft::name});
+            QVERIFY(appliedSorting.isEmpty());
+        }
+
+        //Even if it doesn't provide the sorting
+        query.sort<ApplicationDomain::Mail::Date>();
+        {
+            QSet<QByteArray> appliedFilters;
+            QByteArray appliedSorting;
+            QCOMPARE(store.indexLookup("mail", query, appliedFilters, appliedSorting).size(), 1);
+            QCOMPARE(appliedFilters, QSet<QByteArray>{ApplicationDomain::Mail::Draft::name});
+        }
+
+        //The statistics are updated with every modification
+        store.startTransaction(Storage::DataStore::ReadWrite);
+        QByteArrayList uids;
+        store.readAllUids("mail", [&](const QByteArray &uid) {
+            uids << uid;
+        });
+        for (const auto &uid : uids) {
+            auto modified = ApplicationDomain::ApplicationDomainType::createEntity<ApplicationDomain::Mail>("res1", uid);
+            modified.setDraft(true);
+            store.modify("mail", modified, QByteArrayList{}, false);
+        }
+        store.commitTransaction();
+        {
+            QSet<QByteArray> appliedFilters;
+            QByteArray appliedSorting;
+            QCOMPARE(store.indexLookup("mail", query, appliedFilters, appliedSorting).size(), 10);
+            QVERIFY(appliedFilters.contains(ApplicationDomain::Mail::Folder::name));
+            QCOMPARE(appliedSorting, QByteArray{ApplicationDomain::Mail::Date::name});
+        }
+        store.abortTransaction();
+    }
+
+    void testIndexIntersection()
+    {
+        using namespace Sink;
+        ResourceContext resourceContext{resourceInstanceIdentifier.toUtf8(), "dummy", AdaptorFactoryRegistry::instance().getFactories("test")};
+        Storage::EntityStore store(resourceContext, {});
+
+        QByteArrayList expected;
+        store.startTransaction(Storage::DataStore::ReadWrite);
+        for (int i = 0; i < 10; i++) {
+            auto mail = ApplicationDomain::ApplicationDomainType::createEntity<ApplicationDomain::Mail>("res1");
+            mail.setFolder(i < 5 ? QByteArray{"folder1"} : QByteArray{"folder2"});
+            mail.setDraft(i % 2 == 0);
+            store.add("mail", mail, false);
+            if (i < 5 && i % 2 == 0) {
+                expected << mail.identifier();
+            }
+        }
+        store.commitTransaction();
+
+        store.startTransaction(Storage::DataStore::ReadOnly);
+        {
+            //Both indexes match 5 entities, but only 3 entities match both
+            Query query;
+            query.filter<ApplicationDomain::Mail::Folder>(QByteArray{"folder1"});
+            query.filter<ApplicationDomain::Mail::Draft>(true);
+            QSet<QByteArray> appliedFilters;
+            QByteArray appliedSorting;
+            const auto result = store.indexLookup("mail", query, appliedFilters, appliedSorting);
+            QCOMPARE(result.size(), 3);
+            for (const auto &uid : expected) {
+                QVERIFY(result.contains(uid));
+            }
+            QCOMPARE(appliedFilters, (QSet<QByteArray>{ApplicationDomain::Mail::Folder::name, ApplicationDomain::Mail::Draft::name}));
+        }
+
+        {
+            //The sorting of the sorted index is retained
+            Query query;
+            query.filter<ApplicationDomain::Mail::Folder>(QByteArray{"folder1"});
+            query.filter<ApplicationDomain::Mail::Draft>(true);
+            query.sort<ApplicationDomain::Mail::Date>();
+            QSet<QByteArray> appliedFilters;
+            QByteArray appliedSorting;
+            QCOMPARE(store.indexLookup("mail", query, appliedFilters, appliedSorting).size(), 3);
+            QCOMPARE(appliedSorting, QByteArray{ApplicationDomain::Mail::Date::name});
+        }
+        store.abortTransaction();
+    }
+
+    void testRangeLookup()
+    {
+        using namespace Sink;
+        ResourceContext resourceContext{resourceInstanceIdentifier.toUtf8(), "dummy", AdaptorFactoryRegistry::instance().getFactories("test")};
+        Storage::EntityStore store(resourceContext, {});
+
+        const auto date = QDateTime(QDate(2015, 7, 7), QTime(12, 0), Qt::UTC);
+        QByteArrayList uids;
+        store.startTransaction(Storage::DataStore::ReadWrite);
+        for (int i = 0; i < 10; i++) {
+            auto mail = ApplicationDomain::ApplicationDomainType::createEntity<ApplicationDomain::Mail>("res1");
+            mail.setFolder(i < 5 ? QByteArray{"folder1"} : QByteArray{"folder2"});
+            mail.setExtractedDate(date.addDays(i));
+            store.add("mail", mail, false);
+            uids << mail.identifier();
+        }
+        store.commitTransaction();
+
+        store.startTransaction(Storage::DataStore::ReadOnly);
+        {
+            //A range scan over the value index
+            Query query;
+            query.filter<ApplicationDomain::Mail::Date>(QueryBase::Comparator(QVariantList{date.addDays(2), date.addDays(4)}, QueryBase::Comparator::Within));
+            QSet<QByteArray> appliedFilters;
+            QByteArray appliedSorting;
+            const auto result = store.indexLookup("mail", query, appliedFilters, appliedSorting);
+            QCOMPARE(result, (QVector<QByteArray>{uids.at(2), uids.at(3), uids.at(4)}));
+            QCOMPARE(appliedFilters, QSet<QByteArray>{ApplicationDomain::Mail::Date::name});
+        }
+
+        {
+            //A range scan per folder over the sorted index, which returns the newest first
+            Query query;
+            query.filter<ApplicationDomain::Mail::Folder>(QByteArray{"folder1"});
+            query.filter<ApplicationDomain::Mail::Date>(QueryBase::Comparator(QVariantList{date.addDays(1), date.addDays(3)}, QueryBase::Comparator::Within));
+            query.sort<ApplicationDomain::Mail::Date>();
+            QSet<QByteArray> appliedFilters;
+            QByteArray appliedSorting;
+            const auto result = store.indexLookup("mail", query, appliedFilters, appliedSorting);
+            QCOMPARE(result, (QVector<QByteArray>{uids.at(3), uids.at(2), uids.at(1)}));
+            QCOMPARE(appliedFilters, (QSet<QByteArray>{ApplicationDomain::Mail::Folder::name, ApplicationDomain::Mail::Date::name}));
+            QCOMPARE(appliedSorting, QByteArray{ApplicationDomain::Mail::Date::name});
+        }
+        store.abortTransaction();
+    }
+
+    void testProjectedRead()
+    {
+        using namespace Sink;
+        ResourceContext resourceContext{resourceInstanceIdentifier.toUtf8(), "dummy", AdaptorFactoryRegistry::instance().getFactories("test")};
+        Storage::EntityStore store(resourceContext, {});
+
+        auto mail = ApplicationDomain::ApplicationDomainType::createEntity<ApplicationDomain::Mail>("res1");
+        mail.setExtractedMessageId("messageid");
+        mail.setExtractedSubject("subject");
+        store.startTransaction(Storage::DataStore::ReadWrite);
+        store.add("mail", mail, false);
+        store.commitTransaction();
+
+        store.startTransaction(Storage::DataStore::ReadOnly);
+        bool found = false;
+        store.readLatest("mail", mail.identifier(), QByteArrayList{ApplicationDomain::Mail::Subject::name, "nonexistent"}, [&](const ApplicationDomain::ApplicationDomainType &entity, Sink::Operation) {
+            found = true;
+            QCOMPARE(entity.availableProperties(), QByteArrayList{ApplicationDomain::Mail::Subject::name});
+            QCOMPARE(entity.getProperty(ApplicationDomain::Mail::Subject::name).toString(), QString{"subject"});
+            //Properties outside of the projection are not decoded
+            QVERIFY(!entity.getProperty(ApplicationDomain::Mail::MessageId::name).isValid());
+        });
+        QVERIFY(found);
+        store.abortTransaction();
+    }
+
+    void testBatchedCleanup()
+    {
+        using namespace Sink;
+        ResourceContext resourceContext{resourceInstanceIdentifier.toUtf8(), "dummy", AdaptorFactoryRegistry::instance().getFactories("test")};
+        Storage::EntityStore store(resourceContext, {});
+
+        auto mail = ApplicationDomain::ApplicationDomainType::createEntity<ApplicationDomain::Mail>("res1");
+        auto mail2 = ApplicationDomain::ApplicationDomainType::createEntity<ApplicationDomain::Mail>("res1");
+        store.startTransaction(Storage::DataStore::ReadWrite);
+        store.add("mail", mail, false);
+        store.add("mail", mail2, false);
+        for (int i = 0; i < 5; i++) {
+            mail.setExtractedSubject(QString::number(i));
+            store.modify("mail", mail, QByteArrayList{}, false);
+        }
+        store.remove("mail", mail2, false);
+        const auto maxRevision = store.maxRevision();
+        store.commitTransaction();
+
+        //Without a transaction every batch is committed separately
+        int batches = 0;
+        bool complete = false;
+        while (!complete) {
+            QVERIFY(store.cleanupRevisions(maxRevision, 3, &complete));
+            batches++;
+        }
+        QCOMPARE(batches, 3);
+        QVERIFY(!store.cleanupRevisions(maxRevision, 3, &complete));
+        QVERIFY(complete);
+
+        //Only the latest revision of the modified mail is left
+        store.startTransaction(Storage::DataStore::ReadOnly);
+        QCOMPARE(store.readLatest<ApplicationDomain::Mail>(mail.identifier()).getProperty(ApplicationDomain::Mail::Subject::name).toString(), QString::fromLatin1("4"));
+        QVERIFY(!store.contains("mail", mail2.identifier()));
+        store.abortTransaction();
+
+        Storage::DataStore storage(Sink::storageLocation(), resourceInstanceIdentifier);
+        auto transaction = storage.createTransaction(Storage::DataStore::ReadOnly);
+        QCOMPARE(Storage::DataStore::mainDatabase(transaction, "mail").scan("", [](const QByteArray &, const QByteArray &) { return true; }), 1);
+    }
+
+    void testMaxRevision()
+    {
+        using namespace Sink;
+        ResourceContext resourceContext{resourceInstanceIdentifier.toUtf8(), "dummy", AdaptorFactoryRegistry::instance().getFactories("test")};
+        Storage::EntityStore store(resourceContext, {});
+        const auto persistedMaxRevision = [&] {
+            Storage::DataStore storage(Sink::storageLocation(), resourceInstanceIdentifier);
+            return Storage::DataStore::maxRevision(storage.createTransaction(Storage::DataStore::ReadOnly));
+        };
+
+        store.startTransaction(Storage::DataStore::ReadWrite);
+        store.add("mail", ApplicationDomain::ApplicationDomainType::createEntity<ApplicationDomain::Mail>("res1"), false);
+        store.add("mail", ApplicationDomain::ApplicationDomainType::createEntity<ApplicationDomain::Mail>("res1"), false);
+        QCOMPARE(store.maxRevision(), qint64{2});
+        store.commitTransaction();
+        QCOMPARE(persistedMaxRevision(), qint64{2});
+
+        //An aborted transaction doesn't change the max revision
+        store.startTransaction(Storage::DataStore::ReadWrite);
+        store.add("mail", ApplicationDomain::ApplicationDomainType::createEntity<ApplicationDomain::Mail>("res1"), false);
+        QCOMPARE(store.maxRevision(), qint64{3});
+        store.abortTransaction();
+        QCOMPARE(store.maxRevision(), qint64{2});
+        store.abortTransaction();
+        QCOMPARE(persistedMaxRevision(), qint64{2});
+    }
+
+    void testEntityCache()
+    {
+        using namespace Sink;
+        ResourceContext resourceContext{resourceInstanceIdentifier.toUtf8(), "dummy", AdaptorFactoryRegistry::instance().getFactories("test")};
+        Storage::EntityStore store(resourceContext, {});
+        const auto subject = [&](const QByteArray &uid) {
+            return store.readLatest<ApplicationDomain::Mail>(uid).getProperty(ApplicationDomain::Mail::Subject::name).toString();
+        };
+
+        auto mail = ApplicationDomain::ApplicationDomainType::createEntity<ApplicationDomain::Mail>("res1");
+        mail.setExtractedSubject("subject");
+        store.startTransaction(Storage::DataStore::ReadWrite);
+        store.add("mail", mail, false);
+        //Not cached while the transaction may still be aborted
+        QCOMPARE(subject(mail.identifier()), QString::fromLatin1("subject"));
+        store.commitTransaction();
+
+        Storage::EntityStore::resetCacheStatistics();
+        QCOMPARE(subject(mail.identifier()), QString::fromLatin1("subject"));
+        store.abortTransaction();
+        {
+            //Modifying a cached entity doesn't modify the cache
+            auto cached = store.readLatest<ApplicationDomain::Mail>(mail.identifier());
+            cached.setExtractedSubject("modified");
+        }
+        QCOMPARE(subject(mail.identifier()), QString::fromLatin1("subject"));
+        store.abortTransaction();
+        QCOMPARE(Storage::EntityStore::cacheStatistics().misses, qint64{1});
+        QCOMPARE(Storage::EntityStore::cacheStatistics().hits, qint64{2});
+
+        //A new revision is read from the store again
+        store.startTransaction(Storage::DataStore::ReadWrite);
+        mail.setExtractedSubject("subject2");
+        store.modify("mail", mail, QByteArrayList{}, false);
+        QCOMPARE(subject(mail.identifier()), QString::fromLatin1("subject2"));
+        store.abortTransaction();
+        QCOMPARE(subject(mail.identifier()), QString::fromLatin1("subject"));
+        store.abortTransaction();
+
+        Storage::EntityStore::setCacheCapacity(0);
+        Storage::EntityStore::resetCacheStatistics();
+        QCOMPARE(subject(mail.identifier()), QString::fromLatin1("subject"));
+        store.abortTransaction();
+        QCOMPARE(Storage::EntityStore::cacheStatistics().hits + Storage::EntityStore::cacheStatistics().misses, qint64{0});
+        Storage::EntityStore::setCacheCapacity(1000);
+    }
+
+    void testBlobs()
+    {
+        using namespace Sink;
+        ResourceContext resourceContext{resourceInstanceIdentifier.toUtf8(), "dummy", AdaptorFactoryRegistry::instance().getFactories("test")};
+        Storage::EntityStore store(resourceContext, {});
+        const auto blobDir = QDir{Sink::blobStorageLocation(resourceInstanceIdentifier.toUtf8())};
+
+        const QByteArray mimeMessage = "Subject: blob\r\n\r\n" + QByteArray(10000, 'x');
+        auto mail = ApplicationDomain::ApplicationDomainType::createEntity<ApplicationDomain::Mail>("res1");
+        mail.setMimeMessage(mimeMessage);
+
+        //The same content is only stored once
+        auto mail2 = ApplicationDomain::ApplicationDomainType::createEntity<ApplicationDomain::Mail>("res1");
+        mail2.setMimeMessage(mimeMessage);
+
+        store.startTransaction(Storage::DataStore::ReadWrite);
+        store.add("mail", mail, false);
+        store.add("mail", mail2, false);
+        store.commitTransaction();
+        QCOMPARE(blobDir.entryList(QDir::Files).size(), 1);
+
+        {
+            const auto current = store.readLatest<ApplicationDomain::Mail>(mail.identifier());
+            QVERIFY(current.getRawProperty(ApplicationDomain::Mail::MimeMessage::name).canConvert<ApplicationDomain::BLOB>());
+            QCOMPARE(current.getMimeMessage(), mimeMessage);
+        }
+        store.abortTransaction();
+
+        //Modifying other properties only adds a reference
+        store.startTransaction(Storage::DataStore::ReadWrite);
+        {
+            auto modification = ApplicationDomain::ApplicationDomainType::createEntity<ApplicationDomain::Mail>("res1", mail.identifier());
+            modification.setUnread(true);
+            QVERIFY(store.modify("mail", modification, QByteArrayList{}, false));
+        }
+        store.remove("mail", mail2, false);
+        store.commitTransaction();
+
+        store.startTransaction(Storage::DataStore::ReadWrite);
+        store.cleanupRevisions(store.maxRevision());
+        store.commitTransaction();
+        QCOMPARE(blobDir.entryList(QDir::Files).size(), 1);
+        QCOMPARE(store.readLatest<ApplicationDomain::Mail>(mail.identifier()).getMimeMessage(), mimeMessage);
+        store.abortTransaction();
+
+        //The blob is removed with the last revision that refers to it
+        store.startTransaction(Storage::DataStore::ReadWrite);
+        store.remove("mail", store.readLatest<ApplicationDomain::Mail>(mail.identifier()), false);
+        store.commitTransaction();
+        store.startTransaction(Storage::DataStore::ReadWrite);
+        store.cleanupRevisions(store.maxRevision());
+        store.commitTransaction();
+        QCOMPARE(blobDir.entryList(QDir::Files).size(), 0);
+    }
 };
 
 QTEST_MAIN(EntityStoreTest)
@@ -6,6 +6,7 @@
 #include "store.h"
 #include "storage.h"
 #include "index.h"
+#include "synchronizerstore.h"
 
 /**
  * Test of the index implementation
@@ -55,6 +56,70 @@ private slots:
             QCOMPARE(values.size(), 3);
         }
     }
+
+    void testRemoteIdResolution()
+    {
+        Sink::Storage::DataStore store("./testindex", "sink.dummy.testindex", Sink::Storage::DataStore::ReadWrite);
+        //Enough remote ids to outgrow the initial remote id filter
+        const int count = 10000;
+        QVector<QByteArray> sinkIds;
+        {
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+            Sink::SynchronizerStore syncStore(transaction);
+            for (int i = 0; i < count; i++) {
+                bool created = false;
+                sinkIds << syncStore.resolveRemoteId("mail", "remoteId" + QByteArray::number(i), &created);
+                QVERIFY(created);
+            }
+            for (int i = 0; i < count; i++) {
+                bool created = false;
+                QCOMPARE(syncStore.resolveRemoteId("mail", "remoteId" + QByteArray::number(i), &created), sinkIds.at(i));
+                QVERIFY(!created);
+            }
+            syncStore.flush();
+            transaction.commit();
+        }
+
+        //The persisted filter still knows all remote ids
+        auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+        Sink::SynchronizerStore syncStore(transaction);
+        for (int i = 0; i < count; i++) {
+            QCOMPARE(syncStore.resolveRemoteId("mail", "remoteId" + QByteArray::number(i)), sinkIds.at(i));
+        }
+
+        syncStore.removeRemoteId("mail", sinkIds.first(), "remoteId0");
+        bool created = false;
+        QVERIFY(syncStore.resolveRemoteId("mail", "remoteId0", &created) != sinkIds.first());
+        QVERIFY(created);
+    }
+
+    void testRemoteIdFilterAcrossTransactions()
+    {
+        Sink::Storage::DataStore store("./testindex", "sink.dummy.testindex", Sink::Storage::DataStore::ReadWrite);
+        const auto filters = QSharedPointer<Sink::SynchronizerStore::RemoteIdFilters>::create();
+        const auto otherSinkId = Sink::Storage::DataStore::generateUid();
+        QByteArray sinkId;
+        {
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+            Sink::SynchronizerStore syncStore(transaction, filters);
+            sinkId = syncStore.resolveRemoteId("mail", "remoteId1");
+            syncStore.flush();
+            transaction.commit();
+        }
+        {
+            //Committed without flushing, so the stored filter lacks the remote id
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+            Sink::SynchronizerStore syncStore(transaction);
+            syncStore.recordRemoteId("mail", otherSinkId, "remoteId2");
+            transaction.commit();
+        }
+        auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+        Sink::SynchronizerStore syncStore(transaction, filters);
+        QCOMPARE(syncStore.resolveRemoteId("mail", "remoteId1"), sinkId);
+        bool created = false;
+        QCOMPARE(syncStore.resolveRemoteId("mail", "remoteId2", &created), otherSinkId);
+        QVERIFY(!created);
+    }
 };
 
 QTEST_MAIN(IndexTest)
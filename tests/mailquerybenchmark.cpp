@@ -243,6 +243,47 @@ private slots:
         HAWD::Formatter::print(dataset);
     }
 
+    void testReadTransactionPool()
+    {
+        int count = 1000;
+        int queries = 1000;
+        populateDatabase(count);
+
+        Sink::ResourceContext resourceContext{resourceIdentifier, "test", {{"mail", QSharedPointer<TestMailAdaptorFactory>::create()}}};
+        Sink::Storage::EntityStore entityStore{resourceContext, {}};
+
+        //Many small read transactions, as executed by a UI with many live queries
+        auto runQueries = [&] {
+            QTime time;
+            time.start();
+            for (int i = 0; i < queries; i++) {
+                entityStore.startTransaction(Sink::Storage::DataStore::ReadOnly);
+                int found = 0;
+                entityStore.indexLookup<Mail, Mail::Folder>(QByteArray("folder1"), [&](const QByteArray &) {
+                    found++;
+                });
+                entityStore.commitTransaction();
+                Q_ASSERT(found == count);
+            }
+            return (qreal)time.elapsed() / queries;
+        };
+
+        const auto pooledLatency = runQueries();
+        Sink::Storage::DataStore::setReadTransactionPoolSize(0);
+        const auto unpooledLatency = runQueries();
+        Sink::Storage::DataStore::setReadTransactionPoolSize(-1);
+
+        std::cout << "Query latency with transaction pool [ms]: " << pooledLatency << std::endl;
+        std::cout << "Query latency without transaction pool [ms]: " << unpooledLatency << std::endl;
+
+        HAWD::Dataset dataset("mail_query_transactionpool", mHawdState);
+        HAWD::Dataset::Row row = dataset.row();
+        row.setValue("pooled", pooledLatency);
+        row.setValue("unpooled", unpooledLatency);
+        dataset.insertRow(row);
+        HAWD::Formatter::print(dataset);
+    }
+
     void testIncremental()
     {
         Sink::Query query{Sink::Query::LiveQuery};
@@ -414,6 +414,130 @@ private slots:
         QCOMPARE(model->rowCount(), 1);
     }
 
+    void testSortedWithoutIndex()
+    {
+        // Setup
+        const auto date = QDateTime(QDate(2015, 7, 7), QTime(12, 0));
+        for (int i = 0; i < 5; i++) {
+            Mail mail("sink.dummy.instance1");
+            mail.setExtractedMessageId(QByteArray::number(i));
+            mail.setExtractedDate(date.addDays(-i));
+            VERIFYEXEC(Sink::Store::create<Mail>(mail));
+        }
+        // Ensure all local data is processed
+        VERIFYEXEC(Sink::ResourceControl::flushMessageQueue("sink.dummy.instance1"));
+
+        // Test
+        Sink::Query query;
+        query.resourceFilter("sink.dummy.instance1");
+        query.sort<Mail::Date>();
+        query.limit(2);
+
+        const auto messageIds = [](QAbstractItemModel &model) {
+            QSet<QByteArray> ids;
+            for (int i = 0; i < model.rowCount(); i++) {
+                ids << model.index(i, 0).data(Sink::Store::DomainObjectRole).value<Mail::Ptr>()->getProperty("messageId").toByteArray();
+            }
+            return ids;
+        };
+
+        // There is no sorted index without a folder filter, so the newest mails are selected in memory
+        auto model = Sink::Store::loadModel<Mail>(query);
+        QTRY_VERIFY(model->data(QModelIndex(), Sink::Store::ChildrenFetchedRole).toBool());
+        QCOMPARE(messageIds(*model), (QSet<QByteArray>{"0", "1"}));
+
+        model->fetchMore(QModelIndex());
+        QTRY_VERIFY(model->data(QModelIndex(), Sink::Store::ChildrenFetchedRole).toBool());
+        QCOMPARE(messageIds(*model), (QSet<QByteArray>{"0", "1", "2", "3"}));
+
+        model->fetchMore(QModelIndex());
+        QTRY_VERIFY(model->data(QModelIndex(), Sink::Store::ChildrenFetchedRole).toBool());
+        QCOMPARE(model->rowCount(), 5);
+    }
+
+    void testDateRange()
+    {
+        // Setup
+        const auto date = QDateTime(QDate(2015, 7, 7), QTime(12, 0));
+        for (int i = 0; i < 5; i++) {
+            Mail mail("sink.dummy.instance1");
+            mail.setExtractedMessageId(QByteArray::number(i));
+            mail.setExtractedDate(date.addDays(-i));
+            VERIFYEXEC(Sink::Store::create<Mail>(mail));
+        }
+        // Ensure all local data is processed
+        VERIFYEXEC(Sink::ResourceControl::flushMessageQueue("sink.dummy.instance1"));
+
+        const auto messageIds = [](const QList<Mail> &mails) {
+            QSet<QByteArray> ids;
+            for (const auto &mail : mails) {
+                ids << mail.getMessageId();
+            }
+            return ids;
+        };
+
+        // Test
+        {
+            Sink::Query query;
+            query.resourceFilter("sink.dummy.instance1");
+            query.filter<Mail::Date>(QueryBase::Comparator(date.addDays(-2), QueryBase::Comparator::GreaterThan));
+            QCOMPARE(messageIds(Sink::Store::read<Mail>(query)), (QSet<QByteArray>{"0", "1"}));
+        }
+        {
+            Sink::Query query;
+            query.resourceFilter("sink.dummy.instance1");
+            query.filter<Mail::Date>(QueryBase::Comparator(date.addDays(-3), QueryBase::Comparator::LessThan));
+            QCOMPARE(messageIds(Sink::Store::read<Mail>(query)), (QSet<QByteArray>{"4"}));
+        }
+        {
+            Sink::Query query;
+            query.resourceFilter("sink.dummy.instance1");
+            query.filter<Mail::Date>(QueryBase::Comparator(QVariantList{date.addDays(-3), date.addDays(-1)}, QueryBase::Comparator::Within));
+            QCOMPARE(messageIds(Sink::Store::read<Mail>(query)), (QSet<QByteArray>{"1", "2", "3"}));
+        }
+        {
+            //An open lower bound
+            Sink::Query query;
+            query.resourceFilter("sink.dummy.instance1");
+            query.filter<Mail::Date>(QueryBase::Comparator(QVariantList{QVariant{}, date.addDays(-3)}, QueryBase::Comparator::Within));
+            QCOMPARE(messageIds(Sink::Store::read<Mail>(query)), (QSet<QByteArray>{"3", "4"}));
+        }
+    }
+
+    void testRequestedPropertiesWithFilterAndSorting()
+    {
+        // Setup
+        const auto date = QDateTime(QDate(2015, 7, 7), QTime(12, 0));
+        for (int i = 0; i < 3; i++) {
+            Mail mail("sink.dummy.instance1");
+            mail.setExtractedMessageId(QByteArray::number(i));
+            mail.setExtractedSubject(QString::number(i));
+            mail.setExtractedDate(date.addDays(-i));
+            mail.setUnread(i != 1);
+            VERIFYEXEC(Sink::Store::create<Mail>(mail));
+        }
+        // Ensure all local data is processed
+        VERIFYEXEC(Sink::ResourceControl::flushMessageQueue("sink.dummy.instance1"));
+
+        // Test
+        // The filtered and sorted properties are not requested, but still available to the query
+        Sink::Query query;
+        query.resourceFilter("sink.dummy.instance1");
+        query.request<Mail::Subject>();
+        query.filter<Mail::Unread>(true);
+        query.sort<Mail::Date>();
+        auto model = Sink::Store::loadModel<Mail>(query);
+        QTRY_VERIFY(model->data(QModelIndex(), Sink::Store::ChildrenFetchedRole).toBool());
+        QCOMPARE(model->rowCount(), 2);
+        QSet<QString> subjects;
+        for (int i = 0; i < model->rowCount(); i++) {
+            const auto mail = model->index(i, 0).data(Sink::Store::DomainObjectRole).value<Mail::Ptr>();
+            subjects << mail->getSubject();
+            QVERIFY(!mail->getProperty(Mail::MessageId::name).isValid());
+        }
+        QCOMPARE(subjects, (QSet<QString>{"0", "2"}));
+    }
+
     void testMailByFolderSortedByDate()
     {
         // Setup
@@ -0,0 +1,115 @@
+#include <QtTest>
+
+#include "hawd/dataset.h"
+#include "hawd/formatter.h"
+#include "common/storage.h"
+#include "common/index.h"
+#include "common/synchronizerstore.h"
+#include "common/log.h"
+
+#include <QTime>
+
+/**
+ * Benchmark the remote id resolution of a sync.
+ *
+ * Remote ids are resolved in transactions of a fixed size like the synchronizer does, once on an empty store as in an initial sync,
+ * and once more when all of them exist. The plain index lookups that were used before the remote id filter serve as the baseline.
+ */
+class RemoteIdResolutionBenchmark : public QObject
+{
+    Q_OBJECT
+private:
+    QString testDataPath;
+    const int count = 100000;
+    const int transactionSize = 1000;
+
+    void removeStores()
+    {
+        Sink::Storage::DataStore(testDataPath, "sink.remoteidbenchmark.filter", Sink::Storage::DataStore::ReadWrite).removeFromDisk();
+        Sink::Storage::DataStore(testDataPath, "sink.remoteidbenchmark.index", Sink::Storage::DataStore::ReadWrite).removeFromDisk();
+    }
+
+    static QByteArray remoteId(int i)
+    {
+        return "remoteId" + QByteArray::number(i);
+    }
+
+    //Returns the time in ms to resolve all remote ids
+    qreal resolve(Sink::Storage::DataStore &store, const QSharedPointer<Sink::SynchronizerStore::RemoteIdFilters> &filters, int &createdCount)
+    {
+        QTime time;
+        time.start();
+        for (int i = 0; i < count; i += transactionSize) {
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+            Sink::SynchronizerStore syncStore(transaction, filters);
+            for (int j = i; j < qMin(i + transactionSize, count); j++) {
+                bool created = false;
+                syncStore.resolveRemoteId("mail", remoteId(j), &created);
+                if (created) {
+                    createdCount++;
+                }
+            }
+            syncStore.flush();
+            transaction.commit();
+        }
+        return time.elapsed();
+    }
+
+private slots:
+    void initTestCase()
+    {
+        Sink::Log::setDebugOutputLevel(Sink::Log::Warning);
+        testDataPath = "./testdb";
+        removeStores();
+    }
+
+    void cleanupTestCase()
+    {
+        removeStores();
+    }
+
+    void testResolveRemoteIds()
+    {
+        Sink::Storage::DataStore store(testDataPath, "sink.remoteidbenchmark.filter", Sink::Storage::DataStore::ReadWrite);
+        const auto filters = QSharedPointer<Sink::SynchronizerStore::RemoteIdFilters>::create();
+        int created = 0;
+        const auto resolveNewDuration = resolve(store, filters, created);
+        QCOMPARE(created, count);
+        const auto resolveExistingDuration = resolve(store, filters, created);
+        QCOMPARE(created, count);
+
+        //What resolveRemoteId did for a new remote id without the filter
+        Sink::Storage::DataStore indexStore(testDataPath, "sink.remoteidbenchmark.index", Sink::Storage::DataStore::ReadWrite);
+        QTime time;
+        time.start();
+        for (int i = 0; i < count; i += transactionSize) {
+            auto transaction = indexStore.createTransaction(Sink::Storage::DataStore::ReadWrite);
+            Index index("rid.mapping.mail", transaction);
+            Index localIdIndex("localid.mapping.mail", transaction);
+            for (int j = i; j < qMin(i + transactionSize, count); j++) {
+                if (index.lookup(remoteId(j)).isEmpty()) {
+                    const auto sinkId = Sink::Storage::DataStore::generateUid();
+                    index.add(remoteId(j), sinkId);
+                    localIdIndex.add(sinkId, remoteId(j));
+                }
+            }
+            transaction.commit();
+        }
+        const qreal indexLookupNewDuration = time.elapsed();
+
+        HAWD::Dataset dataset("remoteid_resolution", m_hawdState);
+        HAWD::Dataset::Row row = dataset.row();
+        row.setValue("rows", count);
+        row.setValue("resolveNew", count / qMax<qreal>(resolveNewDuration, 1));
+        row.setValue("resolveExisting", count / qMax<qreal>(resolveExistingDuration, 1));
+        row.setValue("indexLookupNew", count / qMax<qreal>(indexLookupNewDuration, 1));
+        dataset.insertRow(row);
+        HAWD::Formatter::print(dataset);
+    }
+
+private:
+    HAWD::State m_hawdState;
+};
+
+QTEST_MAIN(RemoteIdResolutionBenchmark)
+#include "remoteidresolutionbenchmark.moc"
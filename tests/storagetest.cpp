@@ -1,6 +1,7 @@
 #include <QtTest>
 
 #include <iostream>
+#include <vector>
 
 #include <QDebug>
 #include <QString>
@@ -58,21 +59,45 @@ private:
         return success && keyMatch;
     }
 
+    bool usesMemoryBackend()
+    {
+        QFETCH_GLOBAL(bool, memoryBackend);
+        return memoryBackend;
+    }
+
 private slots:
+    void initTestCase_data()
+    {
+        //Every test runs against both backends
+        QTest::addColumn<bool>("memoryBackend");
+        QTest::newRow("lmdb") << false;
+        QTest::newRow("memory") << true;
+    }
+
     void initTestCase()
     {
         testDataPath = "./testdb";
         dbName = "test";
-        Sink::Storage::DataStore storage(testDataPath, dbName);
+        Sink::Storage::DataStore storage(testDataPath, dbName, Sink::Storage::DataStore::ReadOnly, Sink::Storage::DataStore::LmdbBackend);
         storage.removeFromDisk();
     }
 
+    void init()
+    {
+        Sink::Storage::DataStore::setDefaultBackend(usesMemoryBackend() ? Sink::Storage::DataStore::MemoryBackend : Sink::Storage::DataStore::LmdbBackend);
+    }
+
     void cleanup()
     {
         Sink::Storage::DataStore storage(testDataPath, dbName);
         storage.removeFromDisk();
     }
 
+    void cleanupTestCase()
+    {
+        Sink::Storage::DataStore::setDefaultBackend(Sink::Storage::DataStore::LmdbBackend);
+    }
+
     void testCleanup()
     {
         populate(1);
@@ -136,6 +161,83 @@ private slots:
         }
     }
 
+    void testScanSlices()
+    {
+        populate(100);
+
+        Sink::Storage::DataStore store(testDataPath, dbName);
+        auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadOnly);
+        int hit = 0;
+        int total = 0;
+        transaction.openDatabase()
+            .scan("", [&](const Sink::Storage::Slice &key, const Sink::Storage::Slice &value) -> bool {
+                if (key == "key50" && value == "key50") {
+                    hit++;
+                }
+                total++;
+                return true;
+            });
+        QCOMPARE(hit, 1);
+        QCOMPARE(total, 100);
+
+        QByteArray latest;
+        transaction.openDatabase().findLatest("key5", [&](const Sink::Storage::Slice &key, const Sink::Storage::Slice &value) {
+            latest = value.toByteArray();
+        });
+        QCOMPARE(latest, QByteArray("key59"));
+    }
+
+    void testCursor()
+    {
+        populate(100);
+
+        Sink::Storage::DataStore store(testDataPath, dbName);
+        auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadOnly);
+        auto db = transaction.openDatabase();
+        {
+            //Iterate over key1, key10-key19 and stop at the bound
+            auto cursor = db.createCursor("key2");
+            QVERIFY(cursor.seek("key1"));
+            QCOMPARE(cursor.key().toByteArray(), QByteArray("key1"));
+            int count = 1;
+            QByteArray last;
+            while (cursor.next()) {
+                last = cursor.key().toByteArray();
+                count++;
+            }
+            QCOMPARE(count, 11);
+            QCOMPARE(last, QByteArray("key19"));
+            QVERIFY(!cursor.isValid());
+
+            QVERIFY(cursor.seekLast());
+            QCOMPARE(cursor.key().toByteArray(), QByteArray("key19"));
+            QVERIFY(cursor.prev());
+            QCOMPARE(cursor.key().toByteArray(), QByteArray("key18"));
+            QCOMPARE(cursor.value().toByteArray(), QByteArray("key18"));
+        }
+        {
+            //Without bound we reach the end of the database, internal keys are skipped
+            auto cursor = db.createCursor();
+            int count = 0;
+            for (cursor.seek(); cursor.isValid(); cursor.next()) {
+                count++;
+            }
+            QCOMPARE(count, 100);
+            QVERIFY(cursor.seekLast());
+            QCOMPARE(cursor.key().toByteArray(), QByteArray("key99"));
+        }
+        {
+            //Seeking past the bound results in an invalid cursor
+            auto cursor = db.createCursor("key2");
+            QVERIFY(!cursor.seek("key3"));
+        }
+        {
+            auto cursor = transaction.openDatabase("nonexisting").createCursor();
+            QVERIFY(!cursor.seek());
+            QVERIFY(!cursor.next());
+        }
+    }
+
     void testNestedOperations()
     {
         populate(3);
@@ -438,6 +540,31 @@ private slots:
         QCOMPARE(Sink::Storage::DataStore::getUidFromRevision(transaction, 1), QByteArray("uid"));
     }
 
+    void testIntegerKeySorting()
+    {
+        Sink::Storage::DataStore store(testDataPath, dbName, Sink::Storage::DataStore::ReadWrite);
+        auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+        auto db = transaction.openDatabase("testIntegerKeys", {}, Sink::Storage::DataStore::IntegerKeys);
+        for (const size_t revision : {10, 6, 256, 1}) {
+            db.write(Sink::Storage::DataStore::sizeTToByteArray(revision), QByteArray::number(revision));
+        }
+        QList<size_t> keys;
+        db.scan("", [&](const QByteArray &key, const QByteArray &value) {
+            keys << Sink::Storage::DataStore::byteArrayToSizeT(key);
+            return true;
+        });
+        QCOMPARE(keys, (QList<size_t>{1, 6, 10, 256}));
+    }
+
+    void testMaxRevision()
+    {
+        Sink::Storage::DataStore store(testDataPath, dbName, Sink::Storage::DataStore::ReadWrite);
+        auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+        QCOMPARE(Sink::Storage::DataStore::maxRevision(transaction), qint64(0));
+        Sink::Storage::DataStore::setMaxRevision(transaction, 1000000);
+        QCOMPARE(Sink::Storage::DataStore::maxRevision(transaction), qint64(1000000));
+    }
+
     void testRecordRevisionSorting()
     {
         Sink::Storage::DataStore store(testDataPath, dbName, Sink::Storage::DataStore::ReadWrite);
@@ -448,10 +575,31 @@ private slots:
         //Ensure we can sort 1 and 10 properly (by default string comparison 10 comes before 6)
         db.write(Sink::Storage::DataStore::assembleKey(uid, 6), "value1");
         db.write(Sink::Storage::DataStore::assembleKey(uid, 10), "value2");
-        db.findLatest(uid, [&](const QByteArray &key, const QByteArray &value) { result = value; });
+        db.findLatest(Sink::Storage::DataStore::keyPrefix(uid), [&](const QByteArray &key, const QByteArray &value) { result = value; });
         QCOMPARE(result, QByteArray("value2"));
     }
 
+    void testKeyFormat()
+    {
+        const QByteArray uid = "{c5d06a9f-1534-4c52-b8ea-415db68bdadf}";
+        const auto key = Sink::Storage::DataStore::assembleKey(uid, 300);
+        QCOMPARE(key.size(), 24);
+        QVERIFY(key.startsWith(Sink::Storage::DataStore::keyPrefix(uid)));
+        QCOMPARE(Sink::Storage::DataStore::uidFromKey(key), uid);
+        QCOMPARE(Sink::Storage::DataStore::revisionFromKey(key), qint64(300));
+        QVERIFY(!Sink::Storage::DataStore::isLegacyKey(key));
+
+        const auto legacyKey = uid + QByteArray::number(300).rightJustified(19, '0', false);
+        QVERIFY(Sink::Storage::DataStore::isLegacyKey(legacyKey));
+        QCOMPARE(Sink::Storage::DataStore::uidFromKey(legacyKey), uid);
+        QCOMPARE(Sink::Storage::DataStore::revisionFromKey(legacyKey), qint64(300));
+
+        //Anything but a uuid must not turn into the null uuid
+        QVERIFY(Sink::Storage::DataStore::keyPrefix("foo").isEmpty());
+        QVERIFY(Sink::Storage::DataStore::keyPrefix(QByteArray(38, 'x')).isEmpty());
+        QVERIFY(Sink::Storage::DataStore::assembleKey("foo", 1).isEmpty());
+    }
+
     void testTransactionVisibility()
     {
         auto readValue = [](const Sink::Storage::DataStore::NamedDatabase &db, const QByteArray) {
@@ -487,6 +635,290 @@ private slots:
         }
     }
 
+    void testReopenDatabase()
+    {
+        Sink::Storage::DataStore store(testDataPath, dbName, Sink::Storage::DataStore::ReadWrite);
+        auto countValues = [](const Sink::Storage::DataStore::NamedDatabase &db) {
+            return db.scan("key1", [&](const QByteArray &, const QByteArray &) {
+                return true;
+            });
+        };
+        {
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+            //The second open is served from the handles of the transaction
+            transaction.openDatabase("testReopenDatabase", nullptr, Sink::Storage::DataStore::AllowDuplicates).write("key1", "value1");
+            transaction.openDatabase("testReopenDatabase", nullptr, Sink::Storage::DataStore::AllowDuplicates).write("key1", "value2");
+            QCOMPARE(countValues(transaction.openDatabase("testReopenDatabase", nullptr, Sink::Storage::DataStore::AllowDuplicates)), 2);
+            transaction.commit();
+        }
+        {
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadOnly);
+            QCOMPARE(countValues(transaction.openDatabase("testReopenDatabase", nullptr, Sink::Storage::DataStore::AllowDuplicates)), 2);
+            QCOMPARE(countValues(transaction.openDatabase("testReopenDatabase", nullptr, Sink::Storage::DataStore::AllowDuplicates)), 2);
+        }
+    }
+
+    void testMapGrowth()
+    {
+        if (usesMemoryBackend()) {
+            QSKIP("There is no map to grow in memory");
+        }
+        //Start with a tiny map so we have to grow it several times
+        Sink::Storage::DataStore::setMapSizeLimits(1024 * 1024, 256 * 1024 * 1024);
+        const QByteArray value(4096, 'x');
+        bool gotError = false;
+        auto errorHandler = [&](const Sink::Storage::DataStore::Error &error) {
+            qWarning() << error.message;
+            gotError = true;
+        };
+        {
+            Sink::Storage::DataStore store(testDataPath, dbName, Sink::Storage::DataStore::ReadWrite);
+            //The map is grown before each transaction, so every transaction can use at least half of it
+            for (int t = 0; t < 200; t++) {
+                auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+                for (int i = 0; i < 20; i++) {
+                    transaction.openDatabase("growth").write("key" + QByteArray::number(t * 20 + i), value, errorHandler);
+                }
+                QVERIFY(transaction.commit(errorHandler));
+            }
+            QVERIFY(!gotError);
+
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadOnly);
+            int count = transaction.openDatabase("growth").scan("", [&](const Sink::Storage::Slice &, const Sink::Storage::Slice &v) {
+                return v == value;
+            });
+            QCOMPARE(count, 4000);
+            const auto stat = transaction.stat(false);
+            QVERIFY(stat.totalPages * stat.pageSize > 16 * 1024 * 1024);
+        }
+        Sink::Storage::DataStore(testDataPath, dbName).removeFromDisk();
+
+        //A single transaction that needs to grow the map from 1MB to 16MB, using a database handle that is held across the growth
+        {
+            Sink::Storage::DataStore store(testDataPath, dbName, Sink::Storage::DataStore::ReadWrite);
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+            auto db = transaction.openDatabase("growth");
+            for (int i = 0; i < 2000; i++) {
+                QVERIFY(db.write("key" + QByteArray::number(i), value, errorHandler));
+            }
+            QVERIFY(transaction.commit(errorHandler));
+            QVERIFY(!gotError);
+
+            auto readTransaction = store.createTransaction(Sink::Storage::DataStore::ReadOnly);
+            int count = readTransaction.openDatabase("growth").scan("", [&](const Sink::Storage::Slice &, const Sink::Storage::Slice &v) {
+                return v == value;
+            });
+            QCOMPARE(count, 2000);
+        }
+        Sink::Storage::DataStore(testDataPath, dbName).removeFromDisk();
+
+        //We can't grow beyond the maximum size
+        Sink::Storage::DataStore::setMapSizeLimits(1024 * 1024, 2 * 1024 * 1024);
+        {
+            Sink::Storage::DataStore store(testDataPath, dbName, Sink::Storage::DataStore::ReadWrite);
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+            bool success = true;
+            for (int i = 0; i < 1000 && success; i++) {
+                success = transaction.openDatabase("growth").write("key" + QByteArray::number(i), value, [](const Sink::Storage::DataStore::Error &) {});
+            }
+            QVERIFY(!success);
+            transaction.abort();
+        }
+        Sink::Storage::DataStore::setMapSizeLimits(0, 0);
+    }
+
+    void testCompaction()
+    {
+        if (usesMemoryBackend()) {
+            QSKIP("There are no free pages to get rid of in memory");
+        }
+        const QByteArray value(4096, 'x');
+        Sink::Storage::DataStore store(testDataPath, dbName, Sink::Storage::DataStore::ReadWrite);
+        {
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+            auto db = transaction.openDatabase("compaction");
+            for (int i = 0; i < 2000; i++) {
+                db.write("key" + QByteArray::number(i), value);
+            }
+            transaction.commit();
+        }
+        {
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+            auto db = transaction.openDatabase("compaction");
+            for (int i = 100; i < 2000; i++) {
+                db.remove("key" + QByteArray::number(i));
+            }
+            transaction.commit();
+        }
+        const auto sizeBefore = store.diskUsage();
+        QVERIFY(store.compact());
+        QVERIFY(store.diskUsage() < sizeBefore / 2);
+
+        //The reopened environment contains the remaining data
+        auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadOnly);
+        int count = transaction.openDatabase("compaction").scan("", [&](const Sink::Storage::Slice &, const Sink::Storage::Slice &v) {
+            return v == value;
+        });
+        QCOMPARE(count, 100);
+    }
+
+    void testDurability()
+    {
+        if (usesMemoryBackend()) {
+            QSKIP("There is nothing to sync in memory");
+        }
+        for (const auto durability : {Sink::Storage::DataStore::Relaxed, Sink::Storage::DataStore::Group, Sink::Storage::DataStore::Strict}) {
+            Sink::Storage::DataStore::setDurability(testDataPath, dbName, durability);
+            Sink::Storage::DataStore store(testDataPath, dbName, Sink::Storage::DataStore::ReadWrite);
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+            transaction.openDatabase("durability").write("key" + QByteArray::number(durability), "value");
+            QVERIFY(transaction.commit());
+            QVERIFY(Sink::Storage::DataStore::syncToDisk(testDataPath, dbName));
+        }
+        QCOMPARE(Sink::Storage::DataStore(testDataPath, dbName).createTransaction(Sink::Storage::DataStore::ReadOnly).openDatabase("durability").scan("", [](const Sink::Storage::Slice &, const Sink::Storage::Slice &) {
+            return true;
+        }), 3);
+        //Environments that are not open can't be synced
+        QVERIFY(!Sink::Storage::DataStore::syncToDisk(testDataPath, "nonexisting"));
+    }
+
+    void testReadTransactionPool()
+    {
+        Sink::Storage::DataStore store(testDataPath, dbName, Sink::Storage::DataStore::ReadWrite);
+        auto readValue = [&]() {
+            QByteArray result;
+            //Committing a read transaction returns it to the pool, just like aborting it
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadOnly);
+            transaction.openDatabase("pool").scan("key", [&](const QByteArray &, const QByteArray &value) {
+                result = value;
+                return false;
+            });
+            if (!transaction.commit()) {
+                return QByteArray{};
+            }
+            return result;
+        };
+        for (int i = 0; i < 10; i++) {
+            {
+                auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+                transaction.openDatabase("pool").write("key", QByteArray::number(i));
+                transaction.commit();
+            }
+            //A renewed transaction sees the latest snapshot
+            QCOMPARE(readValue(), QByteArray::number(i));
+        }
+
+        //Concurrent read transactions beyond the pool size
+        {
+            std::vector<Sink::Storage::DataStore::Transaction> transactions;
+            for (int i = 0; i < 10; i++) {
+                transactions.push_back(store.createTransaction(Sink::Storage::DataStore::ReadOnly));
+                QVERIFY(transactions.back());
+            }
+        }
+        QCOMPARE(readValue(), QByteArray::number(9));
+
+        Sink::Storage::DataStore::setReadTransactionPoolSize(0);
+        QCOMPARE(readValue(), QByteArray::number(9));
+        Sink::Storage::DataStore::setReadTransactionPoolSize(-1);
+    }
+
+    void testStatistics()
+    {
+        if (usesMemoryBackend()) {
+            QSKIP("The memory backend collects no statistics");
+        }
+        Sink::Storage::DataStore::resetStatistics();
+        Sink::Storage::DataStore store(testDataPath, dbName, Sink::Storage::DataStore::ReadWrite);
+        {
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+            auto db = transaction.openDatabase("statistics");
+            for (int i = 0; i < 10; i++) {
+                db.write("key" + QByteArray::number(i), "value");
+            }
+            db.remove("key0");
+            QVERIFY(transaction.commit());
+        }
+        {
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadOnly);
+            auto db = transaction.openDatabase("statistics");
+            QCOMPARE(db.scan("key", [](const QByteArray &, const QByteArray &) { return true; }, {}, true), 9);
+            db.findLatest("key5", [](const QByteArray &, const QByteArray &) {});
+        }
+        const auto environment = Sink::Storage::DataStore::statistics().value(dbName);
+        QCOMPARE(environment.commits, qint64(1));
+        QCOMPARE(environment.commitLatencyHistogram.size(), 6);
+        qint64 bucketed = 0;
+        for (const auto count : environment.commitLatencyHistogram) {
+            bucketed += count;
+        }
+        QCOMPARE(bucketed, qint64(1));
+
+        const auto db = environment.databases.value("statistics");
+        QCOMPARE(db.writes, qint64(10));
+        QCOMPARE(db.removes, qint64(1));
+        QCOMPARE(db.scans, qint64(1));
+        QCOMPARE(db.findLatest, qint64(1));
+        QCOMPARE(db.rowsVisited, qint64(10));
+        QCOMPARE(db.bytesWritten, qint64(10 * (4 + 5)));
+        QCOMPARE(db.bytesRead, qint64(10 * (4 + 5)));
+    }
+
+    void testCompression()
+    {
+        const QByteArray compressible = QByteArray(4096, 'a') + "end";
+        const QByteArray small = "value";
+        //Looks like a codec header, so it has to be stored with a header
+        const QByteArray headerLike = QByteArray("\x01sc\xFF", 4) + "1234";
+        const QByteArray legacy = QByteArray(512, 'b');
+
+        Sink::Storage::DataStore store(testDataPath, dbName, Sink::Storage::DataStore::ReadWrite);
+        {
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+            auto db = transaction.openDatabase("compressed", {}, Sink::Storage::DataStore::Compressed);
+            QVERIFY(db.write("compressible", compressible));
+            QVERIFY(db.write("small", small));
+            QVERIFY(db.write("headerLike", headerLike));
+            //The codec is recorded with the database, so it applies without the flag as well
+            QVERIFY(transaction.openDatabase("compressed").write("legacy", legacy));
+            QVERIFY(transaction.commit());
+        }
+        {
+            auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadOnly);
+            auto raw = transaction.openDatabase("compressed");
+            QHash<QByteArray, QByteArray> rawValues;
+            raw.scan("", [&](const QByteArray &key, const QByteArray &value) {
+                rawValues.insert(key, QByteArray(value.constData(), value.size()));
+                return true;
+            });
+            QCOMPARE(rawValues.value("compressible"), compressible);
+            QCOMPARE(rawValues.value("headerLike"), headerLike);
+            //The uncompressed value wouldn't fit on a page
+            QCOMPARE(raw.stat().overflowPages, size_t(0));
+
+            auto db = transaction.openDatabase("compressed", {}, Sink::Storage::DataStore::Compressed);
+            QHash<QByteArray, QByteArray> values;
+            QCOMPARE(db.scan("", [&](const QByteArray &key, const QByteArray &value) {
+                values.insert(key, QByteArray(value.constData(), value.size()));
+                return true;
+            }), 4);
+            QCOMPARE(values.value("compressible"), compressible);
+            QCOMPARE(values.value("small"), small);
+            QCOMPARE(values.value("headerLike"), headerLike);
+            QCOMPARE(values.value("legacy"), legacy);
+
+            QByteArray latest;
+            db.findLatest("compressible", [&](const QByteArray &, const QByteArray &value) {
+                latest = QByteArray(value.constData(), value.size());
+            });
+            QCOMPARE(latest, compressible);
+
+            auto cursor = db.createCursor();
+            QVERIFY(cursor.seek("compressible"));
+            QVERIFY(cursor.value() == compressible);
+        }
+    }
+
     void testCopyTransaction()
     {
         Sink::Storage::DataStore store(testDataPath, dbName, Sink::Storage::DataStore::ReadWrite);
@@ -571,6 +1003,73 @@ private slots:
             QCOMPARE(uids, expected);
         }
     }
+
+    void testResumableUidScan()
+    {
+        Sink::Storage::DataStore store(testDataPath, dbName, Sink::Storage::DataStore::ReadWrite);
+        auto transaction = store.createTransaction(Sink::Storage::DataStore::ReadWrite);
+        for (int i = 0; i < 5; i++) {
+            Sink::Storage::DataStore::recordUid(transaction, "uid" + QByteArray::number(i), "type");
+        }
+        Sink::Storage::DataStore::recordUid(transaction, "uid", "type2");
+
+        QCOMPARE(Sink::Storage::DataStore::getUids("type", transaction, {}, 2), (QVector<QByteArray>{"uid0", "uid1"}));
+        QCOMPARE(Sink::Storage::DataStore::getUids("type", transaction, "uid1", 2), (QVector<QByteArray>{"uid2", "uid3"}));
+        //The last uid doesn't have to exist anymore
+        Sink::Storage::DataStore::removeUid(transaction, "uid3", "type");
+        QCOMPARE(Sink::Storage::DataStore::getUids("type", transaction, "uid3", 2), (QVector<QByteArray>{"uid4"}));
+        QVERIFY(Sink::Storage::DataStore::getUids("type", transaction, "uid4", 2).isEmpty());
+    }
+
+    void testMemoryBackend()
+    {
+        using Sink::Storage::DataStore;
+        const auto noError = [](const DataStore::Error &error) { QFAIL(error.message.constData()); };
+        DataStore store(testDataPath, dbName, DataStore::ReadWrite, DataStore::MemoryBackend);
+        QVERIFY(store.exists());
+        {
+            auto transaction = store.createTransaction(DataStore::ReadWrite);
+            auto db = transaction.openDatabase("main");
+            db.write("key1", "value1");
+            db.write("key2", "value2");
+            db.write("key2", "value3");
+            auto dups = transaction.openDatabase("dups", noError, DataStore::AllowDuplicates);
+            dups.write("key", "value2");
+            dups.write("key", "value1");
+            dups.write("key2", "value3");
+            transaction.commit();
+        }
+        //Nothing ends up on disk
+        QVERIFY(!QFileInfo(testDataPath + "/" + dbName).exists());
+
+        //Uncommitted changes are not visible to readers
+        auto writeTransaction = store.createTransaction(DataStore::ReadWrite);
+        writeTransaction.openDatabase("main").write("key3", "value");
+
+        auto transaction = store.createTransaction(DataStore::ReadOnly);
+        auto db = transaction.openDatabase("main");
+        QByteArray result;
+        QCOMPARE(db.scan("key2", [&](const QByteArray &, const QByteArray &value) { result = value; return true; }, noError), 1);
+        QCOMPARE(result, QByteArray("value3"));
+        QCOMPARE(db.scan("key", [&](const QByteArray &, const QByteArray &) { return true; }, noError, true), 2);
+        bool notFound = false;
+        db.scan("key3", [&](const QByteArray &, const QByteArray &) { return true; }, [&](const DataStore::Error &error) { notFound = error.code == DataStore::NotFound; });
+        QVERIFY(notFound);
+        writeTransaction.abort();
+
+        //Duplicates are sorted by value
+        QByteArrayList values;
+        transaction.openDatabase("dups", noError, DataStore::AllowDuplicates).scan("key", [&](const QByteArray &, const QByteArray &value) { values << value; return true; }, noError);
+        QCOMPARE(values, (QByteArrayList{"value1", "value2"}));
+
+        db.findLatest("key", [&](const QByteArray &key, const QByteArray &) { result = key; }, noError);
+        QCOMPARE(result, QByteArray("key2"));
+        QVERIFY(!transaction.openDatabase("nonexisting").scan("", [&](const QByteArray &, const QByteArray &) { return true; }, noError));
+        transaction.abort();
+
+        store.removeFromDisk();
+        QVERIFY(!DataStore(testDataPath, dbName, DataStore::ReadOnly, DataStore::MemoryBackend).exists());
+    }
 };
 
 QTEST_MAIN(StorageTest)